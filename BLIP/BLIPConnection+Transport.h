@@ -18,6 +18,12 @@
 - (instancetype) initWithTransportQueue: (dispatch_queue_t)transportQueue
                                  isOpen: (BOOL)isOpen;
 
+/** Subclass should set this to YES, before the transport opens, if the peer has agreed (e.g.
+    during the transport's handshake) to the BLIP protocol extensions: frames larger than 64KB,
+    cancel notices, and flow-control acks.
+    Older peers don't understand these, so they're only used when this is YES. */
+@property BOOL peerSupportsExtensions;
+
 // This is settable.
 @property (readwrite) NSError* error;
 
@@ -46,6 +52,28 @@
 /** Subclass must implement this to send the frame to the peer. */
 - (void) sendFrame: (NSData*)frame;
 
+/** Subclass may override this to supply a reusable buffer that an outgoing frame of up to `size`
+    bytes will be written into, starting at offset *outHeadroom. The frame is then sent by calling
+    -sendFrameInBuffer:length: instead of -sendFrame:. This is called on an arbitrary thread.
+    The default implementation returns nil. */
+- (NSMutableData*) transportBufferWithCapacity: (NSUInteger)size headroom: (NSUInteger*)outHeadroom;
+
+/** Sends a frame that was written into a buffer from -transportBufferWithCapacity:headroom:.
+    Subclass must implement this if it overrides that method. */
+- (void) sendFrameInBuffer: (NSMutableData*)buffer length: (NSUInteger)length;
+
+/** Subclass should override this to return the number of bytes of frames that have been sent
+    but not yet written to the network. It's used to measure throughput, to pick frame sizes,
+    and to decide how far ahead of the transport to generate frames.
+    The default implementation returns 0. */
+- (NSUInteger) transportQueuedBytes;
+
+/** Runs the block synchronously on the transport queue; the public API uses this where it has to
+    wait for a result. Subclass should override this if the transport queue might target a queue
+    that its callers could already be running on, where dispatch_sync would deadlock.
+    The default implementation calls dispatch_sync. */
+- (void) syncOnTransportQueue: (dispatch_block_t)block;
+
 // Abstract public methods that that subclasses must implement:
 // - (BOOL) connect: (NSError**)outError;
 // - (void) close;
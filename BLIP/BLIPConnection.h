@@ -32,6 +32,25 @@
 /** If set to YES, an incoming message will be dispatched to the delegate and/or dispatcher before it's complete, as soon as its properties are available. The application should then set a dataDelegate on the message to receive its data a frame at a time. */
 @property BOOL dispatchPartialMessages;
 
+/** Incoming message bodies longer than this many bytes are written to a temporary file as they
+    arrive, instead of accumulating in memory; the completed message's body is then a memory-mapped
+    view of the file. Doesn't apply to messages that have an onDataReceived block.
+    Defaults to 0, meaning bodies are always kept in memory. */
+@property NSUInteger bodySpillThreshold;
+
+/** Maximum size of an incoming message body, after decompression. If a message's body grows
+    larger (say, a small compressed body that inflates hugely), it fails and the connection is
+    closed. Defaults to 0, meaning no limit. */
+@property UInt64 maxBodySize;
+
+/** The default time, in seconds, to wait for the response to a request before failing it with a
+    kBLIPError_Timeout error (see BLIPRequest.timeout.) The clock starts once the request has been
+    completely sent, and restarts whenever a frame of the response arrives, so a large response
+    that's still streaming in won't time out. Defaults to 0, meaning no timeout, since some
+    requests (long polls, change feeds) legitimately wait a long time for their responses; a
+    response that never arrives then stays in memory until the connection closes. */
+@property NSTimeInterval requestTimeout;
+
 /** Creates a new, empty outgoing request.
     You should add properties and/or body data to the request, before sending it by
     calling its -send method. */
@@ -51,9 +70,22 @@
     The request's matching response object will be returned, or nil if the request couldn't be sent. */
 - (BLIPResponse*) sendRequest: (BLIPRequest*)request;
 
+/** The default zlib compression level (1-9) for outgoing messages that are compressed.
+    Compressed messages are compressed a frame at a time as they're sent, off the delegate queue.
+    Defaults to kBLIPDefaultCompressionLevel. */
+@property int compressionLevel;
+
 /** Are any messages currently being sent or received? (Observable) */
 @property (readonly) BOOL active;
 
+/** The number of outgoing messages of the given priority waiting to send (more of) their data. */
+- (NSUInteger) outgoingMessageCountForPriority: (BLIPPriority)priority;
+
+/** A measure of how busy the connection is: the number of outgoing messages that haven't been
+    completely sent, plus the number of requests awaiting responses. It's updated as messages are
+    queued and finished, and can be read cheaply from any thread, but may be slightly stale. */
+@property (readonly) NSUInteger load;
+
 @end
 
 
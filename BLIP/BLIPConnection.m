@@ -17,14 +17,49 @@
 #import "BLIPConnection+Transport.h"
 #import "BLIPRequest.h"
 #import "BLIP_Internal.h"
+#import "BLIPOutbox.h"
+#import "BLIPMessageTable.h"
 
 #import "ExceptionUtils.h"
 #import "Logging.h"
 #import "Test.h"
 #import "MYData.h"
+#import "DDData.h"
 
 
+// Frame sizes are adjusted to take about kTargetFrameTime to transmit, within these limits.
+// Frames are kept to kDefaultFrameSize when a higher-priority message is waiting to send.
 #define kDefaultFrameSize 4096
+#define kMaxFrameSize (512*1024)
+#define kTargetFrameTime 0.010
+
+// Max frame size with peers that don't support the protocol extensions. Larger WebSocket messages
+// need a 64-bit length, which older implementations reject.
+#define kMaxLegacyFrameSize 0xFFFF
+
+// Minimum interval over which throughput is measured
+#define kThroughputSampleInterval 0.050
+
+// Max number of frames generated at once by -feedTransport
+#define kMaxFramesPerBatch 8
+
+// Max total size of the frames one message generates in a batch, when it's allowed several
+#define kMaxBytesPerBatch (256*1024)
+
+// Max length of a frame's header (message number and flags, as varints)
+#define kMaxFrameHeaderSize 7
+
+// Max number of batches being generated and sent at once
+#define kMaxBatchesInFlight 2
+
+// Batches keep being generated ahead of the transport until it has this many bytes queued
+#define kPipelineTargetBytes (256*1024)
+
+// Granularity of request timeouts
+#define kDeadlineResolution 0.25
+
+// How long to wait before polling a message whose body stream had no data available
+#define kStalledStreamRetryInterval 0.050
 
 
 @interface BLIPConnection ()
@@ -40,15 +75,35 @@
     __weak id<BLIPConnectionDelegate> _delegate;
     dispatch_queue_t _delegateQueue;
     
-    NSMutableArray *_outBox;
+    BLIPOutbox *_outBox;
     UInt32 _numRequestsSent;
 
     UInt32 _numRequestsReceived;
-    NSMutableDictionary *_pendingRequests, *_pendingResponses;
+    BLIPMessageTable *_pendingRequests, *_pendingResponses;
+    BLIPMessageTable *_outgoingRequests;    // My requests that are being sent
+    BLIPMessageTable *_outgoingResponses;   // My responses that are being sent
+    NSMapTable *_unansweredRequests;        // Incoming requests (weak) whose responses aren't sent
+    NSMutableIndexSet *_cancelledRequests;  // Numbers of those the peer has since cancelled
+    NSMutableSet *_blockedMessages;         // Messages waiting for the peer to ack more data
+    volatile NSUInteger _load;              // Value of the `load` property
+    BLIPDeadlineWheel *_responseDeadlines;
     NSUInteger _poppedMessageCount;
+    NSUInteger _stalledMessageCount;    // Messages waiting for their body streams to have data
+    dispatch_queue_t _encoderQueue;     // Outgoing frames are generated on this queue (created lazily)
+    NSUInteger _batchesInFlight;        // Batches of frames being generated on _encoderQueue
+    BOOL _feedPending;                  // Transport asked for more while batches were maxed out
+    NSUInteger _frameSize;              // Current max frame size, when nothing's more urgent
+    BOOL _peerSupportsExtensions;       // Peer understands the BLIP protocol extensions
+    double _throughput;                 // Measured transport throughput (bytes/sec), or 0
+    CFAbsoluteTime _sampleTime;         // Start time of current throughput sample
+    NSUInteger _sampleQueuedBytes;      // transportQueuedBytes at _sampleTime
+    NSUInteger _sampleBytesSent;        // Frame bytes sent since _sampleTime
 }
 
-@synthesize error=_error, dispatchPartialMessages=_dispatchPartialMessages, active=_active;
+@synthesize error=_error, dispatchPartialMessages=_dispatchPartialMessages, active=_active,
+            compressionLevel=_compressionLevel, bodySpillThreshold=_bodySpillThreshold,
+            maxBodySize=_maxBodySize, requestTimeout=_requestTimeout,
+            peerSupportsExtensions=_peerSupportsExtensions;
 
 
 - (instancetype) initWithTransportQueue: (dispatch_queue_t)transportQueue
@@ -60,8 +115,22 @@
         _transportQueue = transportQueue;
         _transportIsOpen = isOpen;
         _delegateQueue = dispatch_get_main_queue();
-        _pendingRequests = [[NSMutableDictionary alloc] init];
-        _pendingResponses = [[NSMutableDictionary alloc] init];
+        _pendingRequests = [[BLIPMessageTable alloc] init];
+        _pendingResponses = [[BLIPMessageTable alloc] init];
+        _outgoingRequests = [[BLIPMessageTable alloc] init];
+        _outgoingResponses = [[BLIPMessageTable alloc] init];
+        _unansweredRequests = [NSMapTable strongToWeakObjectsMapTable];
+        _cancelledRequests = [[NSMutableIndexSet alloc] init];
+        _blockedMessages = [[NSMutableSet alloc] init];
+        __weak BLIPConnection* weakSelf = self;
+        _responseDeadlines = [[BLIPDeadlineWheel alloc] initWithQueue: _transportQueue
+                                                           resolution: kDeadlineResolution
+                                                            onExpired: ^(UInt32 number) {
+            [weakSelf _responseTimedOut: number];
+        }];
+        _outBox = [[BLIPOutbox alloc] init];
+        _frameSize = 4 * kDefaultFrameSize;
+        _compressionLevel = kBLIPDefaultCompressionLevel;
     }
     return self;
 }
@@ -94,8 +163,9 @@
 
 
 - (void) updateActive {
-    BOOL active = _outBox.count || _pendingRequests.count ||
-                    _pendingResponses.count || _poppedMessageCount;
+    _load = _outBox.count + _poppedMessageCount + _stalledMessageCount + _blockedMessages.count
+          + _pendingResponses.count;
+    BOOL active = _load || _pendingRequests.count;
     if (active != _active) {
         LogTo(BLIPVerbose, @"%@ active = %@", self, (active ?@"YES" : @"NO"));
         self.active = active;
@@ -190,34 +260,13 @@
 
 
 - (void) _queueMessage: (BLIPMessage*)msg isNew: (BOOL)isNew {
-    NSInteger n = _outBox.count, index;
-    if (msg.urgent && n > 1) {
-        // High-priority gets queued after the last existing high-priority message,
-        // leaving one regular-priority message in between if possible.
-        for (index=n-1; index>0; index--) {
-            BLIPMessage *otherMsg = _outBox[index];
-            if ([otherMsg urgent]) {
-                index = MIN(index+2, n);
-                break;
-            } else if (isNew && otherMsg._bytesWritten==0) {
-                // But have to keep message starts in order
-                index = index+1;
-                break;
-            }
-        }
-        if (index==0)
-            index = 1;
-    } else {
-        // Regular priority goes at the end of the queue:
-        index = n;
-    }
-    if (! _outBox)
-        _outBox = [[NSMutableArray alloc] init];
-    [_outBox insertObject: msg atIndex: index];
+    BOOL wasEmpty = (_outBox.count == 0);
+    [_outBox addMessage: msg isNew: isNew];
+    msg.queued = YES;
 
     if (isNew) {
-        LogTo(BLIP,@"%@ queuing outgoing %@ at index %li",self,msg,(long)index);
-        if (n==0 && _transportIsOpen) {
+        LogTo(BLIP,@"%@ queuing outgoing %@ (%lu queued)",self,msg,(unsigned long)_outBox.count);
+        if (wasEmpty && _transportIsOpen) {
             dispatch_async(_transportQueue, ^{
                 [self feedTransport];  // queue the first message now
             });
@@ -227,25 +276,43 @@
 }
 
 
+// Public API
+- (NSUInteger) load {
+    return _load;
+}
+
+
+// Public API
+- (NSUInteger) outgoingMessageCountForPriority: (BLIPPriority)priority {
+    __block NSUInteger count;
+    [self syncOnTransportQueue: ^{
+        count = [_outBox countForPriority: priority];
+    }];
+    return count;
+}
+
+
 // BLIPMessageSender protocol: Called from -[BLIPRequest send]
 - (BOOL) _sendRequest: (BLIPRequest*)q response: (BLIPResponse*)response {
     Assert(!q.sent,@"message has already been sent");
     __block BOOL result;
-    dispatch_sync(_transportQueue, ^{
+    [self syncOnTransportQueue: ^{
         if (_transportIsOpen && !self.transportCanSend) {
             Warn(@"%@: Attempt to send a request after the connection has started closing: %@",self,q);
             result = NO;
             return;
         }
         [q _assignedNumber: ++_numRequestsSent];
+        _outgoingRequests[q.number] = q;
         if (response) {
             [response _assignedNumber: _numRequestsSent];
-            _pendingResponses[$object(response.number)] = response;
+            _pendingResponses[response.number] = response;
+            response._timeout = q.timeout ?: _requestTimeout;   // armed once q is sent
             [self updateActive];
         }
         [self _queueMessage: q isNew: YES];
         result = YES;
-    });
+    }];
     return result;
 }
 
@@ -253,58 +320,380 @@
 - (BOOL) _sendResponse: (BLIPResponse*)response {
     Assert(!response.sent,@"message has already been sent");
     dispatch_async(_transportQueue, ^{
+        if (response.queued)
+            return;     // It was cancelled, and is already queued to send a cancel notice
+        UInt32 number = response.number;
+        [_unansweredRequests removeObjectForKey: @(number)];
+        if ([_cancelledRequests containsIndex: number]) {
+            // The peer cancelled the request, so it doesn't want this:
+            [_cancelledRequests removeIndex: number];
+            LogTo(BLIP, @"%@: Not sending %@; the request was cancelled", self, response);
+            dispatch_async(_delegateQueue, ^{
+                [response _cancelWithNotice: NO];
+            });
+            return;
+        }
+        _outgoingResponses[number] = response;
         [self _queueMessage: response isNew: YES];
     });
     return YES;
 }
 
 
+// Internal API: Called from -[BLIPMessage cancel], on any thread.
+- (void) _cancelMessage: (BLIPMessage*)msg {
+    dispatch_async(_transportQueue, ^{
+        if (msg.cancelled)
+            return;
+        LogTo(BLIP, @"%@: Cancelling %@", self, msg);
+        UInt32 number = msg.number;
+        if (msg.isMine && !_peerSupportsExtensions) {
+            // This peer doesn't understand cancel notices, and would be left waiting for the rest
+            // of the message (or would lose track of request numbers), so it still goes out in
+            // full. Only a request's response is given up on:
+            if (msg.isRequest) {
+                [self _abandonResponseToRequest: number except: msg];
+                [self updateActive];
+            }
+            return;
+        }
+        [msg _cancelWithNotice: _peerSupportsExtensions];
+        if (msg.isMine && !msg.isRequest) {
+            [_outgoingResponses removeMessageWithNumber: number];
+        } else {
+            if (msg.isMine)
+                [_outgoingRequests removeMessageWithNumber: number];
+            // Cancelling a request, or its response, means the response won't arrive:
+            [self _abandonResponseToRequest: number except: msg];
+        }
+        [_blockedMessages removeObject: msg];
+        if (!msg.queued && msg._needsCancelNotice) {
+            // It's not in the outbox, so put it back in to send the cancel notice:
+            [self _queueMessage: msg isNew: NO];
+            if (_transportIsOpen)
+                [self feedTransport];
+        }
+        [self updateActive];
+    });
+}
+
+
 // Subclasses call this
-// Pull a frame from the outBox queue and send it to the transport:
+// Pull frames from the outBox queue and send them to the transport. Frames are generated in
+// batches on the encoder queue. Up to kMaxBatchesInFlight batches run at once, and more are
+// started as each one is sent, until the transport has kPipelineTargetBytes queued; so the
+// encoder works ahead of the transport instead of waiting for each write to finish.
 - (void) feedTransport {
-    if (_outBox.count > 0) {
-        // Pop first message in queue:
-        BLIPMessage *msg = _outBox[0];
-        [_outBox removeObjectAtIndex: 0];
-        ++_poppedMessageCount; // remember that this message is still active
-        
-        // As an optimization, allow message to send a big frame unless there's a higher-priority
-        // message right behind it:
-        size_t frameSize = kDefaultFrameSize;
-        if (msg.urgent || _outBox.count==0 || ! [_outBox[0] urgent])
-            frameSize *= 4;
-
-        // Ask the message to generate its next frame. Do this on the delegate queue:
-        __block BOOL moreComing;
-        __block NSData* frame;
-        dispatch_async(_delegateQueue, ^{
-            frame = [msg nextFrameWithMaxSize: (UInt16)frameSize moreComing: &moreComing];
-            void (^onSent)() = moreComing ? nil : msg.onSent;
-            dispatch_async(_transportQueue, ^{
-                // SHAZAM! Send the frame to the transport:
-                [self sendFrame: frame];
+    if (_batchesInFlight >= kMaxBatchesInFlight) {
+        _feedPending = YES;     // Feed the transport again as soon as a batch is sent
+        return;
+    }
+    NSUInteger n = MIN(_outBox.count, (NSUInteger)kMaxFramesPerBatch);
+    if (n == 0) {
+        //LogTo(BLIPVerbose,@"%@: no more work for writer",self);
+        return;
+    }
 
-                if (moreComing) {
-                    // add the message back so it can send its next frame later:
-                    [self _queueMessage: msg isNew: NO];
+    // Pop the messages that will send the next frames:
+    NSMutableArray* msgs = [NSMutableArray arrayWithCapacity: n];
+    NSMutableArray* maxSizes = [NSMutableArray arrayWithCapacity: n];
+    NSMutableArray* maxBytes = [NSMutableArray arrayWithCapacity: n];
+    for (NSUInteger i = 0; i < n; i++) {
+        BLIPMessage *msg = [_outBox popMessage];
+        [msgs addObject: msg];
+        // Send a big frame unless there's a higher-priority message waiting:
+        NSUInteger frameSize = _frameSize;
+        if ([_outBox hasMessagesAbovePriority: msg.priority])
+            frameSize = kDefaultFrameSize;
+        [maxSizes addObject: @(frameSize)];
+        // Limit the bytes it can send (at least one full frame), and keep them within its
+        // flow-control window:
+        NSUInteger budget = MAX(kMaxBytesPerBatch / n, frameSize);
+        if (_peerSupportsExtensions) {
+            NSInteger credit = kBLIPReceiveWindow - (msg._bytesWritten - msg._bytesAcked);
+            budget = MIN(budget, (NSUInteger)MAX(credit, 1));
+        }
+        [maxBytes addObject: @(budget)];
+    }
+    // If no other messages are waiting, the ones in this batch may each send several frames, so
+    // that even a single message gets frames generated ahead of the transport:
+    NSUInteger framesPerMessage = (_outBox.count == 0) ? kMaxFramesPerBatch / n : 1;
+    _poppedMessageCount += n; // remember that these messages are still active
+    ++_batchesInFlight;
+
+    // Idle connections don't need an encoder queue, so it's not created till something's sent:
+    if (!_encoderQueue)
+        _encoderQueue = dispatch_queue_create("BLIP encoder", DISPATCH_QUEUE_SERIAL);
+    dispatch_async(_encoderQueue, ^{
+        // Ask the messages to generate their next frames, in buffers from the transport if it
+        // provides them:
+        NSMutableArray* frames = [NSMutableArray arrayWithCapacity: n];          // arrays of frames
+        NSMutableArray* bufferedLengths = [NSMutableArray arrayWithCapacity: n]; // arrays of lengths
+        NSMutableIndexSet* finished = [NSMutableIndexSet indexSet];
+        NSMutableIndexSet* stalled = [NSMutableIndexSet indexSet];
+        for (NSUInteger i = 0; i < n; i++) {
+            BLIPMessage* msg = msgs[i];
+            NSUInteger maxSize = [maxSizes[i] unsignedIntegerValue];
+            NSUInteger budget = [maxBytes[i] unsignedIntegerValue];
+            NSMutableArray* msgFrames = [NSMutableArray array];
+            NSMutableArray* msgLengths = [NSMutableArray array];
+            NSUInteger bytes = 0;
+            for (NSUInteger f = 0; f < framesPerMessage; f++) {
+                BOOL moreComing;
+                // Don't let the frame overrun the message's budget (its flow-control window):
+                NSUInteger frameMax = MIN(maxSize, budget - bytes + kMaxFrameHeaderSize);
+                NSUInteger frameLength = [msg nextFrameLengthWithMaxSize: frameMax];
+                NSUInteger headroom = 0, bufferedLength = 0;
+                NSMutableData* buffer = [self transportBufferWithCapacity: frameLength
+                                                                 headroom: &headroom];
+                id frame;
+                if (buffer) {
+                    bufferedLength = [msg writeNextFrameTo: (UInt8*)buffer.mutableBytes + headroom
+                                                 maxLength: frameLength
+                                                moreComing: &moreComing];
+                    frame = bufferedLength ? buffer : nil;
                 } else {
-                    if (onSent)
-                        dispatch_async(_delegateQueue, onSent);
+                    frame = [msg nextFrameWithMaxSize: frameLength moreComing: &moreComing];
                 }
-                --_poppedMessageCount;
-                [self updateActive];
-            });
+                if (frame) {
+                    [msgFrames addObject: frame];
+                    [msgLengths addObject: @(bufferedLength)];
+                    bytes += bufferedLength ?: [frame length];
+                }
+                if (!moreComing) {
+                    [finished addIndex: i];
+                    break;
+                } else if (!frame) {
+                    [stalled addIndex: i];
+                    break;
+                } else if (msg._sendError || msg.cancelled || bytes >= budget) {
+                    break;
+                }
+            }
+            [frames addObject: msgFrames];
+            [bufferedLengths addObject: msgLengths];
+        }
+
+        dispatch_async(_transportQueue, ^{
+            [self updateFrameSize];
+            NSMutableArray* callbacks = [NSMutableArray array];
+            for (NSUInteger i = 0; i < n; i++) {
+                BLIPMessage* msg = msgs[i];
+                // SHAZAM! Send the frames to the transport:
+                NSArray* msgFrames = frames[i];
+                NSArray* msgLengths = bufferedLengths[i];
+                for (NSUInteger f = 0; f < msgFrames.count; f++) {
+                    NSUInteger bufferedLength = [msgLengths[f] unsignedIntegerValue];
+                    if (bufferedLength > 0) {
+                        [self sendFrameInBuffer: msgFrames[f] length: bufferedLength];
+                        _sampleBytesSent += bufferedLength;
+                    } else {
+                        [self sendFrame: msgFrames[f]];
+                        _sampleBytesSent += [msgFrames[f] length];
+                    }
+                }
+
+                if ([stalled containsIndex: i]) {
+                    // Body stream has no data yet, so check back later:
+                    [self _retryStalledMessage: msg];
+                    continue;
+                } else if (msg._sendError) {
+                    [self _failedToSendMessage: msg];
+                    continue;
+                } else if (msg.cancelled) {
+                    if (msg._needsCancelNotice) {
+                        // It was cancelled while its last frame was being generated:
+                        [self _queueMessage: msg isNew: NO];
+                    } else {
+                        [self _finishedSendingMessage: msg];
+                    }
+                    continue;
+                }
+
+                uint64_t bytesSent = msg._bytesWritten;
+                void (^onDataSent)(uint64_t) = msg.onDataSent;
+                if (onDataSent)
+                    [callbacks addObject: ^{ onDataSent(bytesSent); }];
+                if (![finished containsIndex: i]) {
+                    if ([self _hasCreditToSend: msg]) {
+                        // add the message back so it can send its next frame later:
+                        [self _queueMessage: msg isNew: NO];
+                    } else {
+                        // wait until the peer acks more of it:
+                        LogTo(BLIPVerbose, @"%@: %@ is waiting for an ack", self, msg);
+                        msg.queued = NO;
+                        [_blockedMessages addObject: msg];
+                    }
+                } else {
+                    [self _finishedSendingMessage: msg];
+                    if (msg.onSent)
+                        [callbacks addObject: msg.onSent];
+                }
+            }
+            if (callbacks.count > 0) {
+                dispatch_async(_delegateQueue, ^{
+                    for (void (^callback)() in callbacks)
+                        callback();
+                });
+            }
+            _poppedMessageCount -= n;
+            --_batchesInFlight;
+            [self updateActive];
+            if (_feedPending || self.transportQueuedBytes < kPipelineTargetBytes) {
+                _feedPending = NO;
+                [self feedTransport];
+            }
         });
-    } else {
-        //LogTo(BLIPVerbose,@"%@: no more work for writer",self);
+    });
+
+    // Start another batch right away if there are more messages and the transport has room:
+    if (_outBox.count > 0 && self.transportQueuedBytes < kPipelineTargetBytes)
+        [self feedTransport];
+}
+
+
+// Puts a message whose body stream stalled back in the outbox after a short wait. (Streams aren't
+// scheduled on a runloop, so there's no event to tell when they have more data.)
+- (void) _retryStalledMessage: (BLIPMessage*)msg {
+    ++_stalledMessageCount;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kStalledStreamRetryInterval * NSEC_PER_SEC)),
+                   _transportQueue, ^{
+        --_stalledMessageCount;
+        if (_transportIsOpen) {
+            [self _queueMessage: msg isNew: NO];
+            [self feedTransport];
+        } else {
+            [self updateActive];
+        }
+    });
+}
+
+
+// Stops waiting for the response to my request, and fails it with kBLIPError_Cancelled.
+// `msg` is the message being cancelled, which has already been marked as such.
+- (void) _abandonResponseToRequest: (UInt32)number except: (BLIPMessage*)msg {
+    BLIPResponse* response = (BLIPResponse*)_pendingResponses[number];
+    if (!response)
+        return;
+    [_pendingResponses removeMessageWithNumber: number];
+    dispatch_async(_delegateQueue, ^{
+        if (response != msg)
+            [response _cancelWithNotice: NO];
+        [response _failWithError: BLIPMakeError(kBLIPError_Cancelled,
+                                                @"Request was cancelled")];
+    });
+}
+
+
+// Called on the transport queue when a request's deadline passes. If its response hasn't
+// arrived, gives up on it.
+- (void) _responseTimedOut: (UInt32)number {
+    BLIPResponse* response = (BLIPResponse*)_pendingResponses[number];
+    if (!response)
+        return;     // It already arrived
+    if (response._deadline > CFAbsoluteTimeGetCurrent()) {
+        // Part of the response has arrived since the deadline was set, which pushed it back:
+        [_responseDeadlines addDeadline: response._deadline forNumber: number];
+        return;
+    }
+    LogTo(BLIP, @"%@: Timed out waiting for %@", self, response);
+    [_pendingResponses removeMessageWithNumber: number];
+    [self updateActive];
+    dispatch_async(_delegateQueue, ^{
+        [response _failWithError: BLIPMakeError(kBLIPError_Timeout,
+                                                @"Timed out waiting for response")];
+    });
+}
+
+
+- (void) _finishedSendingMessage: (BLIPMessage*)msg {
+    msg.queued = NO;
+    if (msg.isMine) {
+        [(msg.isRequest ? _outgoingRequests : _outgoingResponses) removeMessageWithNumber: msg.number];
+        if (msg.isRequest) {
+            // Now that the request is all sent, start the clock on its response:
+            BLIPResponse* response = (BLIPResponse*)_pendingResponses[msg.number];
+            if (response._timeout > 0) {
+                response._deadline = CFAbsoluteTimeGetCurrent() + response._timeout;
+                [_responseDeadlines addDeadline: response._deadline forNumber: msg.number];
+            }
+        }
+    }
+}
+
+
+// Flow control: can a message send another frame, or has the peer not yet acknowledged enough
+// of what's been sent? (Peers without the protocol extensions don't send acks.)
+- (BOOL) _hasCreditToSend: (BLIPMessage*)msg {
+    return !_peerSupportsExtensions || msg._bytesWritten - msg._bytesAcked < kBLIPReceiveWindow;
+}
+
+
+// A message's body couldn't be read, so it can't be finished. Fail its response, if any.
+- (void) _failedToSendMessage: (BLIPMessage*)msg {
+    Warn(@"%@: Couldn't send %@: %@", self, msg, msg._sendError);
+    [self _finishedSendingMessage: msg];
+    if (msg.isRequest) {
+        BLIPResponse* response = (BLIPResponse*)_pendingResponses[msg.number];
+        if (response) {
+            [_pendingResponses removeMessageWithNumber: msg.number];
+            NSError* error = msg._sendError;
+            dispatch_async(_delegateQueue, ^{
+                [response _failWithError: error];
+            });
+        }
     }
 }
 
 
+// Adjusts _frameSize based on how fast the transport is sending data. The aim is for a frame to
+// take about kTargetFrameTime to send, so large transfers use few frames but a newly-queued
+// urgent message doesn't have to wait long behind them.
+- (void) updateFrameSize {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    NSUInteger queued = self.transportQueuedBytes;
+    NSUInteger maxFrameSize = _peerSupportsExtensions ? kMaxFrameSize : kMaxLegacyFrameSize;
+    if (queued == 0) {
+        // The transport is keeping up with me, so use bigger frames:
+        _frameSize = MIN(2 * _frameSize, maxFrameSize);
+    } else if (_sampleQueuedBytes > 0 && now - _sampleTime >= kThroughputSampleInterval) {
+        // The transport's been busy since the last sample, so it's been sending at full speed:
+        double sent = (double)_sampleQueuedBytes + _sampleBytesSent - queued;
+        double throughput = MAX(sent, 0.0) / (now - _sampleTime);
+        _throughput = _throughput ? (0.75 * _throughput + 0.25 * throughput) : throughput;
+        NSUInteger frameSize = (NSUInteger)(_throughput * kTargetFrameTime);
+        _frameSize = MAX(kDefaultFrameSize, MIN(frameSize, maxFrameSize));
+        LogTo(BLIPVerbose, @"%@: throughput = %.0f bytes/sec; frame size = %lu",
+              self, _throughput, (unsigned long)_frameSize);
+    } else if (_sampleQueuedBytes > 0) {
+        return;     // Keep measuring
+    }
+    _sampleTime = now;
+    _sampleQueuedBytes = queued;
+    _sampleBytesSent = 0;
+}
+
+
 - (BOOL) transportCanSend {
     AssertAbstractMethod();
 }
 
+- (NSMutableData*) transportBufferWithCapacity: (NSUInteger)size headroom: (NSUInteger*)outHeadroom {
+    return nil;
+}
+
+- (void) sendFrameInBuffer: (NSMutableData*)buffer length: (NSUInteger)length {
+    AssertAbstractMethod();
+}
+
+- (NSUInteger) transportQueuedBytes {
+    return 0;
+}
+
+- (void) syncOnTransportQueue: (dispatch_block_t)block {
+    dispatch_sync(_transportQueue, block);
+}
+
 - (void) sendFrame:(NSData *)frame {
     AssertAbstractMethod();
 }
@@ -323,7 +712,8 @@
         UInt64 flags;
         pos = MYDecodeVarUInt(pos, end, &flags);
         if (pos && flags <= kBLIP_MaxFlag) {
-            NSData* body = [NSData dataWithBytes: pos length: frame.length - (pos-start)];
+            NSData* body = [frame subdataNoCopyWithRange: NSMakeRange(pos - start,
+                                                                      end - pos)];
             [self receivedFrameWithNumber: (UInt32)messageNum
                                     flags: (BLIPMessageFlags)flags
                                      body: body];
@@ -343,16 +733,27 @@
     BLIPMessageType type = flags & kBLIP_TypeMask;
     LogTo(BLIPVerbose,@"%@ rcvd frame of %s #%u, length %lu",self,kTypeStrs[type],(unsigned int)requestNumber,(unsigned long)body.length);
 
-    id key = $object(requestNumber);
+    if ((flags & kBLIP_Meta) && _peerSupportsExtensions) {
+        // (Older peers don't send these; their meta messages are handled as requests, below.)
+        UInt64 bytesAcked;
+        if (body.length == 0)
+            [self receivedCancelNoticeForNumber: requestNumber type: type];
+        else if (MYDecodeVarUInt(body.bytes, (const UInt8*)body.bytes + body.length, &bytesAcked))
+            [self receivedAckForNumber: requestNumber type: type bytes: bytesAcked];
+        else
+            LogTo(BLIP, @"%@ ignoring unknown meta frame for #%u", self, (unsigned)requestNumber);
+        return;
+    }
+
     BOOL complete = ! (flags & kBLIP_MoreComing);
     switch(type) {
         case kBLIP_MSG: {
             // Incoming request:
-            BLIPRequest *request = _pendingRequests[key];
+            BLIPRequest *request = (BLIPRequest*)_pendingRequests[requestNumber];
             if (request) {
                 // Continuation frame of a request:
                 if (complete) {
-                    [_pendingRequests removeObjectForKey: key];
+                    [_pendingRequests removeMessageWithNumber: requestNumber];
                 }
             } else if (requestNumber == _numRequestsReceived+1) {
                 // Next new request:
@@ -362,7 +763,9 @@
                                                             number: requestNumber
                                                               body: nil];
                 if (! complete)
-                    _pendingRequests[key] = request;
+                    _pendingRequests[requestNumber] = request;
+                if (! (flags & kBLIP_NoReply))
+                    [_unansweredRequests setObject: request forKey: @(requestNumber)];
                 _numRequestsReceived++;
             } else {
                 return [self _closeWithError: BLIPMakeError(kBLIPError_BadFrame, 
@@ -377,10 +780,13 @@
             
         case kBLIP_RPY:
         case kBLIP_ERR: {
-            BLIPResponse *response = _pendingResponses[key];
+            BLIPResponse *response = (BLIPResponse*)_pendingResponses[requestNumber];
             if (response) {
                 if (complete) {
-                    [_pendingResponses removeObjectForKey: key];
+                    [_pendingResponses removeMessageWithNumber: requestNumber];
+                } else if (response._deadline > 0) {
+                    // The response is making progress, so push back its deadline:
+                    response._deadline = CFAbsoluteTimeGetCurrent() + response._timeout;
                 }
                 [self _receiveFrameWithFlags: flags body: body complete: complete forMessage: response];
 
@@ -404,6 +810,86 @@
 }
 
 
+// Called on the delegate queue by an incoming message, to tell the peer it's processed the given
+// number of bytes of it. Does nothing if the peer doesn't support acks.
+- (void) _sendAckForMessage: (BLIPMessage*)msg bytes: (UInt64)bytesReceived {
+    BLIPMessageType type = msg.isRequest ? kBLIP_MSG : kBLIP_RPY;
+    UInt32 number = msg.number;
+    dispatch_async(_transportQueue, ^{
+        if (!_peerSupportsExtensions || !_transportIsOpen || !self.transportCanSend)
+            return;
+        UInt8 frame[3 * 10];
+        void* pos = MYEncodeVarUInt(frame, number);
+        pos = MYEncodeVarUInt(pos, type | kBLIP_Meta);
+        pos = MYEncodeVarUInt(pos, bytesReceived);
+        LogTo(BLIPVerbose, @"%@: acking %llu bytes of #%u", self, bytesReceived, (unsigned)number);
+        [self sendFrame: [NSData dataWithBytes: frame length: (UInt8*)pos - frame]];
+    });
+}
+
+
+- (void) receivedAckForNumber: (UInt32)number type: (BLIPMessageType)type bytes: (UInt64)bytes {
+    BLIPMessage* msg = (type == kBLIP_MSG) ? _outgoingRequests[number] : _outgoingResponses[number];
+    if (!msg || (NSInteger)bytes <= msg._bytesAcked)
+        return;
+    msg._bytesAcked = (NSInteger)bytes;
+    if ([_blockedMessages containsObject: msg] && [self _hasCreditToSend: msg]) {
+        LogTo(BLIPVerbose, @"%@: %@ can send again", self, msg);
+        [_blockedMessages removeObject: msg];
+        [self _queueMessage: msg isNew: NO];
+        if (_transportIsOpen)
+            [self feedTransport];
+    }
+}
+
+
+- (void) receivedCancelNoticeForNumber: (UInt32)number type: (BLIPMessageType)type {
+    LogTo(BLIP, @"%@ peer cancelled %s #%u", self, (type == kBLIP_MSG ? "request" : "response"),
+          (unsigned)number);
+    if (type == kBLIP_MSG) {
+        // The peer cancelled its request, so stop receiving it and stop sending my response:
+        BLIPRequest* request = (BLIPRequest*)_pendingRequests[number];
+        if (request) {
+            [_pendingRequests removeMessageWithNumber: number];
+        } else if (number == _numRequestsReceived + 1) {
+            _numRequestsReceived++;     // The request never started
+        }
+        BLIPRequest* unanswered = [_unansweredRequests objectForKey: @(number)];
+        if (unanswered) {
+            // Its response hasn't been sent yet; when it is, drop it:
+            request = unanswered;
+            [_unansweredRequests removeObjectForKey: @(number)];
+            [_cancelledRequests addIndex: number];
+        }
+        if (request) {
+            // Its frames are handled on the delegate queue, so mark it cancelled there:
+            dispatch_async(_delegateQueue, ^{
+                [request _cancelWithNotice: NO];
+                if (request.repliedTo)
+                    [request.response _cancelWithNotice: NO];
+            });
+        }
+        BLIPMessage* response = _outgoingResponses[number];
+        if (response) {
+            [_outgoingResponses removeMessageWithNumber: number];
+            [response _cancelWithNotice: NO];
+        }
+    } else {
+        // The peer aborted its response to my request:
+        BLIPResponse* response = (BLIPResponse*)_pendingResponses[number];
+        if (response) {
+            [_pendingResponses removeMessageWithNumber: number];
+            dispatch_async(_delegateQueue, ^{
+                [response _cancelWithNotice: NO];
+                [response _failWithError: BLIPMakeError(kBLIPError_Cancelled,
+                                                        @"Peer cancelled the response")];
+            });
+        }
+    }
+    [self updateActive];
+}
+
+
 - (void) _receiveFrameWithFlags: (BLIPMessageFlags)flags
                            body: (NSData*)body
                        complete: (BOOL)complete
@@ -441,7 +927,8 @@
 }
 
 
-// Called on the delegate queue (by _dispatchRequest)!
+// Called on the delegate queue (by _dispatchRequest)! Handles a meta request from a peer that
+// doesn't support the protocol extensions; none are currently implemented, so it gets an error.
 - (BOOL) _dispatchMetaRequest: (BLIPRequest*)request {
 #if 0
     NSString* profile = request.profile;
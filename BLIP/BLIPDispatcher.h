@@ -25,10 +25,12 @@ typedef void (^BLIPDispatchBlock)(BLIPMessage*);
 /** Adds a new rule, to call a given target method if a given predicate matches the message. The return value is a token that you can later pass to -removeRule: to unregister this rule. */
 - (id) onPredicate: (NSPredicate*)predicate do: (BLIPDispatchBlock)block;
 
-/** Convenience method that adds a rule that compares a property against a string. */
+/** Adds a rule that compares a property against a string. These rules are indexed by property
+    and value, so they're matched in constant time however many of them there are; it's much
+    faster than an equivalent NSPredicate. */
 - (id) onProperty: (NSString*)property value: (NSString*)value do: (BLIPDispatchBlock)block;
 
-/** Removes all rules with the given target. */
+/** Removes a rule, given the token returned when it was added. */
 - (void) removeRule: (id)rule;
 
 /** Tests the message against all the rules, in the order they were added, and calls the
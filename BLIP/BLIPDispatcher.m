@@ -20,9 +20,27 @@
 #import "Test.h"
 
 
+// A registered rule. Rules match in the order they were added, which is the order of `sequence`.
+@interface BLIPDispatchRule : NSObject
+{
+    @public
+    NSUInteger _sequence;
+    NSPredicate* _predicate;        // nil if it's an equality rule
+    NSString *_key, *_value;        // Property key and value of an equality rule
+    BLIPDispatchBlock _block;
+}
+@end
+
+@implementation BLIPDispatchRule
+@end
+
+
 @implementation BLIPDispatcher
 {
-    NSMutableArray *_predicates, *_targets;
+    NSMutableDictionary *_rules;            // Maps rule token (NSNumber) -> BLIPDispatchRule
+    NSMutableDictionary *_equalityRules;    // Maps key -> value -> NSMutableArray of rules
+    NSMutableArray *_predicateRules;        // General predicate rules, in order
+    NSUInteger _nextSequence;
     BLIPDispatcher *_parent;
 }
 
@@ -30,8 +48,9 @@
 - (instancetype) init {
     self = [super init];
     if (self != nil) {
-        _targets = [[NSMutableArray alloc] init];
-        _predicates = [[NSMutableArray alloc] init];
+        _rules = [[NSMutableDictionary alloc] init];
+        _equalityRules = [[NSMutableDictionary alloc] init];
+        _predicateRules = [[NSMutableArray alloc] init];
     }
     return self;
 }
@@ -41,42 +60,99 @@
 @synthesize parent=_parent;
 
 
-- (id) onPredicate: (NSPredicate*)predicate do: (BLIPDispatchBlock)block {
-    [_targets addObject: block];
-    [_predicates addObject: predicate];
-    return @(_targets.count - 1);
+- (id) addRule: (BLIPDispatchRule*)rule block: (BLIPDispatchBlock)block {
+    rule->_sequence = _nextSequence++;
+    rule->_block = [block copy];
+    id token = @(rule->_sequence);
+    _rules[token] = rule;
+    return token;
 }
 
 
-- (void) removeRule: (id)rule {
-    NSUInteger ruleID = [$cast(NSNumber, rule) unsignedIntegerValue];
-    _targets[ruleID] = [NSNull null];
-    _predicates[ruleID] = [NSNull null];
+- (id) onPredicate: (NSPredicate*)predicate do: (BLIPDispatchBlock)block {
+    BLIPDispatchRule* rule = [[BLIPDispatchRule alloc] init];
+    rule->_predicate = predicate;
+    [_predicateRules addObject: rule];
+    return [self addRule: rule block: block];
 }
 
 
 - (id) onProperty: (NSString*)key value: (NSString*)value do: (BLIPDispatchBlock)block {
-    return [self onPredicate: [NSComparisonPredicate
-                predicateWithLeftExpression: [NSExpression expressionForKeyPath: key]
-                            rightExpression: [NSExpression expressionForConstantValue: value]
-                                   modifier: NSDirectPredicateModifier
-                                       type: NSEqualToPredicateOperatorType
-                                    options: 0]
-                   do: block];
+    if (!value || [key rangeOfString: @"."].location != NSNotFound) {
+        // Not a simple key lookup, so fall back to a predicate:
+        return [self onPredicate: [NSComparisonPredicate
+                    predicateWithLeftExpression: [NSExpression expressionForKeyPath: key]
+                                rightExpression: [NSExpression expressionForConstantValue: value]
+                                       modifier: NSDirectPredicateModifier
+                                           type: NSEqualToPredicateOperatorType
+                                        options: 0]
+                       do: block];
+    }
+    // Equality rules are indexed by key and value, so matching them doesn't depend on how many
+    // there are:
+    BLIPDispatchRule* rule = [[BLIPDispatchRule alloc] init];
+    rule->_key = [key copy];
+    rule->_value = [value copy];
+    NSMutableDictionary* byValue = _equalityRules[key];
+    if (!byValue)
+        byValue = _equalityRules[rule->_key] = [[NSMutableDictionary alloc] init];
+    NSMutableArray* rules = byValue[value];
+    if (!rules)
+        rules = byValue[rule->_value] = [[NSMutableArray alloc] init];
+    [rules addObject: rule];
+    return [self addRule: rule block: block];
+}
+
+
+- (void) removeRule: (id)token {
+    BLIPDispatchRule* rule = _rules[token];
+    if (!rule)
+        return;
+    [_rules removeObjectForKey: token];
+    if (rule->_predicate) {
+        [_predicateRules removeObjectIdenticalTo: rule];
+    } else {
+        NSMutableDictionary* byValue = _equalityRules[rule->_key];
+        NSMutableArray* rules = byValue[rule->_value];
+        [rules removeObjectIdenticalTo: rule];
+        if (rules.count == 0) {
+            [byValue removeObjectForKey: rule->_value];
+            if (byValue.count == 0)
+                [_equalityRules removeObjectForKey: rule->_key];
+        }
+    }
 }
 
 
 - (BOOL) dispatchMessage: (BLIPMessage*)message {
     NSDictionary *properties = message.properties;
-    NSUInteger n = _predicates.count;
-    for (NSUInteger i=0; i<n; i++) {
-        id p = _predicates[i];
-        if([$castIf(NSPredicate,p) evaluateWithObject: properties]) {
-            BLIPDispatchBlock target = _targets[i];
-            target(message);
-            return YES;
+
+    // Find the earliest matching equality rule, by looking up each indexed key's value:
+    __block BLIPDispatchRule* match = nil;
+    [_equalityRules enumerateKeysAndObjectsUsingBlock: ^(NSString* key, NSDictionary* byValue,
+                                                         BOOL *stop) {
+        NSString* value = properties[key];
+        if (value) {
+            BLIPDispatchRule* rule = [byValue[value] firstObject];
+            if (rule && (!match || rule->_sequence < match->_sequence))
+                match = rule;
+        }
+    }];
+
+    // Then try the predicate rules that were added before it:
+    for (BLIPDispatchRule* rule in _predicateRules) {
+        if (match && rule->_sequence > match->_sequence)
+            break;
+        if ([rule->_predicate evaluateWithObject: properties]) {
+            match = rule;
+            break;
         }
     }
+
+    if (match) {
+        match->_block(message);
+        return YES;
+    }
     return [_parent dispatchMessage: message];
 }
 
@@ -91,6 +167,53 @@
 @end
 
 
+
+
+#pragma mark - TESTS:
+#if DEBUG
+
+TestCase(BLIPDispatcher) {
+    BLIPDispatcher* dispatcher = [[BLIPDispatcher alloc] init];
+    __block NSString* matched;
+    id fooRule = [dispatcher onProperty: @"Profile" value: @"foo" do: ^(BLIPMessage* msg) {
+        matched = @"foo";
+    }];
+    [dispatcher onPredicate: [NSPredicate predicateWithFormat: @"Size == '1'"]
+                         do: ^(BLIPMessage* msg) { matched = @"size"; }];
+    [dispatcher onProperty: @"Profile" value: @"bar" do: ^(BLIPMessage* msg) { matched = @"bar"; }];
+    [dispatcher onProperty: @"Profile" value: @"foo" do: ^(BLIPMessage* msg) { matched = @"foo2"; }];
+
+    BOOL (^dispatch)(NSDictionary*) = ^BOOL(NSDictionary* properties) {
+        matched = nil;
+        return [dispatcher dispatchMessage: [BLIPRequest requestWithBody: nil
+                                                              properties: properties]];
+    };
+
+    // Rules match in the order they were added:
+    CAssert(dispatch(@{@"Profile": @"foo", @"Size": @"1"}));
+    CAssertEqual(matched, @"foo");
+    CAssert(dispatch(@{@"Profile": @"bar", @"Size": @"1"}));
+    CAssertEqual(matched, @"size");
+    CAssert(dispatch(@{@"Profile": @"bar"}));
+    CAssertEqual(matched, @"bar");
+    CAssert(!dispatch(@{@"Profile": @"baz"}));
+    CAssert(matched == nil);
+
+    [dispatcher removeRule: fooRule];
+    CAssert(dispatch(@{@"Profile": @"foo"}));
+    CAssertEqual(matched, @"foo2");
+
+    // Unmatched messages go to the parent:
+    BLIPDispatcher* parent = [[BLIPDispatcher alloc] init];
+    [parent onProperty: @"Profile" value: @"baz" do: ^(BLIPMessage* msg) { matched = @"parent"; }];
+    dispatcher.parent = parent;
+    CAssert(dispatch(@{@"Profile": @"baz"}));
+    CAssertEqual(matched, @"parent");
+}
+
+#endif
+
+
 /*
  Copyright (c) 2008-2013, Jens Alfke <jens@mooseyard.com>. All rights reserved.
  
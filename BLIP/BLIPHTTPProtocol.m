@@ -14,16 +14,20 @@
 //  and limitations under the License.
 
 #import "BLIPHTTPProtocol.h"
-#import "BLIPWebSocket.h"
+#import "BLIPWebSocketConnection.h"
 #import "BLIPPool.h"
 #import "BLIPRequest+HTTP.h"
 
 #import "CollectionUtils.h"
 #import "Logging.h"
+#import "MYBuffer.h"
 
 
-@interface BLIPHTTPProtocol () <BLIPMessageDataDelegate>
-@end
+// Size of the buffer used to pass response body data to the client
+#define kBodyChunkSize 32768
+
+// Max size of the response's HTTP header block
+#define kMaxHeaderSize (64*1024)
 
 
 @implementation BLIPHTTPProtocol
@@ -31,7 +35,7 @@
     NSURL* _webSocketURL;
     BLIPResponse* _response;
     BOOL _gotHeaders;
-    NSMutableData* _responseBody;
+    NSMutableData* _headerData;     // Response data received before the header block is complete
 }
 
 
@@ -115,52 +119,108 @@ static inline bool urlPrefixMatch(NSString* prefix, NSString* urlString) {
         sSockets = [[BLIPPool alloc] initWithDelegate: nil
                                         dispatchQueue: dispatch_get_current_queue()];
     NSError* error;
-    BLIPWebSocket* socket = [sSockets socketToURL: _webSocketURL error: &error];
+    BLIPWebSocketConnection* socket = [sSockets socketToURL: _webSocketURL error: &error];
     if (!socket) {
         [self.client URLProtocol: self didFailWithError: error];
         return;
     }
+    // The request body (if it's a stream) is read as frames are sent, and the response is passed
+    // to the client as it arrives, so neither is ever held in memory all at once:
     _response = [socket sendRequest: [BLIPRequest requestWithHTTPRequest: self.request]];
-    _response.dataDelegate = self;
+    __weak BLIPHTTPProtocol* weakSelf = self;
+    _response.onDataReceived = ^(id<MYReader> reader) {
+        [weakSelf receivedDataFrom: reader];
+    };
+    _response.onComplete = ^{
+        [weakSelf responseCompleted];
+    };
 }
 
 
 - (void)stopLoading {
-    // The Obj-C BLIP API has no way to stop a request, so just ignore its data:
-    _response.dataDelegate = nil;
+    // Tell the peer to stop sending the response, and ignore any data already on its way:
+    [_response cancel];
+    _response.onDataReceived = nil;
+    _response.onComplete = nil;
     _response = nil;
+    _headerData = nil;
 }
 
 
-- (void) blipMessage: (BLIPMessage*)msg didReceiveData: (NSData*)data {
+// Called on the pool's dispatch queue as each frame of the response arrives.
+- (void) receivedDataFrom: (id<MYReader>)reader {
+    if (!_response || _response.error)
+        return;     // Leave error bodies to be reported by -responseCompleted
     id<NSURLProtocolClient> client = self.client;
-    NSError* error = _response.error;
-    if (error) {
-        [client URLProtocol: self didFailWithError: error];
-        return;
-    }
-
-    if (!_gotHeaders) {
-        if (!_responseBody)
-            _responseBody = [data mutableCopy];
-        else
-            [_responseBody appendData: data];
-
-        NSData* body = nil;
-        NSURLResponse* response = [_response asHTTPResponseWithBody: &body
-                                                             forURL: self.request.URL];
-        if (response) {
+    uint8_t buffer[kBodyChunkSize];
+    ssize_t bytesRead;
+    while ((bytesRead = [reader readBytes: buffer maxLength: sizeof(buffer)]) > 0) {
+        NSData* data = [NSData dataWithBytes: buffer length: bytesRead];
+        if (!_gotHeaders) {
+            // Collect data until the whole header block has arrived. Only the new data (and the
+            // 3 bytes before it) needs to be searched for the blank line that ends it:
+            NSUInteger scanFrom = _headerData.length >= 3 ? _headerData.length - 3 : 0;
+            if (!_headerData)
+                _headerData = [data mutableCopy];
+            else
+                [_headerData appendData: data];
+            NSRange end = [_headerData rangeOfData: [NSData dataWithBytes: "\r\n\r\n" length: 4]
+                                           options: 0
+                                             range: NSMakeRange(scanFrom,
+                                                                _headerData.length - scanFrom)];
+            if (end.location == NSNotFound && _headerData.length <= kMaxHeaderSize)
+                continue;
+            if (end.location == NSNotFound || NSMaxRange(end) > kMaxHeaderSize) {
+                Warn(@"%@: Response headers are too long", self);
+                [self failWithBadResponse];
+                return;
+            }
+            NSUInteger headerLength;
+            NSURLResponse* response = [BLIPResponse HTTPResponseFromData: _headerData
+                                                            headerLength: &headerLength
+                                                                  forURL: self.request.URL];
+            if (!response) {
+                [self failWithBadResponse];
+                return;
+            }
             _gotHeaders = YES;
             [client URLProtocol: self didReceiveResponse: response
                     cacheStoragePolicy: NSURLCacheStorageNotAllowed];
+            data = [_headerData subdataWithRange: NSMakeRange(headerLength,
+                                                              _headerData.length - headerLength)];
+            _headerData = nil;
         }
-        data = body;
+        if (data.length > 0)
+            [client URLProtocol: self didLoadData: data];
     }
+}
 
-    if (data.length > 0)
-        [client URLProtocol: self didLoadData: data];
 
-    if (msg.complete)
+// Gives up on a response whose HTTP header block is invalid.
+- (void) failWithBadResponse {
+    [self stopLoading];
+    [self.client URLProtocol: self didFailWithError: [NSError errorWithDomain: NSURLErrorDomain
+                                                             code: NSURLErrorBadServerResponse
+                                                         userInfo: nil]];
+}
+
+
+// Called on the pool's dispatch queue when the response is complete or has failed.
+- (void) responseCompleted {
+    if (!_response)
+        return;
+    id<NSURLProtocolClient> client = self.client;
+    NSError* error = _response.error;
+    if (!error && !_gotHeaders) {
+        // The response ended before its header block did:
+        error = [NSError errorWithDomain: NSURLErrorDomain
+                                    code: NSURLErrorBadServerResponse userInfo: nil];
+    }
+    _response = nil;
+    _headerData = nil;
+    if (error)
+        [client URLProtocol: self didFailWithError: error];
+    else
         [client URLProtocolDidFinishLoading: self];
 }
 
@@ -18,6 +18,8 @@ enum {
     kBLIPError_BadFrame,
     kBLIPError_Disconnected,
     kBLIPError_PeerNotAllowed,
+    kBLIPError_Timeout,
+    kBLIPError_Cancelled,
     
     kBLIPError_Misc = 99,
     
@@ -34,6 +36,20 @@ enum {
 NSError *BLIPMakeError( int errorCode, NSString *message, ... ) __attribute__ ((format (__NSString__, 2, 3)));
 
 
+/** Priority classes for sending messages, lowest first. Higher classes get more frequent turns
+    to send a frame, but lower ones are never starved. */
+typedef NS_ENUM(UInt8, BLIPPriority) {
+    kBLIPPriorityBackground,    // Bulk transfers that can wait
+    kBLIPPriorityNormal,        // The default
+    kBLIPPriorityUrgent,        // Same as setting the `urgent` property
+    kBLIPPriorityInteractive,   // Latency-sensitive traffic; also flagged as urgent to the peer
+};
+#define kBLIPNumPriorities 4
+
+/** The default compression level for compressed messages (see BLIPConnection.compressionLevel) */
+#define kBLIPDefaultCompressionLevel 5
+
+
 /** Abstract superclass for BLIP requests and responses. */
 @interface BLIPMessage : NSObject
 
@@ -44,8 +60,11 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) __attribute__ ((
     will be called every time more data arrives. The block can read data from the MYReader if it
     wants. Any data left unread will appear in the next call, and any data unread when the message
     is complete will be left in the .body property.
-    (Note: If the message is compressed, onDataReceived won't be called while data arrives, just
-    once at the end after decompression. This may be improved in the future.) */
+    (If the message is compressed, the data is decompressed as it arrives, and the block reads
+    the decompressed data.)
+    With a peer that supports flow control, the peer only sends so far ahead of what's been read:
+    if about a megabyte is left unread, the peer pauses the message. The block can keep the reader
+    and read from it later, on the connection's delegate queue; the peer resumes as it does. */
 @property (strong) void (^onDataReceived)(id<MYReader>);
 
 /** Called after message data is sent over the socket. */
@@ -78,10 +97,34 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) __attribute__ ((
     This property can only be set <i>before</i> sending the message. */
 @property BOOL compressed;
 
+/** The zlib compression level (1-9) to use if the message is compressed. The default value, -1,
+    means to use the connection's compressionLevel.
+    This property can only be set <i>before</i> sending the message. */
+@property int compressionLevel;
+
 /** Should the message be sent ahead of normal-priority messages?
     This property can only be set <i>before</i> sending the message. */
 @property BOOL urgent;
 
+/** The priority class the message is sent with. Urgent and Interactive messages are flagged as
+    urgent, so setting the `urgent` property moves a message into or out of those classes.
+    A response starts out with the same priority as its request.
+    This property can only be set <i>before</i> sending the message. */
+@property BLIPPriority priority;
+
+/** Stops the message. Whatever's left of an outgoing message isn't sent, and the peer is told to
+    discard it, so it can stop work on it too. Cancelling a request, or the incoming response to
+    one, also tells the peer to stop sending the response; the response then fails with a
+    kBLIPError_Cancelled error. Cancelling an incoming request cancels its response.
+    If the peer doesn't support the BLIP protocol extensions (see kBLIPWebSocketProtocol) it
+    can't be told, so an outgoing message that's been sent is still delivered in full; only the
+    response to a request is given up on.
+    Can be called on any thread. */
+- (void) cancel;
+
+/** YES if the message has been cancelled, either locally or by the peer. */
+@property (readonly) BOOL cancelled;
+
 /** Can this message be changed? (Only true for outgoing messages, before you send them.) */
 @property (readonly) BOOL isMutable;
 
@@ -93,9 +136,19 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) __attribute__ ((
 
 /** Appends the contents of a stream to the body. Don't close the stream afterwards, or read from
     it; the BLIPMessage will read from it later, while the message is being delivered, and close
-    it when it's done. */
+    it when it's done. The stream is read only as fast as frames are sent, so a body of any size
+    can be sent without holding it in memory.
+    If the stream has no bytes available, the message waits and other messages are sent meanwhile.
+    If the stream fails, the rest of the message isn't sent, and the request's response (if any)
+    fails with a kBLIPError_BadData error. */
 - (void) addStreamToBody: (NSInputStream*)stream;
 
+/** Appends the contents of a file to the body. The file is memory-mapped, not read, and its pages
+    are copied straight into frames as the message is sent. Don't change the file until the
+    message has been sent.
+    @return  YES on success, NO if the file couldn't be mapped. */
+- (BOOL) addFileToBody: (NSURL*)fileURL error: (NSError**)outError;
+
 /** The message body as an NSString.
     The UTF-8 character encoding is used to convert. */
 @property (copy) NSString *bodyString;
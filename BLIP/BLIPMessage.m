@@ -16,6 +16,7 @@
 
 #import "BLIPMessage.h"
 #import "BLIPConnection.h"
+#import "BLIPConnection+Transport.h"
 #import "BLIP_Internal.h"
 
 #import "Logging.h"
@@ -23,9 +24,49 @@
 #import "ExceptionUtils.h"
 #import "MYData.h"
 #import "MYBuffer.h"
+#import "DDData.h"
+#import "WebSocketDeflate.h"
+#import <zlib.h>
+#import <sys/mman.h>
 
-// From Google Toolbox For Mac <http://code.google.com/p/google-toolbox-for-mac/>
-#import "GTMNSData+zlib.h"
+
+// Number of bytes of an outgoing body compressed at a time
+#define kCompressionChunkSize 16384
+
+// Size of the pieces a spilled body is handed to an onDataReceived reader in
+#define kSpillSliceSize (64*1024)
+
+
+// Records that once the onDataReceived reader has read `bufferedEnd` bytes of the body, it's
+// consumed `rawEnd` bytes of frames (which may be compressed, and include the properties.)
+typedef struct {
+    UInt64 bufferedEnd;
+    NSInteger rawEnd;
+} BLIPReadMark;
+
+
+// The buffer an onDataReceived reader reads from. It tells its message how much has been read,
+// so it can ack the frames whenever the reader drains them, even between frames.
+@interface BLIPReceiveBuffer : MYBuffer
+{
+    @public
+    __weak BLIPMessage* _message;
+    UInt64 _bytesRead;
+}
+@end
+
+@implementation BLIPReceiveBuffer
+
+- (ssize_t) readBytes: (void*)buffer maxLength: (size_t)maxLength {
+    ssize_t n = [super readBytes: buffer maxLength: maxLength];
+    if (n > 0) {
+        _bytesRead += n;
+        [_message _readerReadBytes: _bytesRead];
+    }
+    return n;
+}
+
+@end
 
 
 NSString* const BLIPErrorDomain = @"BLIP";
@@ -44,7 +85,8 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
 @implementation BLIPMessage
 
 
-@synthesize onDataReceived=_onDataReceived, onDataSent=_onDataSent, onSent=_onSent;
+@synthesize onDataReceived=_onDataReceived, onDataSent=_onDataSent, onSent=_onSent,
+            compressionLevel=_compressionLevel;
 
 
 - (instancetype) _initWithConnection: (BLIPConnection*)connection
@@ -59,13 +101,15 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
         _isMine = isMine;
         _isMutable = isMine;
         _flags = flags;
+        _priority = (flags & kBLIP_Urgent) ? kBLIPPriorityUrgent : kBLIPPriorityNormal;
+        _compressionLevel = -1;
         _number = msgNo;
         if (isMine) {
             _body = body.copy;
             _properties = [[NSMutableDictionary alloc] init];
             _propertiesAvailable = YES;
             _complete = YES;
-        } else {
+        } else if (body.length > 0) {
             _encodedBody = [[MYBuffer alloc] initWithData: body];
         }
         LogTo(BLIPLifecycle,@"INIT %@",self);
@@ -114,7 +158,7 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
 
 
 @synthesize connection=_connection, number=_number, isMine=_isMine, isMutable=_isMutable,
-            _bytesWritten, sent=_sent, propertiesAvailable=_propertiesAvailable, complete=_complete,
+            _bytesWritten, _bytesAcked, _sendError, sent=_sent, queued=_queued, cancelled=_cancelled, propertiesAvailable=_propertiesAvailable, complete=_complete,
             representedObject=_representedObject;
 
 
@@ -132,14 +176,37 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
 - (BOOL) compressed                         {return (_flags & kBLIP_Compressed) != 0;}
 - (BOOL) urgent                             {return (_flags & kBLIP_Urgent) != 0;}
 - (void) setCompressed: (BOOL)compressed    {[self _setFlag: kBLIP_Compressed value: compressed];}
-- (void) setUrgent: (BOOL)high              {[self _setFlag: kBLIP_Urgent value: high];}
+- (BLIPPriority) priority                   {return _priority;}
+
+- (void) setUrgent: (BOOL)high {
+    if (high)
+        self.priority = MAX(_priority, kBLIPPriorityUrgent);
+    else
+        self.priority = MIN(_priority, kBLIPPriorityNormal);
+}
+
+- (void) setPriority: (BLIPPriority)priority {
+    [self _setFlag: kBLIP_Urgent value: (priority >= kBLIPPriorityUrgent)];
+    _priority = priority;
+}
 
 
 - (NSData*) body {
     if (! _body && _isMine)
         return [_mutableBody copy];
-    else
-        return _body;
+    if (! _body && _bodyChunks && !(_flags & kBLIP_MoreComing)) {
+        // The received frames are only concatenated the first time the body is asked for:
+        if (_bodyChunks.count == 1) {
+            _body = _bodyChunks[0];
+        } else {
+            NSMutableData* body = [NSMutableData dataWithCapacity: _bytesReceived];
+            for (NSData* chunk in _bodyChunks)
+                [body appendData: chunk];
+            _body = body;
+        }
+        _bodyChunks = nil;
+    }
+    return _body;
 }
 
 - (void) setBody: (NSData*)body {
@@ -166,9 +233,25 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
 }
 
 - (void) addStreamToBody:(NSInputStream *)stream {
-    if (!_bodyStreams)
-        _bodyStreams = [NSMutableArray new];
-    [_bodyStreams addObject: stream];
+    Assert(_isMine && _isMutable);
+    if (!_bodySources)
+        _bodySources = [NSMutableArray new];
+    [_bodySources addObject: stream];
+}
+
+- (BOOL) addFileToBody: (NSURL*)fileURL error: (NSError**)outError {
+    Assert(_isMine && _isMutable);
+    NSData* data = [NSData dataWithContentsOfURL: fileURL
+                                         options: NSDataReadingMappedAlways
+                                           error: outError];
+    if (!data)
+        return NO;
+    if (data.length > 0) {
+        if (!_bodySources)
+            _bodySources = [NSMutableArray new];
+        [_bodySources addObject: data];
+    }
+    return YES;
 }
 
 
@@ -249,15 +332,134 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
     Assert(_encodedBody.maxLength > 0);
 
     NSData *body = _body ?: _mutableBody;
-    NSUInteger length = body.length;
-    if (length > 0) {
-        if (self.compressed)
-            body = [NSData gtm_dataByGzippingData: body compressionLevel: 5];
+    if (body.length == 0 && _bodySources.count == 0)
+        return;
+    if (self.compressed) {
+        // The body will be compressed a piece at a time, as frames are generated:
+        int level = _compressionLevel;
+        if (level < 0)
+            level = _connection ? _connection.compressionLevel : kBLIPDefaultCompressionLevel;
+        _deflater = [[WebSocketDeflater alloc] initWithLevel: level windowBits: 15 + 16];
+        if (body.length > 0)
+            _bodyToCompress = [[MYBuffer alloc] initWithData: body];
+    } else if (body.length > 0) {
         [_encodedBody writeData: body];
     }
-    for (NSInputStream* stream in _bodyStreams)
-        [_encodedBody writeContentsOfStream: stream];
-    _bodyStreams = nil;
+    // Body streams and files aren't read yet; they're pulled from as frames are generated.
+}
+
+
+// Reads body bytes that haven't been encoded into _encodedBody: first _bodyToCompress, then the
+// body sources (streams, and mapped files.) Doesn't block: returns 0 if a stream has no data
+// available yet. On a stream error, sets _sendError and returns -1.
+- (NSInteger) readUnencodedBody: (UInt8*)dst maxLength: (NSUInteger)maxLength {
+    NSUInteger total = 0;
+    if (_bodyToCompress) {
+        ssize_t bytesRead = [_bodyToCompress readBytes: dst maxLength: maxLength];
+        if (bytesRead < 0) {
+            _sendError = BLIPMakeError(kBLIPError_Misc, @"Couldn't read message body");
+            return -1;
+        }
+        total = bytesRead;
+        if (_bodyToCompress.atEnd)
+            _bodyToCompress = nil;
+    }
+    while (total < maxLength && _bodySources.count > 0) {
+        id source = _bodySources[0];
+        if ([source isKindOfClass: [NSData class]]) {
+            // Copy straight from the mapped file into the frame:
+            NSData* data = source;
+            NSUInteger n = MIN(maxLength - total, data.length - _bodySourceOffset);
+            memcpy(dst + total, (const UInt8*)data.bytes + _bodySourceOffset, n);
+            total += n;
+            _bodySourceOffset += n;
+            if (_bodySourceOffset == data.length) {
+                [_bodySources removeObjectAtIndex: 0];
+                _bodySourceOffset = 0;
+            }
+            continue;
+        }
+        NSInputStream* stream = source;
+        if (stream.streamStatus == NSStreamStatusNotOpen)
+            [stream open];
+        NSStreamStatus status = stream.streamStatus;
+        NSInteger bytesRead = 0;
+        if (status == NSStreamStatusOpen || status == NSStreamStatusReading) {
+            if (!stream.hasBytesAvailable)
+                break;      // Stalled; try again later
+            bytesRead = [stream read: dst + total maxLength: maxLength - total];
+        } else if (status == NSStreamStatusOpening) {
+            break;
+        } else if (status == NSStreamStatusError) {
+            bytesRead = -1;
+        }
+        if (bytesRead < 0) {
+            NSError* error = stream.streamError;
+            Warn(@"%@: error reading body stream: %@", self, error);
+            _sendError = BLIPMakeError(kBLIPError_BadData, @"Couldn't read message body: %@",
+                                       error.localizedDescription);
+            [self closeBodyStreams];
+            return -1;
+        } else if (bytesRead == 0) {
+            // Reached the end of this stream:
+            [stream close];
+            [_bodySources removeObjectAtIndex: 0];
+        } else {
+            total += bytesRead;
+        }
+    }
+    return total;
+}
+
+
+- (BOOL) unencodedBodyAtEnd {
+    return !_bodyToCompress && _bodySources.count == 0;
+}
+
+
+- (void) closeBodyStreams {
+    for (id source in _bodySources) {
+        if ([source isKindOfClass: [NSInputStream class]])
+            [source close];
+    }
+    _bodySources = nil;
+    _bodySourceOffset = 0;
+    _bodyToCompress = nil;
+}
+
+
+// Compresses more of the body into _encodedBody, until it has at least `length` bytes, the
+// entire body has been compressed, or a body stream has no data available.
+- (BOOL) compressBodyUpToLength: (NSUInteger)length {
+    UInt8 chunk[kCompressionChunkSize];
+    while (_deflater && _encodedBody.minLength < length) {
+        NSInteger bytesRead = [self readUnencodedBody: chunk maxLength: sizeof(chunk)];
+        if (bytesRead < 0)
+            return NO;
+        BOOL atEnd = self.unencodedBodyAtEnd;
+        int flush = Z_NO_FLUSH;
+        if (atEnd)
+            flush = Z_FINISH;
+        else if (bytesRead == 0) {
+            // A stream stalled; flush what's been compressed so far so it can be sent:
+            if (!_deflaterHasInput)
+                break;
+            flush = Z_SYNC_FLUSH;
+        }
+        NSMutableData* output = [NSMutableData dataWithCapacity: bytesRead / 2 + 32];
+        if (![_deflater deflateBytes: chunk length: bytesRead toData: output flush: flush]) {
+            _sendError = BLIPMakeError(kBLIPError_Misc, @"Couldn't compress message body");
+            return NO;
+        }
+        _deflaterHasInput = (flush == Z_NO_FLUSH);
+        if (output.length > 0)
+            [_encodedBody writeData: output];
+        if (atEnd)
+            _deflater = nil;
+        else if (bytesRead == 0)
+            break;
+    }
+    return YES;
 }
 
 
@@ -268,48 +470,135 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
 }
 
 
+- (void) cancel {
+    if (_isMine && !_sent && self.isRequest) {
+        _cancelled = YES;   // Never sent, so the peer doesn't need to know
+        return;
+    }
+    [_connection _cancelMessage: self];
+}
+
+
+// Marks the message as cancelled. If notifyPeer is YES, the next frame it generates will be a
+// cancel notice; otherwise it won't generate any more frames.
+- (void) _cancelWithNotice: (BOOL)notifyPeer {
+    _cancelled = YES;
+    _cancelNoticeSent = !notifyPeer;
+}
+
+
+- (BOOL) _needsCancelNotice {
+    return _cancelled && !_cancelNoticeSent;
+}
+
+
+// The length of the frame that -nextFrameWithMaxSize: would generate.
+- (NSUInteger) nextFrameLengthWithMaxSize: (NSUInteger)maxSize {
+    if (_cancelled)
+        return MYLengthOfVarUInt(_number) + 1;
+    if (_deflater || _bodySources.count > 0)
+        return maxSize;     // Can't tell how much data there will be
+    size_t headerSize = MYLengthOfVarUInt(_number) + MYLengthOfVarUInt(_flags);
+    return MIN(headerSize + _encodedBody.maxLength, maxSize);
+}
+
 // Generates the next outgoing frame.
-- (NSData*) nextFrameWithMaxSize: (UInt16)maxSize moreComing: (BOOL*)outMoreComing {
+- (NSData*) nextFrameWithMaxSize: (NSUInteger)maxSize moreComing: (BOOL*)outMoreComing {
+    NSMutableData* frame = [NSMutableData dataWithLength: [self nextFrameLengthWithMaxSize: maxSize]];
+    NSUInteger length = [self writeNextFrameTo: frame.mutableBytes
+                                     maxLength: frame.length
+                                    moreComing: outMoreComing];
+    if (length == 0)
+        return nil;
+    frame.length = length;
+    return frame;
+}
+
+// Generates the next outgoing frame in a caller-supplied buffer, and returns its length.
+// Returns 0 if there's no frame to send right now; then *outMoreComing is YES if a body stream
+// has stalled and this should be called again later, or NO if the message failed (_sendError.)
+- (NSUInteger) writeNextFrameTo: (void*)frame
+                      maxLength: (NSUInteger)maxLength
+                     moreComing: (BOOL*)outMoreComing
+{
+    *outMoreComing = NO;
+    if (_cancelled)
+        return [self writeCancelNoticeTo: frame];
     Assert(_number!=0);
     Assert(_isMine);
     Assert(_encodedBody);
-    *outMoreComing = NO;
+    if (_sendError)
+        return 0;
     if (_bytesWritten==0)
         LogTo(BLIP,@"Now sending %@",self);
     size_t headerSize = MYLengthOfVarUInt(_number) + MYLengthOfVarUInt(_flags);
+    NSUInteger maxBodyLength = maxLength - headerSize;
+    if (_deflater && ![self compressBodyUpToLength: maxBodyLength]) {
+        Warn(@"Failed to compress %@", self);
+        return 0;
+    }
 
-    // Allocate frame and read bytes from body into it:
-    NSUInteger frameSize = MIN(headerSize + _encodedBody.maxLength, maxSize);
-    NSMutableData* frame = [NSMutableData dataWithLength: frameSize];
-    ssize_t bytesRead = [_encodedBody readBytes: (uint8_t*)frame.mutableBytes + headerSize
-                                      maxLength: frameSize - headerSize];
-    if (bytesRead < 0)
-        return nil;
-    frame.length = headerSize + bytesRead;
+    // Read bytes from body into the frame, then pull more from the body streams if there's room:
+    UInt8* body = (UInt8*)frame + headerSize;
+    ssize_t bytesRead = [_encodedBody readBytes: body maxLength: maxBodyLength];
+    if (bytesRead < 0) {
+        _sendError = BLIPMakeError(kBLIPError_Misc, @"Couldn't read message body");
+        return 0;
+    }
+    if (!_deflater && (NSUInteger)bytesRead < maxBodyLength && _bodySources.count > 0) {
+        NSInteger streamBytes = [self readUnencodedBody: body + bytesRead
+                                              maxLength: maxBodyLength - bytesRead];
+        if (streamBytes < 0)
+            return 0;
+        bytesRead += streamBytes;
+    }
+
+    BOOL moreComing = !(_encodedBody.atEnd && !_deflater && self.unencodedBodyAtEnd);
+    if (bytesRead == 0 && moreComing) {
+        // Nothing to send until a body stream has more data:
+        LogTo(BLIPVerbose,@"%@ body stream stalled",self);
+        *outMoreComing = YES;
+        return 0;
+    }
     _bytesWritten += bytesRead;
 
     // Write the header:
-    if (_encodedBody.atEnd) {
-        _flags &= ~kBLIP_MoreComing;
-    } else {
+    if (moreComing) {
         _flags |= kBLIP_MoreComing;
         *outMoreComing = YES;
+    } else {
+        _flags &= ~kBLIP_MoreComing;
     }
-    void* pos = MYEncodeVarUInt(frame.mutableBytes, _number);
+    void* pos = MYEncodeVarUInt(frame, _number);
     MYEncodeVarUInt(pos, _flags);
 
     LogTo(BLIPVerbose,@"%@ pushing frame, bytes %lu-%lu%@", self,
           (unsigned long)_bytesWritten-bytesRead, (unsigned long)_bytesWritten,
           (*outMoreComing ? @"" : @" (finished)"));
-    if (_onDataSent)
-        _onDataSent(_bytesWritten);
     if (!*outMoreComing)
         self.complete = YES;
-    return frame;
+    return headerSize + bytesRead;
 }
 
 
-// Parses the next incoming frame.
+// Generates a cancel notice in place of the rest of the message, if the peer needs one.
+- (NSUInteger) writeCancelNoticeTo: (void*)frame {
+    [self closeBodyStreams];
+    if (_cancelNoticeSent)
+        return 0;
+    _cancelNoticeSent = YES;
+    // An outgoing response is cancelled with RPY/ERR, anything else (an outgoing request or the
+    // response to one) with MSG:
+    BLIPMessageFlags type = (_isMine && !self.isRequest) ? (_flags & kBLIP_TypeMask) : kBLIP_MSG;
+    LogTo(BLIP,@"%@ sending cancel notice",self);
+    void* pos = MYEncodeVarUInt(frame, _number);
+    pos = MYEncodeVarUInt(pos, type | kBLIP_Meta);
+    return (UInt8*)pos - (UInt8*)frame;
+}
+
+
+// Parses the next incoming frame. The frame body is usually a slice of the WebSocket's read
+// buffer; it's kept as-is in _bodyChunks rather than being copied.
 - (BOOL) _receivedFrameWithFlags: (BLIPMessageFlags)flags body: (NSData*)frameBody {
     Assert(!_isMine);
     Assert(_flags & kBLIP_MoreComing);
@@ -318,28 +607,124 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
         _flags = flags | kBLIP_MoreComing;
 
     _bytesReceived += frameBody.length;
-    if (!_encodedBody)
-        _encodedBody = [[MYBuffer alloc] init];
-    [_encodedBody writeData: frameBody];
     LogTo(BLIPVerbose,@"%@ rcvd bytes %lu-%lu, flags=%x",
           self, (unsigned long)_bytesReceived-frameBody.length, (unsigned long)_bytesReceived, flags);
     
     if (! _properties) {
         // Try to extract the properties:
-        BOOL complete;
-        _properties = BLIPReadPropertiesFromBuffer(_encodedBody, &complete);
+        NSUInteger propertiesLength = 0;
+        if (!_propertiesReader) {
+            // Usually they're all in the first frame, so parse them in place (after checking
+            // their length against the same limit the incremental reader uses):
+            UInt64 declaredLength;
+            const UInt8* start = frameBody.bytes;
+            if (MYDecodeVarUInt(start, start + frameBody.length, &declaredLength)
+                    && declaredLength > kBLIPMaxPropertiesSize) {
+                Warn(@"%@: Properties are too large (%llu bytes)", self, declaredLength);
+                return NO;
+            }
+            BOOL complete;
+            _properties = BLIPParsePropertiesFromData(frameBody, &propertiesLength, &complete);
+            if (!_properties) {
+                if (complete)
+                    return NO;
+                // Properties span multiple frames, so read them incrementally:
+                _propertiesReader = [[BLIPPropertiesReader alloc]
+                                                    initWithMaxLength: kBLIPMaxPropertiesSize];
+            }
+        }
+        if (_propertiesReader) {
+            propertiesLength = [_propertiesReader readData: frameBody];
+            if (propertiesLength == NSNotFound) {
+                Warn(@"%@: Invalid or too-large properties", self);
+                return NO;
+            }
+            _properties = _propertiesReader.properties;
+            if (_properties)
+                _propertiesReader = nil;
+        }
+        frameBody = [frameBody subdataNoCopyWithRange:
+                                    NSMakeRange(propertiesLength,
+                                                frameBody.length - propertiesLength)];
         if (_properties) {
             self.propertiesAvailable = YES;
             [_connection _messageReceivedProperties: self];
-        } else if (complete) {
-            return NO;
         }
     }
 
-    void (^onDataReceived)(id<MYReader>) = (_properties && !self.compressed) ? _onDataReceived : nil;
-    if (onDataReceived) {
-        LogTo(BLIPVerbose, @"%@ -> calling onDataReceived(%lu bytes)", self, (unsigned long)frameBody.length);
-        onDataReceived(_encodedBody);
+    if (_properties) {
+        UInt64 maxBodySize = _connection.maxBodySize;
+        if (self.compressed && frameBody.length > 0) {
+            // Decompress the data as it arrives, without letting it grow past maxBodySize:
+            if (!_inflater)
+                _inflater = [[WebSocketInflater alloc] initWithWindowBits: 15 + 32];
+            NSUInteger maxLength = 0;
+            if (maxBodySize > 0)
+                maxLength = (NSUInteger)MAX(maxBodySize - MIN(_bodyLength, maxBodySize), 1);
+            NSMutableData* inflated = [NSMutableData dataWithCapacity: 2 * frameBody.length];
+            if (![_inflater inflateBytes: frameBody.bytes length: frameBody.length
+                                  toData: inflated maxLength: maxLength]) {
+                if (maxLength > 0 && inflated.length > maxLength)
+                    Warn(@"%@: Body is larger than %llu bytes", self, maxBodySize);
+                else
+                    Warn(@"Failed to decompress %@", self);
+                return NO;
+            }
+            frameBody = inflated;
+        }
+        _bodyLength += frameBody.length;
+        if (maxBodySize > 0 && _bodyLength > maxBodySize) {
+            Warn(@"%@: Body is larger than %llu bytes", self, maxBodySize);
+            return NO;
+        }
+        void (^onDataReceived)(id<MYReader>) = _onDataReceived;
+        if (onDataReceived) {
+            // The callback reads from a MYBuffer, so move the body into one:
+            if (!_encodedBody) {
+                BLIPReceiveBuffer* buffer = [[BLIPReceiveBuffer alloc] init];
+                buffer->_message = self;
+                _encodedBody = buffer;
+                _readMarks = [[NSMutableData alloc] init];
+                if (_spillFile) {
+                    // Hand the reader the mapped file in slices, so nothing is copied and the
+                    // pages it's read past can be dropped:
+                    if (![self finishSpilling])
+                        return NO;
+                    NSUInteger length = _body.length;
+                    for (NSUInteger pos = 0; pos < length; pos += kSpillSliceSize) {
+                        NSRange range = NSMakeRange(pos, MIN(kSpillSliceSize, length - pos));
+                        [_encodedBody writeData: [_body subdataNoCopyWithRange: range]];
+                    }
+                    _body = nil;
+                }
+                for (NSData* chunk in _bodyChunks)
+                    [_encodedBody writeData: chunk];
+                _bodyChunks = nil;
+                // (What was already received was consumed as it was stored.)
+                _bytesBuffered = _encodedBody.minLength;
+                BLIPReadMark mark = {_bytesBuffered, _bytesConsumed};
+                [_readMarks appendBytes: &mark length: sizeof(mark)];
+            }
+            [_encodedBody writeData: frameBody];
+            _bytesBuffered += frameBody.length;
+            [self addReadMark: _bytesBuffered];
+            LogTo(BLIPVerbose, @"%@ -> calling onDataReceived(%lu bytes)", self, (unsigned long)frameBody.length);
+            onDataReceived(_encodedBody);
+        } else if (_encodedBody) {
+            [_encodedBody writeData: frameBody];
+            _readMarks = nil;
+        } else if (_spillFile) {
+            if (![self spillData: frameBody])
+                return NO;
+        } else if (frameBody.length > 0) {
+            if (!_bodyChunks)
+                _bodyChunks = [[NSMutableArray alloc] init];
+            [_bodyChunks addObject: frameBody];
+            _bodyChunksLength += frameBody.length;
+            NSUInteger threshold = _connection.bodySpillThreshold;
+            if (threshold > 0 && _bodyChunksLength > threshold && ![self startSpilling])
+                return NO;
+        }
     }
 
     if (! (flags & kBLIP_MoreComing)) {
@@ -347,32 +732,143 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
         _flags &= ~kBLIP_MoreComing;
         if (! _properties)
             return NO;
-        _body = _encodedBody.flattened;
-        _encodedBody = nil;
-        NSUInteger encodedLength = _body.length;
-        if (self.compressed && encodedLength>0) {
-            _body = [[NSData gtm_dataByInflatingData: _body] copy];
-            if (! _body) {
-                Warn(@"Failed to decompress %@", self);
-                return NO;
-            }
-            LogTo(BLIPVerbose,@"Uncompressed %@ from %lu bytes (%.1fx)", self, (unsigned long)encodedLength,
-                  _body.length/(double)encodedLength);
-            if (_onDataReceived) {
-                MYBuffer* buffer = [[MYBuffer alloc] initWithData: _body];
-                _onDataReceived(buffer);
-                _body = buffer.flattened;
-            }
+        if (_inflater && !_inflater.finished) {
+            Warn(@"Compressed body of %@ is truncated", self);
+            return NO;
         }
+        _inflater = nil;
+        if (_spillFile && ![self finishSpilling])
+            return NO;
+        if (_encodedBody) {
+            NSData* rest = _encodedBody.flattened;
+            _encodedBody = nil;
+            _bodyChunks = rest.length ? [NSMutableArray arrayWithObject: rest] : nil;
+        }
+        if (!_bodyChunks && !_body)
+            _body = [NSData data];
         _onDataReceived = nil;
+        _readMarks = nil;
         self.propertiesAvailable = self.complete = YES;
+    } else if (!_readMarks) {
+        // The frame's been spilled to disk, or kept in memory for the body (which has to be
+        // there in full anyway), so it's consumed. With a reader, it isn't until it's been read.
+        _bytesConsumed = _bytesReceived;
+        [self sendAckIfNeeded];
+    }
+
+    return YES;
+}
+
+
+// Notes that once the reader has read `bufferedEnd` bytes, all frames so far are consumed.
+- (void) addReadMark: (UInt64)bufferedEnd {
+    BLIPReadMark mark = {bufferedEnd, _bytesReceived};
+    [_readMarks appendBytes: &mark length: sizeof(mark)];
+}
+
+
+// Called by the reader's BLIPReceiveBuffer whenever it's read from, on the delegate queue.
+// Works out how many frame bytes that consumes, and acks them if there are enough.
+- (void) _readerReadBytes: (UInt64)totalRead {
+    const BLIPReadMark* marks = _readMarks.bytes;
+    NSUInteger n = _readMarks.length / sizeof(BLIPReadMark);
+    while (_readMarksStart < n && marks[_readMarksStart].bufferedEnd <= totalRead)
+        ++_readMarksStart;
+    if (_readMarksStart == 0)
+        return;
+    BLIPReadMark prev = marks[_readMarksStart - 1];
+    NSInteger consumed = prev.rawEnd;
+    if (_readMarksStart < n) {
+        // Credit the part of the next frame that's been read, in proportion:
+        BLIPReadMark next = marks[_readMarksStart];
+        double fraction = (double)(totalRead - prev.bufferedEnd)
+                                / (next.bufferedEnd - prev.bufferedEnd);
+        consumed += (NSInteger)(fraction * (next.rawEnd - prev.rawEnd));
+    }
+    _bytesConsumed = MAX(_bytesConsumed, consumed);
+    if (_readMarksStart > 1 && _readMarksStart >= n / 2) {
+        // Discard the used-up marks, except the latest:
+        NSUInteger drop = (_readMarksStart - 1) * sizeof(BLIPReadMark);
+        [_readMarks replaceBytesInRange: NSMakeRange(0, drop) withBytes: NULL length: 0];
+        _readMarksStart = 1;
+    }
+    [self sendAckIfNeeded];
+}
+
+
+// Tells the sender it can send more, once I've consumed enough of what it's sent.
+- (void) sendAckIfNeeded {
+    if ((_flags & kBLIP_MoreComing) && _bytesConsumed - _bytesAcked >= kBLIPAckInterval) {
+        _bytesAcked = _bytesConsumed;
+        [_connection _sendAckForMessage: self bytes: _bytesConsumed];
+    }
+}
+
+
+// Moves the body received so far out of memory, into a new temporary file. The file is unlinked
+// right away, so it goes away when it's closed, even if the process crashes.
+- (BOOL) startSpilling {
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"BLIP-XXXXXX"];
+    char pathBuf[PATH_MAX];
+    strlcpy(pathBuf, path.fileSystemRepresentation, sizeof(pathBuf));
+    int fd = mkstemp(pathBuf);
+    if (fd < 0) {
+        Warn(@"%@: Couldn't create temp file: %s", self, strerror(errno));
+        return NO;
+    }
+    unlink(pathBuf);
+    LogTo(BLIP, @"%@: Body is over %lu bytes; writing it to a temporary file",
+          self, (unsigned long)_connection.bodySpillThreshold);
+    _spillFile = [[NSFileHandle alloc] initWithFileDescriptor: fd closeOnDealloc: YES];
+    NSArray* chunks = _bodyChunks;
+    _bodyChunks = nil;
+    _bodyChunksLength = 0;
+    for (NSData* chunk in chunks) {
+        if (![self spillData: chunk])
+            return NO;
+    }
+    return YES;
+}
+
+- (BOOL) spillData: (NSData*)data {
+    const UInt8* bytes = data.bytes;
+    size_t remaining = data.length;
+    while (remaining > 0) {
+        ssize_t written = write(_spillFile.fileDescriptor, bytes, remaining);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            Warn(@"%@: Couldn't write to temp file: %s", self, strerror(errno));
+            _spillFile = nil;
+            return NO;
+        }
+        bytes += written;
+        remaining -= written;
     }
+    _spillLength += data.length;
+    return YES;
+}
 
+// Maps the completed temp file into memory as the body, and closes it.
+- (BOOL) finishSpilling {
+    void* mapped = mmap(NULL, _spillLength, PROT_READ, MAP_PRIVATE, _spillFile.fileDescriptor, 0);
+    _spillFile = nil;   // closes the file; the mapping stays valid
+    if (mapped == MAP_FAILED) {
+        Warn(@"%@: Couldn't map temp file: %s", self, strerror(errno));
+        return NO;
+    }
+    size_t length = _spillLength;
+    madvise(mapped, length, MADV_SEQUENTIAL);
+    _body = [[NSData alloc] initWithBytesNoCopy: mapped length: length
+                                    deallocator: ^(void *bytes, NSUInteger len) {
+                                        munmap(bytes, length);
+                                    }];
     return YES;
 }
 
 
 - (void) _connectionClosed {
+    [self closeBodyStreams];
     if (_isMine) {
         _bytesWritten = 0;
         _flags |= kBLIP_MoreComing;
@@ -383,6 +879,185 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... ) {
 @end
 
 
+
+#pragma mark - TESTS:
+#if DEBUG
+
+// Sends `msg` through a new incoming message, a frame at a time, and returns the incoming message.
+static BLIPMessage* transferMessage(BLIPMessage* msg, NSUInteger frameSize,
+                                    BLIPConnection* toConnection)
+{
+    BLIPMessage* rcvd = nil;
+    BOOL moreComing;
+    do {
+        NSData* frame = [msg nextFrameWithMaxSize: frameSize moreComing: &moreComing];
+        CAssert(frame);
+        CAssert(frame.length <= frameSize);
+        const void* start = frame.bytes, *end = start + frame.length;
+        UInt64 number, flags;
+        const void* pos = MYDecodeVarUInt(start, end, &number);
+        pos = MYDecodeVarUInt(pos, end, &flags);
+        CAssertEq(number, (UInt64)msg.number);
+        CAssertEq((flags & kBLIP_MoreComing) != 0, moreComing);
+        if (!rcvd)
+            rcvd = [[BLIPRequest alloc] _initWithConnection: toConnection isMine: NO
+                                                      flags: (BLIPMessageFlags)flags | kBLIP_MoreComing
+                                                     number: (UInt32)number body: nil];
+        NSData* body = [frame subdataWithRange: NSMakeRange(pos - start, end - pos)];
+        CAssert([rcvd _receivedFrameWithFlags: (BLIPMessageFlags)flags body: body]);
+    } while (moreComing);
+    CAssert(rcvd.complete);
+    return rcvd;
+}
+
+TestCase(BLIPMessageBodyStreams) {
+    NSMutableData* data = [NSMutableData dataWithLength: 100000];
+    UInt8* bytes = data.mutableBytes;
+    for (NSUInteger i = 0; i < data.length; i++)
+        bytes[i] = (UInt8)(i * 7 % 251);
+
+    for (int compressed = 0; compressed <= 1; compressed++) {
+        // Body is some data followed by two streams; they're read as the frames are generated:
+        BLIPRequest* msg = [BLIPRequest requestWithBody: [data subdataWithRange: NSMakeRange(0, 1000)]
+                                             properties: @{@"Foo": @"bar"}];
+        msg.compressed = compressed;
+        NSInputStream* stream1 = [NSInputStream inputStreamWithData:
+                                            [data subdataWithRange: NSMakeRange(1000, 60000)]];
+        NSInputStream* stream2 = [NSInputStream inputStreamWithData:
+                                            [data subdataWithRange: NSMakeRange(61000, 39000)]];
+        [msg addStreamToBody: stream1];
+        [msg addStreamToBody: stream2];
+        [msg _encode];
+        [msg _assignedNumber: 1];
+        CAssertEq(stream1.streamStatus, NSStreamStatusNotOpen);
+
+        BLIPMessage* rcvd = transferMessage(msg, 4096, nil);
+        CAssertEqual(rcvd[@"Foo"], @"bar");
+        CAssertEqual(rcvd.body, data);
+        CAssertEq(stream2.streamStatus, NSStreamStatusClosed);
+    }
+
+    // A stream that fails makes the message fail:
+    BLIPRequest* msg = [BLIPRequest requestWithBody: nil properties: nil];
+    [msg addStreamToBody: [NSInputStream inputStreamWithFileAtPath: @"/nonexistent/file"]];
+    [msg _encode];
+    [msg _assignedNumber: 1];
+    BOOL moreComing;
+    CAssert([msg nextFrameWithMaxSize: 4096 moreComing: &moreComing] == nil);
+    CAssert(!moreComing);
+    CAssertEq(msg._sendError.code, kBLIPError_BadData);
+}
+
+
+TestCase(BLIPMessageMaxProperties) {
+    // A properties block over kBLIPMaxPropertiesSize is rejected, even if it's all in one frame:
+    NSString* big = [@"" stringByPaddingToLength: kBLIPMaxPropertiesSize + 1
+                                      withString: @"x" startingAtIndex: 0];
+    NSData* frame = BLIPEncodeProperties(@{@"Big": big});
+    BLIPRequest* rcvd = [[BLIPRequest alloc] _initWithConnection: nil isMine: NO
+                                                           flags: kBLIP_MSG | kBLIP_MoreComing
+                                                          number: 1 body: nil];
+    CAssert(![rcvd _receivedFrameWithFlags: kBLIP_MSG body: frame]);
+
+    // ...but one under the limit is fine:
+    frame = BLIPEncodeProperties(@{@"Big": [big substringFromIndex: 1000]});
+    rcvd = [[BLIPRequest alloc] _initWithConnection: nil isMine: NO
+                                               flags: kBLIP_MSG | kBLIP_MoreComing
+                                              number: 1 body: nil];
+    CAssert([rcvd _receivedFrameWithFlags: kBLIP_MSG body: frame]);
+    CAssert(rcvd.complete);
+}
+
+
+TestCase(BLIPMessageMaxBodySize) {
+    // A small compressed body that inflates past maxBodySize is rejected:
+    BLIPConnection* conn = [[BLIPConnection alloc] initWithTransportQueue: dispatch_get_main_queue()
+                                                                   isOpen: NO];
+    conn.maxBodySize = 100000;
+    BLIPRequest* msg = [BLIPRequest requestWithBody: [NSMutableData dataWithLength: 1000000]
+                                         properties: nil];
+    msg.compressed = YES;
+    [msg _encode];
+    [msg _assignedNumber: 1];
+    BOOL moreComing;
+    NSData* frame = [msg nextFrameWithMaxSize: 1000000 moreComing: &moreComing];
+    CAssert(frame.length < 10000);
+    CAssert(!moreComing);
+    const void* start = frame.bytes, *end = start + frame.length;
+    UInt64 number, flags;
+    const void* pos = MYDecodeVarUInt(start, end, &number);
+    pos = MYDecodeVarUInt(pos, end, &flags);
+    NSData* body = [frame subdataWithRange: NSMakeRange(pos - start, end - pos)];
+    BLIPRequest* rcvd = [[BLIPRequest alloc] _initWithConnection: conn isMine: NO
+                                                           flags: (BLIPMessageFlags)flags | kBLIP_MoreComing
+                                                          number: 1 body: nil];
+    CAssert(![rcvd _receivedFrameWithFlags: (BLIPMessageFlags)flags body: body]);
+
+    // ...but a body under the limit is fine, compressed or not:
+    for (int compressed = 0; compressed <= 1; compressed++) {
+        msg = [BLIPRequest requestWithBody: [NSMutableData dataWithLength: 100000]
+                                properties: nil];
+        msg.compressed = compressed;
+        [msg _encode];
+        [msg _assignedNumber: 1];
+        rcvd = (BLIPRequest*)transferMessage(msg, 4096, conn);
+        CAssertEq(rcvd.body.length, 100000u);
+    }
+}
+
+
+TestCase(BLIPMessageFileBodies) {
+    NSMutableData* data = [NSMutableData dataWithLength: 300000];
+    UInt8* bytes = data.mutableBytes;
+    for (NSUInteger i = 0; i < data.length; i++)
+        bytes[i] = (UInt8)(i * 13 % 241);
+    NSURL* fileURL = [NSURL fileURLWithPath: [NSTemporaryDirectory()
+                                        stringByAppendingPathComponent: @"BLIPMessageTest.dat"]];
+    CAssert([data writeToURL: fileURL atomically: NO]);
+
+    // Send a body from a mapped file, and have the receiver spill it to a temporary file:
+    BLIPConnection* conn = [[BLIPConnection alloc] initWithTransportQueue: dispatch_get_main_queue()
+                                                                   isOpen: NO];
+    conn.bodySpillThreshold = 100000;
+    BLIPRequest* msg = [BLIPRequest requestWithBody: [@"header" dataUsingEncoding: NSUTF8StringEncoding]
+                                         properties: nil];
+    NSError* error;
+    CAssert([msg addFileToBody: fileURL error: &error], @"%@", error);
+    [msg _encode];
+    [msg _assignedNumber: 1];
+    BLIPMessage* rcvd = transferMessage(msg, 16384, conn);
+    CAssertEq(rcvd.body.length, data.length + 6);
+    CAssertEqual([rcvd.body subdataWithRange: NSMakeRange(6, data.length)], data);
+    [[NSFileManager defaultManager] removeItemAtURL: fileURL error: NULL];
+
+    BLIPRequest* missing = [BLIPRequest requestWithBody: nil properties: nil];
+    CAssert(![missing addFileToBody: [NSURL fileURLWithPath: @"/nonexistent/file"] error: &error]);
+}
+
+
+TestCase(BLIPMessageCancel) {
+    BLIPRequest* msg = [BLIPRequest requestWithBody: [NSMutableData dataWithLength: 10000]
+                                         properties: nil];
+    [msg _encode];
+    [msg _assignedNumber: 7];
+    BOOL moreComing;
+    NSData* frame = [msg nextFrameWithMaxSize: 4096 moreComing: &moreComing];
+    CAssertEq(frame.length, 4096u);
+    CAssert(moreComing);
+
+    // After it's cancelled, its only remaining frame is a cancel notice:
+    [msg _cancelWithNotice: YES];
+    CAssert(msg.cancelled);
+    frame = [msg nextFrameWithMaxSize: 4096 moreComing: &moreComing];
+    CAssert(!moreComing);
+    CAssertEqual(frame, [NSData dataWithBytes: (UInt8[]){7, kBLIP_MSG | kBLIP_Meta} length: 2]);
+    CAssert([msg nextFrameWithMaxSize: 4096 moreComing: &moreComing] == nil);
+    CAssert(!moreComing);
+}
+
+#endif
+
+
 /*
  Copyright (c) 2008-2013, Jens Alfke <jens@mooseyard.com>. All rights reserved.
  
@@ -0,0 +1,62 @@
+//
+//  BLIPMessageTable.h
+//  WebSocket
+//
+//  Copyright (c) 2015 Couchbase, Inc. All rights reserved.
+
+#import "BLIPMessage.h"
+
+
+/** Maps message numbers to the BLIPMessages that are in progress. Since message numbers are
+    assigned sequentially and most messages finish in roughly the order they started, this is a
+    dense array covering the range from the lowest to the highest number in the table, which slides
+    forward as messages are removed. Lookups, insertions and removals take constant time, with
+    no hashing and no boxing of the numbers. The array is kept to a bounded size: a message that
+    stays in the table while the window moves far past it is moved to a side dictionary, so one
+    long-running message doesn't make the table grow with all the traffic after it.
+    Not thread-safe; BLIPConnection uses it only on its transport queue. */
+@interface BLIPMessageTable : NSObject
+
+/** The number of messages in the table. */
+@property (readonly) NSUInteger count;
+
+/** Returns the message with the given number, or nil. Supports `table[number]` syntax. */
+- (BLIPMessage*) objectAtIndexedSubscript: (NSUInteger)number;
+
+/** Adds a message with the given number, or removes it if msg is nil. Supports
+    `table[number] = msg` syntax. */
+- (void) setObject: (BLIPMessage*)msg atIndexedSubscript: (NSUInteger)number;
+
+/** Removes the message with the given number, if any. */
+- (void) removeMessageWithNumber: (NSUInteger)number;
+
+/** All the messages in the table, in order of number. */
+@property (readonly) NSArray* allMessages;
+
+@end
+
+
+/** Schedules deadlines for message numbers on a hashed timer wheel: a ring of slots, each holding
+    the deadlines that fall in one tick. Adding a deadline takes constant time, and the timer only
+    has to look at one slot per tick, however many deadlines are pending. Deadlines are never
+    cancelled; the handler should ignore ones whose message has already finished.
+    Must be used only on the queue it's created with. */
+@interface BLIPDeadlineWheel : NSObject
+
+/** @param queue  The queue that the handler is called on.
+    @param resolution  The tick length; deadlines may be reached up to this much late.
+    @param onExpired  Called with a message number whose deadline has passed. */
+- (instancetype) initWithQueue: (dispatch_queue_t)queue
+                    resolution: (NSTimeInterval)resolution
+                     onExpired: (void(^)(UInt32 number))onExpired;
+
+/** Schedules a deadline for a message number. */
+- (void) addDeadline: (CFAbsoluteTime)deadline forNumber: (UInt32)number;
+
+/** The number of deadlines scheduled. */
+@property (readonly) NSUInteger count;
+
+/** Discards all deadlines and stops the timer. */
+- (void) removeAllDeadlines;
+
+@end
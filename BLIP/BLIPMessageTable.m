@@ -0,0 +1,382 @@
+//
+//  BLIPMessageTable.m
+//  WebSocket
+//
+//  Copyright (c) 2015 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "BLIPMessageTable.h"
+#import "BLIP_Internal.h"
+
+#import "Test.h"
+
+
+// Max number of slots in a BLIPMessageTable's window
+#define kMaxWindowSize 1024
+
+
+@implementation BLIPMessageTable
+{
+    // Slot i holds message number _base+i, or NSNull. NSMutableArray is a ring buffer, so
+    // trimming empty slots off the start takes constant time.
+    NSMutableArray* _slots;
+    NSUInteger _base;
+    NSUInteger _count;
+    NSMutableDictionary* _outliers;     // Messages that don't fit in the window, keyed by number
+}
+
+@synthesize count=_count;
+
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        _slots = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+
+- (BLIPMessage*) objectAtIndexedSubscript: (NSUInteger)number {
+    if (number < _base || number - _base >= _slots.count)
+        return _outliers.count ? _outliers[@(number)] : nil;
+    id msg = _slots[number - _base];
+    return (msg == [NSNull null]) ? nil : msg;
+}
+
+
+- (void) setObject: (BLIPMessage*)msg atIndexedSubscript: (NSUInteger)number {
+    if (!msg) {
+        [self removeMessageWithNumber: number];
+        return;
+    }
+    id null = [NSNull null];
+    if (_outliers.count && _outliers[@(number)]) {
+        _outliers[@(number)] = msg;
+        return;
+    }
+    if (_slots.count == 0) {
+        _base = number;
+    } else if (number < _base) {
+        if (_base - number + _slots.count > kMaxWindowSize) {
+            [self addOutlier: msg number: number];
+            return;
+        }
+        // Rare: extend the window backwards
+        for (NSUInteger i = _base - number; i > 0; --i)
+            [_slots insertObject: null atIndex: 0];
+        _base = number;
+    } else if (number - _base >= kMaxWindowSize) {
+        // Slide the window forward, moving any messages it leaves behind to _outliers:
+        NSUInteger newBase = number - kMaxWindowSize + 1;
+        while (_slots.count > 0 && _base < newBase) {
+            id old = _slots[0];
+            [_slots removeObjectAtIndex: 0];
+            if (old != null) {
+                --_count;
+                [self addOutlier: old number: _base];
+            }
+            ++_base;
+        }
+        [self trimSlots];
+        if (_slots.count == 0)
+            _base = number;
+    }
+    while (number - _base >= _slots.count)
+        [_slots addObject: null];
+    if (_slots[number - _base] == null)
+        ++_count;
+    _slots[number - _base] = msg;
+}
+
+
+- (void) addOutlier: (BLIPMessage*)msg number: (NSUInteger)number {
+    if (!_outliers)
+        _outliers = [[NSMutableDictionary alloc] init];
+    _outliers[@(number)] = msg;
+    ++_count;
+}
+
+
+- (void) removeMessageWithNumber: (NSUInteger)number {
+    id null = [NSNull null];
+    if (number < _base || number - _base >= _slots.count || _slots[number - _base] == null) {
+        if (_outliers[@(number)]) {
+            [_outliers removeObjectForKey: @(number)];
+            --_count;
+        }
+        return;
+    }
+    _slots[number - _base] = null;
+    --_count;
+    [self trimSlots];
+}
+
+
+// Slides the window past empty slots at either end.
+- (void) trimSlots {
+    id null = [NSNull null];
+    while (_slots.count > 0 && _slots[0] == null) {
+        [_slots removeObjectAtIndex: 0];
+        ++_base;
+    }
+    while (_slots.count > 0 && _slots.lastObject == null)
+        [_slots removeLastObject];
+}
+
+
+- (NSArray*) allMessages {
+    NSMutableArray* messages = [NSMutableArray arrayWithCapacity: _count];
+    for (id msg in _slots) {
+        if (msg != [NSNull null])
+            [messages addObject: msg];
+    }
+    if (_outliers.count) {
+        [messages addObjectsFromArray: _outliers.allValues];
+        [messages sortUsingComparator: ^NSComparisonResult(BLIPMessage* a, BLIPMessage* b) {
+            return a.number < b.number ? NSOrderedAscending
+                                       : (a.number > b.number ? NSOrderedDescending
+                                                              : NSOrderedSame);
+        }];
+    }
+    return messages;
+}
+
+
+@end
+
+
+
+
+// Number of slots in the wheel. Deadlines further ahead than one turn stay in their slot until
+// a later turn.
+#define kWheelSize 64
+
+
+@interface BLIPDeadline : NSObject
+{
+    @public
+    CFAbsoluteTime _time;
+    UInt32 _number;
+}
+@end
+
+@implementation BLIPDeadline
+@end
+
+
+@implementation BLIPDeadlineWheel
+{
+    dispatch_queue_t _queue;
+    NSTimeInterval _resolution;
+    void (^_onExpired)(UInt32);
+    NSMutableArray* _slots[kWheelSize];
+    uint64_t _currentTick;          // The next tick to be processed
+    NSUInteger _count;
+    dispatch_source_t _timer;       // Only exists while there are deadlines
+}
+
+@synthesize count=_count;
+
+
+- (instancetype) initWithQueue: (dispatch_queue_t)queue
+                    resolution: (NSTimeInterval)resolution
+                     onExpired: (void(^)(UInt32 number))onExpired
+{
+    self = [super init];
+    if (self) {
+        _queue = queue;
+        _resolution = resolution;
+        _onExpired = [onExpired copy];
+        for (int i = 0; i < kWheelSize; i++)
+            _slots[i] = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    if (_timer)
+        dispatch_source_cancel(_timer);
+}
+
+
+- (uint64_t) tickForTime: (CFAbsoluteTime)time {
+    return (uint64_t)(MAX(time, 0.0) / _resolution);
+}
+
+
+- (void) addDeadline: (CFAbsoluteTime)time forNumber: (UInt32)number {
+    if (_count == 0)
+        _currentTick = [self tickForTime: CFAbsoluteTimeGetCurrent()];
+    BLIPDeadline* deadline = [[BLIPDeadline alloc] init];
+    deadline->_time = time;
+    deadline->_number = number;
+    uint64_t tick = MAX([self tickForTime: time], _currentTick);
+    [_slots[tick % kWheelSize] addObject: deadline];
+    if (_count++ == 0)
+        [self startTimer];
+}
+
+
+- (void) startTimer {
+    _timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+    uint64_t interval = (uint64_t)(_resolution * NSEC_PER_SEC);
+    dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, interval),
+                              interval, interval / 4);
+    __weak BLIPDeadlineWheel* weakSelf = self;
+    dispatch_source_set_event_handler(_timer, ^{
+        [weakSelf tick];
+    });
+    dispatch_resume(_timer);
+}
+
+
+- (void) stopTimer {
+    if (_timer) {
+        dispatch_source_cancel(_timer);
+        _timer = nil;
+    }
+}
+
+
+// Expires the deadlines in every slot whose tick has completed.
+- (void) tick {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    uint64_t nowTick = [self tickForTime: now];
+    NSMutableArray* expired = [NSMutableArray array];
+    for (int n = 0; _currentTick < nowTick && n < kWheelSize; ++n, ++_currentTick) {
+        NSMutableArray* slot = _slots[_currentTick % kWheelSize];
+        for (NSUInteger i = slot.count; i-- > 0; ) {
+            BLIPDeadline* deadline = slot[i];
+            if (deadline->_time <= now) {
+                [expired addObject: deadline];
+                [slot removeObjectAtIndex: i];
+            }
+        }
+    }
+    _currentTick = MAX(_currentTick, nowTick);
+    _count -= expired.count;
+    if (_count == 0)
+        [self stopTimer];
+
+    [expired sortUsingComparator: ^NSComparisonResult(BLIPDeadline* a, BLIPDeadline* b) {
+        return a->_number < b->_number ? NSOrderedAscending
+                                       : (a->_number > b->_number ? NSOrderedDescending
+                                                                  : NSOrderedSame);
+    }];
+    for (BLIPDeadline* deadline in expired)
+        _onExpired(deadline->_number);
+}
+
+
+- (void) removeAllDeadlines {
+    for (int i = 0; i < kWheelSize; i++)
+        [_slots[i] removeAllObjects];
+    _count = 0;
+    [self stopTimer];
+}
+
+
+@end
+
+
+
+
+#pragma mark - TESTS:
+#if DEBUG
+
+TestCase(BLIPMessageTable) {
+    BLIPMessageTable* table = [[BLIPMessageTable alloc] init];
+    CAssert(table[1] == nil);
+    NSMutableArray* msgs = [NSMutableArray array];
+    for (UInt32 i = 1; i <= 10; i++) {
+        BLIPRequest* msg = [BLIPRequest requestWithBody: nil properties: nil];
+        [msg _assignedNumber: i];
+        [msgs addObject: msg];
+        table[i] = msg;
+    }
+    CAssertEq(table.count, 10u);
+    CAssert(table[3] == msgs[2]);
+    CAssert(table[11] == nil);
+    CAssert(table[0] == nil);
+
+    // Remove out of order; the window slides forward as the lowest numbers go away:
+    table[5] = nil;
+    [table removeMessageWithNumber: 1];
+    [table removeMessageWithNumber: 1];
+    CAssertEq(table.count, 8u);
+    CAssert(table[1] == nil);
+    CAssert(table[5] == nil);
+    CAssert(table[2] == msgs[1]);
+    NSArray* all = table.allMessages;
+    CAssertEq(all.count, 8u);
+    CAssert(all[0] == msgs[1]);
+    CAssert(all.lastObject == msgs[9]);
+    for (UInt32 i = 1; i <= 10; i++)
+        [table removeMessageWithNumber: i];
+    CAssertEq(table.count, 0u);
+
+    // Reusing the table after it's emptied:
+    table[100] = msgs[0];
+    table[98] = msgs[1];
+    CAssert(table[100] == msgs[0]);
+    CAssert(table[98] == msgs[1]);
+    CAssert(table[99] == nil);
+    CAssertEq(table.count, 2u);
+    [table removeMessageWithNumber: 100];
+    [table removeMessageWithNumber: 98];
+
+    // One message stays while many later ones come and go; the window doesn't grow without bound:
+    table[1] = msgs[0];
+    for (UInt32 i = 2; i <= 5000; i++) {
+        table[i] = msgs[1];
+        [table removeMessageWithNumber: i];
+    }
+    table[5001] = msgs[2];
+    CAssertEq(table.count, 2u);
+    CAssert(table[1] == msgs[0]);
+    CAssert(table[5001] == msgs[2]);
+    CAssert(table[2] == nil);
+    all = table.allMessages;
+    CAssertEq(all.count, 2u);
+    CAssert(all[0] == msgs[0]);
+    table[1] = nil;
+    CAssertEq(table.count, 1u);
+    CAssert(table[1] == nil);
+}
+
+
+TestCase(BLIPDeadlineWheel) {
+    dispatch_queue_t queue = dispatch_queue_create("BLIPDeadlineWheel test", DISPATCH_QUEUE_SERIAL);
+    NSMutableArray* expired = [NSMutableArray array];
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    BLIPDeadlineWheel* wheel = [[BLIPDeadlineWheel alloc] initWithQueue: queue
+                                                             resolution: 0.01
+                                                              onExpired: ^(UInt32 number) {
+        [expired addObject: @(number)];
+        if (expired.count == 3)
+            dispatch_semaphore_signal(done);
+    }];
+    dispatch_sync(queue, ^{
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        [wheel addDeadline: now + 0.05 forNumber: 2];
+        [wheel addDeadline: now + 1.0 forNumber: 3];   // more than one turn of the wheel ahead
+        [wheel addDeadline: now + 0.02 forNumber: 1];
+        CAssertEq(wheel.count, 3u);
+    });
+    CAssertEq(dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, 5*NSEC_PER_SEC)), 0);
+    dispatch_sync(queue, ^{
+        CAssertEqual(expired, (@[@1, @2, @3]));
+        CAssertEq(wheel.count, 0u);
+    });
+}
+
+#endif
@@ -0,0 +1,36 @@
+//
+//  BLIPOutbox.h
+//  WebSocket
+//
+//  Copyright (c) 2015 Couchbase, Inc. All rights reserved.
+
+#import "BLIPMessage.h"
+
+
+/** Schedules a BLIPConnection's outgoing messages, one frame at a time.
+    Messages wait in a FIFO per priority class, and classes take turns by weighted round-robin,
+    so higher priorities get most of the bandwidth without starving the lower ones.
+    All operations take constant time. Not thread-safe; BLIPConnection uses it only on its
+    transport queue. */
+@interface BLIPOutbox : NSObject
+
+/** Adds a message that has a frame ready to send.
+    @param isNew  YES if no frames of the message have been sent yet. New requests are started in
+            the order they were added (as the protocol requires), so a request can't start ahead
+            of an earlier one; instead the earlier ones inherit its priority. */
+- (void) addMessage: (BLIPMessage*)msg isNew: (BOOL)isNew;
+
+/** Removes and returns the message that should send the next frame, or nil if empty.
+    The caller should add it back after sending its frame, if it has more to send. */
+- (BLIPMessage*) popMessage;
+
+/** The total number of messages waiting. */
+@property (readonly) NSUInteger count;
+
+/** The number of waiting messages with the given priority. */
+- (NSUInteger) countForPriority: (BLIPPriority)priority;
+
+/** YES if any message waiting is of a higher priority class than the given one. */
+- (BOOL) hasMessagesAbovePriority: (BLIPPriority)priority;
+
+@end
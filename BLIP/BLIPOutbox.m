@@ -0,0 +1,196 @@
+//
+//  BLIPOutbox.m
+//  WebSocket
+//
+//  Copyright (c) 2015 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "BLIPOutbox.h"
+#import "BLIP_Internal.h"
+
+#import "Test.h"
+
+
+// Number of frames each priority class may send per round-robin round
+static const NSUInteger kPriorityWeights[kBLIPNumPriorities] = {1, 4, 8, 16};
+
+
+@implementation BLIPOutbox
+{
+    // Messages ready to send, one FIFO per priority class. (NSMutableArray is a ring buffer, so
+    // adding at the end and removing at the start take constant time.)
+    NSMutableArray* _queues[kBLIPNumPriorities];
+    NSUInteger _credits[kBLIPNumPriorities];    // Turns left for each class in this round
+    NSMutableArray* _unstarted;                 // New requests waiting for earlier ones to start
+    NSUInteger _unstartedCounts[kBLIPNumPriorities]; // Number of _unstarted per priority
+    BLIPMessage* _nextRequest;                  // The next new request to start, if any
+    NSUInteger _count;
+}
+
+@synthesize count=_count;
+
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        for (int i = 0; i < kBLIPNumPriorities; i++) {
+            _queues[i] = [[NSMutableArray alloc] init];
+            _credits[i] = kPriorityWeights[i];
+        }
+        _unstarted = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+
+- (void) addMessage: (BLIPMessage*)msg isNew: (BOOL)isNew {
+    if (isNew && msg.isRequest) {
+        // Requests have to start in order, so only one at a time is eligible to be sent:
+        if (_nextRequest) {
+            [_unstarted addObject: msg];
+            ++_unstartedCounts[msg.priority];
+        } else {
+            _nextRequest = msg;
+        }
+    } else {
+        [_queues[msg.priority] addObject: msg];
+    }
+    ++_count;
+}
+
+
+// The priority class _nextRequest is scheduled in: its own, or that of the most urgent request
+// waiting behind it, whichever is higher.
+- (BLIPPriority) nextRequestPriority {
+    for (int i = kBLIPNumPriorities - 1; i > _nextRequest.priority; i--) {
+        if (_unstartedCounts[i] > 0)
+            return (BLIPPriority)i;
+    }
+    return _nextRequest.priority;
+}
+
+
+- (BOOL) hasMessagesWithPriority: (BLIPPriority)priority {
+    return _queues[priority].count > 0
+        || (_nextRequest && self.nextRequestPriority == priority);
+}
+
+
+- (BLIPMessage*) popMessage {
+    if (_count == 0)
+        return nil;
+    for (;;) {
+        // Pick the highest-priority class that has messages and hasn't used up its turns:
+        for (int i = kBLIPNumPriorities - 1; i >= 0; i--) {
+            if (_credits[i] > 0 && [self hasMessagesWithPriority: (BLIPPriority)i])
+                return [self popMessageWithPriority: (BLIPPriority)i];
+        }
+        // Every class with messages has used up its turns, so start a new round:
+        for (int i = 0; i < kBLIPNumPriorities; i++)
+            _credits[i] = kPriorityWeights[i];
+    }
+}
+
+
+- (BLIPMessage*) popMessageWithPriority: (BLIPPriority)priority {
+    BLIPMessage* msg;
+    if (_nextRequest && self.nextRequestPriority == priority) {
+        // Start the next request, and make the one after it eligible:
+        msg = _nextRequest;
+        _nextRequest = nil;
+        if (_unstarted.count > 0) {
+            _nextRequest = _unstarted[0];
+            [_unstarted removeObjectAtIndex: 0];
+            --_unstartedCounts[_nextRequest.priority];
+        }
+    } else {
+        msg = _queues[priority][0];
+        [_queues[priority] removeObjectAtIndex: 0];
+    }
+    --_credits[priority];
+    --_count;
+    return msg;
+}
+
+
+- (NSUInteger) countForPriority: (BLIPPriority)priority {
+    NSUInteger count = _queues[priority].count + _unstartedCounts[priority];
+    if (_nextRequest && _nextRequest.priority == priority)
+        ++count;
+    return count;
+}
+
+
+- (BOOL) hasMessagesAbovePriority: (BLIPPriority)priority {
+    for (int i = kBLIPNumPriorities - 1; i > priority; i--) {
+        if ([self hasMessagesWithPriority: (BLIPPriority)i])
+            return YES;
+    }
+    return NO;
+}
+
+
+@end
+
+
+
+
+#pragma mark - TESTS:
+#if DEBUG
+
+static BLIPMessage* makeRequest(BLIPPriority priority, UInt32 number) {
+    BLIPRequest* msg = [BLIPRequest requestWithBody: nil properties: nil];
+    msg.priority = priority;
+    [msg _assignedNumber: number];
+    return msg;
+}
+
+TestCase(BLIPOutbox) {
+    BLIPOutbox* outbox = [[BLIPOutbox alloc] init];
+    CAssert([outbox popMessage] == nil);
+
+    // Higher priorities get more turns, but lower ones aren't starved:
+    for (UInt32 i = 1; i <= 20; i++) {
+        [outbox addMessage: makeRequest(kBLIPPriorityNormal, i) isNew: NO];
+        [outbox addMessage: makeRequest(kBLIPPriorityUrgent, 100+i) isNew: NO];
+    }
+    CAssertEq(outbox.count, 40u);
+    CAssertEq([outbox countForPriority: kBLIPPriorityUrgent], 20u);
+    CAssert([outbox hasMessagesAbovePriority: kBLIPPriorityNormal]);
+    CAssert(![outbox hasMessagesAbovePriority: kBLIPPriorityUrgent]);
+    NSUInteger urgent = 0, normal = 0;
+    for (int i = 0; i < 24; i++) {
+        if ([outbox popMessage].priority == kBLIPPriorityUrgent)
+            ++urgent;
+        else
+            ++normal;
+    }
+    CAssertEq(urgent, 16u);
+    CAssertEq(normal, 8u);
+    while ([outbox popMessage])
+        ;
+    CAssertEq(outbox.count, 0u);
+
+    // New requests start in order; an urgent one raises the priority of those ahead of it:
+    [outbox addMessage: makeRequest(kBLIPPriorityNormal, 50) isNew: NO];
+    [outbox addMessage: makeRequest(kBLIPPriorityBackground, 1) isNew: YES];
+    [outbox addMessage: makeRequest(kBLIPPriorityNormal, 2) isNew: YES];
+    [outbox addMessage: makeRequest(kBLIPPriorityInteractive, 3) isNew: YES];
+    CAssertEq([outbox countForPriority: kBLIPPriorityBackground], 1u);
+    CAssertEq([outbox countForPriority: kBLIPPriorityInteractive], 1u);
+    CAssert([outbox hasMessagesAbovePriority: kBLIPPriorityUrgent]);
+    CAssertEq([outbox popMessage].number, 1u);
+    CAssertEq([outbox popMessage].number, 2u);
+    CAssertEq([outbox popMessage].number, 3u);
+    CAssertEq([outbox popMessage].number, 50u);
+    CAssert([outbox popMessage] == nil);
+}
+
+#endif
@@ -8,8 +8,22 @@
 #import "BLIPWebSocketConnection.h"
 
 
+/** Statistics about a BLIPPool's connections to one URL. */
+typedef struct {
+    NSUInteger connections;         // Connections currently open or opening
+    NSUInteger load;                // Total `load` of those connections
+    NSUInteger requestsRouted;      // Number of times a connection was handed out
+    NSUInteger connectionsOpened;   // Connections opened so far
+    NSUInteger connectionsReaped;   // Connections closed so far for being idle
+} BLIPPoolStats;
+
+
 /** A pool of open BLIPWebSocketConnections to different URLs.
-    By using this class you can conserve sockets by opening only a single socket to a WebSocket endpoint. */
+    By default it keeps only a single socket to a WebSocket endpoint, to conserve sockets. If
+    maxConnectionsPerURL is raised, it opens more connections to an endpoint as they get busy,
+    and hands out the least-loaded one each time, so traffic isn't all serialized over one TCP
+    connection and one queue. (Messages sent over different connections may arrive in any order
+    relative to each other.) */
 @interface BLIPPool : NSObject
 
 - (instancetype) initWithDelegate: (id<BLIPConnectionDelegate>)delegate
@@ -18,12 +32,29 @@
 /** All the opened sockets will call this delegate. */
 @property (weak) id<BLIPConnectionDelegate> delegate;
 
-/** Returns an open BLIPConnection to the given URL. If none is open yet, it will open one. */
+/** The maximum number of connections to open to a URL. Defaults to 1.
+    A new connection is only opened when all the existing ones are busy (have nonzero `load`.) */
+@property NSUInteger maxConnectionsPerURL;
+
+/** If nonzero, connections that haven't been handed out, or had any traffic, for this many seconds
+    are closed. Defaults to 0 (never.) */
+@property NSTimeInterval idleTimeout;
+
+/** Returns an open BLIPConnection to the given URL: the least-loaded one, or a new one if they're
+    all busy and there's room for another. */
 - (BLIPWebSocketConnection*) socketToURL: (NSURL*)url error: (NSError**)outError;
 
-/** Returns an already-open BLIPWebSocketConnection to the given URL, or nil if there is none. */
+/** Returns the least-loaded already-open BLIPWebSocketConnection to the given URL, or nil if there
+    is none. */
 - (BLIPWebSocketConnection*) existingSocketToURL: (NSURL*)url error: (NSError**)outError;
 
+/** Opens connections to the URL in advance, until there are `count` of them (but no more than
+    maxConnectionsPerURL.) */
+- (BOOL) warmUpConnectionsToURL: (NSURL*)url count: (NSUInteger)count error: (NSError**)outError;
+
+/** Returns statistics about the connections to the URL. */
+- (BLIPPoolStats) statsForURL: (NSURL*)url;
+
 /** Closes all open sockets, with the default status code. */
 - (void) close;
 
@@ -15,9 +15,37 @@
 
 #import "BLIPPool.h"
 #import "BLIPWebSocketConnection.h"
+#import "Test.h"
 
 
 @interface BLIPPool () <BLIPConnectionDelegate>
+- (void) closeIdleConnections;
+@end
+
+
+// One of the pool's connections.
+@interface BLIPPoolEntry : NSObject
+{
+    @public
+    BLIPWebSocketConnection* _connection;
+    CFAbsoluteTime _lastUsed;       // When it was last handed out or seen to be active
+}
+@end
+
+@implementation BLIPPoolEntry
+@end
+
+
+// The pool's connections to one URL.
+@interface BLIPPoolEndpoint : NSObject
+{
+    @public
+    NSMutableArray* _entries;       // BLIPPoolEntry objects
+    BLIPPoolStats _stats;
+}
+@end
+
+@implementation BLIPPoolEndpoint
 @end
 
 
@@ -25,11 +53,14 @@
 {
     __weak id<BLIPConnectionDelegate> _delegate;
     dispatch_queue_t _queue;
-    NSMutableDictionary* _sockets;
+    NSMutableDictionary* _endpoints;    // Maps URL -> BLIPPoolEndpoint
+    NSUInteger _maxConnectionsPerURL;
+    NSTimeInterval _idleTimeout;
+    dispatch_source_t _reapTimer;
 }
 
 
-@synthesize delegate=_delegate;
+@synthesize delegate=_delegate, maxConnectionsPerURL=_maxConnectionsPerURL;
 
 
 - (instancetype) initWithDelegate: (id<BLIPConnectionDelegate>)delegate
@@ -39,21 +70,62 @@
     if (self) {
         _delegate = delegate;
         _queue = queue;
-        _sockets = [[NSMutableDictionary alloc] init];
+        _endpoints = [[NSMutableDictionary alloc] init];
+        _maxConnectionsPerURL = 1;
     }
     return self;
 }
 
 
 - (void) dealloc {
+    if (_reapTimer)
+        dispatch_source_cancel(_reapTimer);
     [self closeWithCode: kWebSocketCloseGoingAway reason: nil];
 }
 
 
+// Returns the endpoint's connection with the lowest load. Must be called within @synchronized.
+static BLIPPoolEntry* leastLoadedEntry(BLIPPoolEndpoint* endpoint) {
+    if (!endpoint)
+        return nil;
+    BLIPPoolEntry* best = nil;
+    NSUInteger bestLoad = NSUIntegerMax, bestQueued = NSUIntegerMax;
+    for (BLIPPoolEntry* entry in endpoint->_entries) {
+        NSUInteger load = entry->_connection.load;
+        NSUInteger queued = entry->_connection.webSocket.queuedOutputBytes;
+        if (load < bestLoad || (load == bestLoad && queued < bestQueued)) {
+            best = entry;
+            bestLoad = load;
+            bestQueued = queued;
+        }
+    }
+    return best;
+}
+
+
+// Opens a new connection and adds it to the endpoint. Must be called within @synchronized.
+- (BLIPPoolEntry*) openConnectionToURL: (NSURL*)url
+                              endpoint: (BLIPPoolEndpoint*)endpoint
+                                 error: (NSError**)outError
+{
+    BLIPWebSocketConnection* socket = [[BLIPWebSocketConnection alloc] initWithURL: url];
+    [socket setDelegate: self queue: _queue];
+    if (![socket connect: outError])
+        return nil;
+    BLIPPoolEntry* entry = [[BLIPPoolEntry alloc] init];
+    entry->_connection = socket;
+    entry->_lastUsed = CFAbsoluteTimeGetCurrent();
+    [endpoint->_entries addObject: entry];
+    ++endpoint->_stats.connectionsOpened;
+    return entry;
+}
+
+
 // Returns an already-open BLIPWebSocketConnection to use to communicate with a given URL.
 - (BLIPWebSocketConnection*) existingSocketToURL: (NSURL*)url error: (NSError**)outError {
     @synchronized(self) {
-        return _sockets[url];
+        BLIPPoolEntry* entry = leastLoadedEntry(_endpoints[url]);
+        return entry ? entry->_connection : nil;
     }
 }
 
@@ -61,41 +133,149 @@
 // Returns an open BLIPWebSocketConnection to use to communicate with a given URL.
 - (BLIPWebSocketConnection*) socketToURL: (NSURL*)url error: (NSError**)outError {
     @synchronized(self) {
-        BLIPWebSocketConnection* socket = _sockets[url];
-        if (!socket) {
-            if (!_sockets) {
-                // I'm closed already
+        if (!_endpoints) {
+            // I'm closed already
+            if (outError)
+                *outError = nil;
+            return nil;
+        }
+        BLIPPoolEndpoint* endpoint = _endpoints[url];
+        if (!endpoint) {
+            endpoint = [[BLIPPoolEndpoint alloc] init];
+            endpoint->_entries = [[NSMutableArray alloc] init];
+            _endpoints[url] = endpoint;
+        }
+        BLIPPoolEntry* entry = leastLoadedEntry(endpoint);
+        if (!entry || (entry->_connection.load > 0
+                            && endpoint->_entries.count < _maxConnectionsPerURL)) {
+            // All the connections are busy (or there are none), so open another:
+            NSError* error;
+            BLIPPoolEntry* newEntry = [self openConnectionToURL: url endpoint: endpoint
+                                                          error: &error];
+            if (newEntry) {
+                entry = newEntry;
+            } else if (!entry) {
                 if (outError)
-                    *outError = nil;
+                    *outError = error;
                 return nil;
             }
-            socket = [[BLIPWebSocketConnection alloc] initWithURL: url];
-            [socket setDelegate: self queue: _queue];
-            if (![socket connect: outError])
-                return nil;
-            _sockets[url] = socket;
         }
-        return socket;
+        entry->_lastUsed = CFAbsoluteTimeGetCurrent();
+        ++endpoint->_stats.requestsRouted;
+        return entry->_connection;
+    }
+}
+
+
+- (BOOL) warmUpConnectionsToURL: (NSURL*)url count: (NSUInteger)count error: (NSError**)outError {
+    @synchronized(self) {
+        if (!_endpoints)
+            return NO;
+        BLIPPoolEndpoint* endpoint = _endpoints[url];
+        if (!endpoint) {
+            endpoint = [[BLIPPoolEndpoint alloc] init];
+            endpoint->_entries = [[NSMutableArray alloc] init];
+            _endpoints[url] = endpoint;
+        }
+        count = MIN(count, _maxConnectionsPerURL);
+        while (endpoint->_entries.count < count) {
+            if (![self openConnectionToURL: url endpoint: endpoint error: outError])
+                return NO;
+        }
+        return YES;
+    }
+}
+
+
+- (BLIPPoolStats) statsForURL: (NSURL*)url {
+    @synchronized(self) {
+        BLIPPoolEndpoint* endpoint = _endpoints[url];
+        if (!endpoint)
+            return (BLIPPoolStats){0};
+        BLIPPoolStats stats = endpoint->_stats;
+        stats.connections = endpoint->_entries.count;
+        for (BLIPPoolEntry* entry in endpoint->_entries)
+            stats.load += entry->_connection.load;
+        return stats;
     }
 }
 
 
+- (NSTimeInterval) idleTimeout {
+    @synchronized(self) {
+        return _idleTimeout;
+    }
+}
+
+- (void) setIdleTimeout: (NSTimeInterval)idleTimeout {
+    @synchronized(self) {
+        _idleTimeout = idleTimeout;
+        if (_reapTimer) {
+            dispatch_source_cancel(_reapTimer);
+            _reapTimer = nil;
+        }
+        if (idleTimeout > 0) {
+            // Check for idle connections a few times per timeout period:
+            _reapTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+            uint64_t interval = (uint64_t)(MAX(idleTimeout / 4, 0.1) * NSEC_PER_SEC);
+            dispatch_source_set_timer(_reapTimer, dispatch_time(DISPATCH_TIME_NOW, interval),
+                                      interval, interval / 4);
+            __weak BLIPPool* weakSelf = self;
+            dispatch_source_set_event_handler(_reapTimer, ^{
+                [weakSelf closeIdleConnections];
+            });
+            dispatch_resume(_reapTimer);
+        }
+    }
+}
+
+
+- (void) closeIdleConnections {
+    NSMutableArray* idle = [NSMutableArray array];
+    @synchronized(self) {
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        for (BLIPPoolEndpoint* endpoint in _endpoints.allValues) {
+            for (BLIPPoolEntry* entry in [endpoint->_entries copy]) {
+                if (entry->_connection.active) {
+                    entry->_lastUsed = now;
+                } else if (now - entry->_lastUsed >= _idleTimeout) {
+                    [idle addObject: entry->_connection];
+                    [endpoint->_entries removeObjectIdenticalTo: entry];
+                    ++endpoint->_stats.connectionsReaped;
+                }
+            }
+        }
+    }
+    for (BLIPWebSocketConnection* socket in idle)
+        [socket closeWithCode: kWebSocketCloseNormal reason: @"Idle"];
+}
+
+
 - (void) forgetSocket: (BLIPConnection*)webSocket {
     @synchronized(self) {
-        [_sockets removeObjectForKey: webSocket.URL];
+        BLIPPoolEndpoint* endpoint = _endpoints[webSocket.URL];
+        if (!endpoint)
+            return;
+        NSMutableArray* entries = endpoint->_entries;
+        for (NSUInteger i = 0; i < entries.count; i++) {
+            if (((BLIPPoolEntry*)entries[i])->_connection == webSocket) {
+                [entries removeObjectAtIndex: i];
+                break;
+            }
+        }
     }
 }
 
 
 - (void) closeWithCode:(WebSocketCloseCode)code reason:(NSString *)reason {
-    NSDictionary* sockets;
+    NSDictionary* endpoints;
     @synchronized(self) {
-        sockets = _sockets;
-        _sockets = nil; // marks that I'm closed
+        endpoints = _endpoints;
+        _endpoints = nil; // marks that I'm closed
     }
-    for (NSURL* url in sockets) {
-        BLIPWebSocketConnection* socket = sockets[url];
-        [socket closeWithCode: code reason: reason];
+    for (BLIPPoolEndpoint* endpoint in endpoints.allValues) {
+        for (BLIPPoolEntry* entry in endpoint->_entries)
+            [entry->_connection closeWithCode: code reason: reason];
     }
 }
 
@@ -146,3 +326,120 @@
 
 
 @end
+
+
+
+#pragma mark - TESTS:
+#if DEBUG
+
+// A connection that never touches the network, with a load and activity set by the test.
+@interface BLIPPoolTestConnection : BLIPWebSocketConnection
+{
+    @public
+    NSUInteger _fakeLoad;
+    BOOL _fakeActive, _closed;
+}
+@end
+
+@implementation BLIPPoolTestConnection
+- (NSUInteger) load                                     {return _fakeLoad;}
+- (BOOL) active                                         {return _fakeActive;}
+- (void) closeWithCode: (WebSocketCloseCode)code reason: (NSString*)reason {_closed = YES;}
+@end
+
+
+// A pool that opens BLIPPoolTestConnections, or fails to open anything if _failOpen is set.
+@interface BLIPTestPool : BLIPPool
+{
+    @public
+    NSMutableArray* _opened;        // BLIPPoolEntry objects, in the order they were opened
+    BOOL _failOpen;
+}
+@end
+
+@implementation BLIPTestPool
+- (BLIPPoolEntry*) openConnectionToURL: (NSURL*)url
+                              endpoint: (BLIPPoolEndpoint*)endpoint
+                                 error: (NSError**)outError
+{
+    if (_failOpen) {
+        if (outError)
+            *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: ECONNREFUSED
+                                        userInfo: nil];
+        return nil;
+    }
+    BLIPPoolEntry* entry = [[BLIPPoolEntry alloc] init];
+    entry->_connection = [[BLIPPoolTestConnection alloc] initWithURL: url];
+    entry->_lastUsed = CFAbsoluteTimeGetCurrent();
+    [endpoint->_entries addObject: entry];
+    ++endpoint->_stats.connectionsOpened;
+    if (!_opened)
+        _opened = [NSMutableArray array];
+    [_opened addObject: entry];
+    return entry;
+}
+@end
+
+
+TestCase(BLIPPool) {
+    NSURL* url = [NSURL URLWithString: @"ws://example.com/db"];
+    BLIPTestPool* pool = [[BLIPTestPool alloc] initWithDelegate: nil
+                                                  dispatchQueue: dispatch_get_main_queue()];
+    pool.maxConnectionsPerURL = 2;
+    NSError* error;
+
+    // The first request opens a connection, which is reused while it's idle:
+    BLIPWebSocketConnection* conn1 = [pool socketToURL: url error: &error];
+    CAssert(conn1, @"%@", error);
+    CAssertEq([pool socketToURL: url error: &error], conn1);
+    CAssertEq(pool->_opened.count, 1u);
+    BLIPPoolTestConnection* fake1 = (BLIPPoolTestConnection*)conn1;
+
+    // Once it's busy, a second connection is opened:
+    fake1->_fakeLoad = 3;
+    BLIPWebSocketConnection* conn2 = [pool socketToURL: url error: &error];
+    CAssert(conn2 && conn2 != conn1);
+    CAssertEq(pool->_opened.count, 2u);
+    BLIPPoolTestConnection* fake2 = (BLIPPoolTestConnection*)conn2;
+
+    // At maxConnectionsPerURL, the least loaded connection is handed out:
+    fake2->_fakeLoad = 5;
+    CAssertEq([pool socketToURL: url error: &error], conn1);
+    fake2->_fakeLoad = 1;
+    CAssertEq([pool socketToURL: url error: &error], conn2);
+    CAssertEq(pool->_opened.count, 2u);
+
+    // If opening an extra connection fails, an existing one is used and no error is returned:
+    pool.maxConnectionsPerURL = 3;
+    pool->_failOpen = YES;
+    error = nil;
+    CAssertEq([pool socketToURL: url error: &error], conn2);
+    CAssertNil(error);
+
+    // ...but with no existing connection, the error is returned:
+    NSURL* otherURL = [NSURL URLWithString: @"ws://example.org/db"];
+    CAssert([pool socketToURL: otherURL error: &error] == nil);
+    CAssertEq(error.code, ECONNREFUSED);
+    pool->_failOpen = NO;
+
+    BLIPPoolStats stats = [pool statsForURL: url];
+    CAssertEq(stats.connections, 2u);
+    CAssertEq(stats.load, 4u);
+    CAssertEq(stats.requestsRouted, 6u);
+    CAssertEq(stats.connectionsOpened, 2u);
+
+    // Only inactive connections unused for idleTimeout are closed:
+    pool.idleTimeout = 60;
+    for (BLIPPoolEntry* entry in pool->_opened)
+        entry->_lastUsed -= 120;
+    fake2->_fakeActive = YES;
+    [pool closeIdleConnections];
+    CAssert(fake1->_closed);
+    CAssert(!fake2->_closed);
+    stats = [pool statsForURL: url];
+    CAssertEq(stats.connections, 1u);
+    CAssertEq(stats.connectionsReaped, 1u);
+    pool.idleTimeout = 0;
+}
+
+#endif
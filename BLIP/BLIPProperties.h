@@ -11,6 +11,40 @@
 @class MYBuffer;
 
 
+/** Parses encoded properties at the start of the slice, and advances the slice past them.
+    The result is an immutable dictionary that decodes values on demand.
+    @param complete  On return, NO if the slice doesn't contain all of the properties yet.
+    @return  The properties, or nil if they're incomplete or invalid. */
 NSDictionary* BLIPParseProperties(MYSlice *data, BOOL *complete);
+
+/** Like BLIPParseProperties, but the result refers to the data instead of copying from it.
+    @param outLength  On success, the number of bytes the encoded properties took up. */
+NSDictionary* BLIPParsePropertiesFromData(NSData* data, NSUInteger *outLength, BOOL *complete);
+
 NSDictionary* BLIPReadPropertiesFromBuffer(MYBuffer*, BOOL *complete);
+
 NSData* BLIPEncodeProperties(NSDictionary* properties);
+
+/** Encodes the properties and appends them to the data. */
+void BLIPAppendEncodedProperties(NSMutableData* data, NSDictionary* properties);
+
+
+/** Default maximum size of an encoded properties block that's read incrementally. */
+#define kBLIPMaxPropertiesSize (64*1024)
+
+/** Reads an encoded properties block that arrives in pieces (e.g. split across frames.)
+    Each byte is only looked at once; the reader keeps its position between calls. */
+@interface BLIPPropertiesReader : NSObject
+
+/** @param maxLength  The largest encoded properties block to accept. */
+- (instancetype) initWithMaxLength: (NSUInteger)maxLength;
+
+/** Consumes bytes from the start of the data, up to the end of the properties block.
+    @return  The number of bytes consumed, or NSNotFound if the properties are invalid or
+            larger than the maximum length. */
+- (NSUInteger) readData: (NSData*)data;
+
+/** The properties, once the entire block has been read; else nil. */
+@property (readonly) NSDictionary* properties;
+
+@end
@@ -19,7 +19,7 @@
 #import "MYData.h"
 #import "Logging.h"
 #import "Test.h"
-#import "MYData.h"
+#import "DDData.h"
 
 
 /** Common strings are abbreviated as single-byte strings in the packed form.
@@ -46,24 +46,145 @@ static const char* kAbbreviations[] = {
 
 
 
-static NSString* readCString(MYSlice* slice) {
-    const char* key = slice->bytes;
-    size_t len = strlen(key);
-    MYSliceMoveStart(slice, len+1);
-    if (len == 0)
-        return nil;
-    uint8_t first = (uint8_t)key[0];
-    if (first < ' ' && key[1]=='\0') {
+// Lookup tables for abbreviations, built on first use:
+static NSString* sAbbreviationStrings[kNAbbreviations];     // Abbreviations as NSStrings
+static NSDictionary* sAbbreviationIndex;                    // Maps string -> abbreviation byte
+
+static void initAbbreviations(void) {
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        NSMutableDictionary* index = [NSMutableDictionary dictionary];
+        for (uint8_t i=0; i<kNAbbreviations; i++) {
+            sAbbreviationStrings[i] = @(kAbbreviations[i]);
+            index[sAbbreviationStrings[i]] = @(i+1);
+        }
+        sAbbreviationIndex = [index copy];
+    });
+}
+
+
+// Returns the expansion of an encoded property string, or NULL if it's an invalid abbreviation.
+static const char* expandCString(const char* str, uint8_t *outAbbrev) {
+    uint8_t first = (uint8_t)str[0];
+    *outAbbrev = 0;
+    if (first < ' ' && str[1]=='\0') {
         // Single-control-character property string is an abbreviation:
-        if (first > kNAbbreviations)
-            return nil;
-        key = kAbbreviations[first-1];
+        if (first == 0 || first > kNAbbreviations)
+            return NULL;
+        *outAbbrev = first;
+        return kAbbreviations[first-1];
     }
-    return [NSString stringWithUTF8String: key];
+    return str;
 }
 
+// Converts an encoded property string to an NSString. Abbreviations map to shared instances.
+static NSString* stringForCString(const char* str) {
+    uint8_t abbrev;
+    str = expandCString(str, &abbrev);
+    if (abbrev)
+        return sAbbreviationStrings[abbrev-1];
+    return str ? [[NSString alloc] initWithUTF8String: str] : nil;
+}
 
-NSDictionary* BLIPParseProperties(MYSlice *data, BOOL* complete) {
+
+/** An immutable dictionary that's a view of the encoded properties. Looking up a key scans the
+    encoded data without allocating anything (except possibly the returned value.) A regular
+    dictionary is only decoded if it's enumerated or counted. */
+@interface BLIPEncodedProperties : NSDictionary
+- (instancetype) initWithEncodedData: (NSData*)data;
+@end
+
+
+@implementation BLIPEncodedProperties
+{
+    NSData* _data;              // Encoded key/value strings, each nul-terminated
+    NSDictionary* _dictionary;  // Decoded properties, created on demand
+}
+
+- (instancetype) initWithEncodedData: (NSData*)data {
+    self = [super init];
+    if (self) {
+        _data = data;
+    }
+    return self;
+}
+
+- (NSDictionary*) decoded {
+    @synchronized(self) {
+        if (!_dictionary) {
+            NSMutableDictionary* dict = [NSMutableDictionary new];
+            const char* pos = _data.bytes, *end = pos + _data.length;
+            while (pos < end) {
+                const char* key = pos;
+                const char* value = key + strlen(key) + 1;
+                pos = value + strlen(value) + 1;
+                dict[stringForCString(key)] = stringForCString(value);
+            }
+            _dictionary = [dict copy];
+        }
+        return _dictionary;
+    }
+}
+
+- (NSUInteger) count {
+    return self.decoded.count;
+}
+
+- (NSEnumerator*) keyEnumerator {
+    return self.decoded.keyEnumerator;
+}
+
+- (id) objectForKey: (id)key {
+    if (![key isKindOfClass: [NSString class]])
+        return nil;
+    char buf[256];
+    const char* keyStr = CFStringGetCStringPtr((__bridge CFStringRef)key, kCFStringEncodingUTF8);
+    if (!keyStr) {
+        if (![key getCString: buf maxLength: sizeof(buf) encoding: NSUTF8StringEncoding])
+            return self.decoded[key];     // too long for the stack buffer
+        keyStr = buf;
+    }
+    // Scan the key/value pairs. (If a key appears twice, the last value wins, as when decoding.)
+    const char* value = NULL;
+    const char* pos = _data.bytes, *end = pos + _data.length;
+    while (pos < end) {
+        uint8_t abbrev;
+        const char* encodedKey = pos;
+        pos += strlen(pos) + 1;
+        if (strcmp(expandCString(encodedKey, &abbrev), keyStr) == 0)
+            value = pos;
+        pos += strlen(pos) + 1;
+    }
+    return value ? stringForCString(value) : nil;
+}
+
+- (id) copyWithZone: (NSZone*)zone {
+    return self;    // I'm immutable
+}
+
+@end
+
+
+// Checks that the nul-terminated strings in the slice are valid key/value pairs.
+static BOOL validateProperties(MYSlice buf) {
+    NSUInteger n = 0;
+    const char* pos = buf.bytes, *end = pos + buf.length;
+    while (pos < end) {
+        uint8_t abbrev;
+        if (*pos == '\0' || !expandCString(pos, &abbrev))
+            return NO;
+        pos += strlen(pos) + 1;
+        ++n;
+    }
+    return (n % 2) == 0;
+}
+
+
+// Parses properties from the start of the slice, if it's complete; on success moves the slice's
+// start past them. `data`, if non-nil, is the NSData that the slice points into; the result will
+// refer to it rather than copying the bytes.
+static NSDictionary* parseProperties(MYSlice *data, NSData* owner, BOOL* complete) {
+    initAbbreviations();
     MYSlice slice = *data;
     uint64_t length;
     if (!MYSliceReadVarUInt(&slice, &length) || slice.length < length) {
@@ -77,19 +198,32 @@ NSDictionary* BLIPParseProperties(MYSlice *data, BOOL* complete) {
     }
     MYSlice buf = MYMakeSlice(slice.bytes, (size_t)length);
     if (((const char*)slice.bytes)[buf.length - 1] != '\0')
-        return nil;     // checking for nul at end makes it safe to use strlen in readCString
-    NSMutableDictionary* result = [NSMutableDictionary new];
-    while (buf.length > 0) {
-        NSString* key = readCString(&buf);
-        if (!key)
-            return nil;
-        NSString* value = readCString(&buf);
-        if (!value)
-            return nil;
-        result[key] = value;
-    }
-    MYSliceMoveStartTo(data, buf.bytes);
-    return result;
+        return nil;     // checking for nul at end makes it safe to use strlen
+    if (!validateProperties(buf))
+        return nil;
+    NSData* encoded;
+    if (owner)
+        encoded = [owner subdataNoCopyWithRange: NSMakeRange((const UInt8*)buf.bytes -
+                                                             (const UInt8*)owner.bytes,
+                                                             buf.length)];
+    else
+        encoded = [[NSData alloc] initWithBytes: buf.bytes length: buf.length];
+    MYSliceMoveStartTo(data, (const UInt8*)buf.bytes + buf.length);
+    return [[BLIPEncodedProperties alloc] initWithEncodedData: encoded];
+}
+
+
+NSDictionary* BLIPParseProperties(MYSlice *data, BOOL* complete) {
+    return parseProperties(data, nil, complete);
+}
+
+
+NSDictionary* BLIPParsePropertiesFromData(NSData* data, NSUInteger *outLength, BOOL *complete) {
+    MYSlice slice = data.my_asSlice;
+    NSDictionary* props = parseProperties(&slice, data, complete);
+    if (props)
+        *outLength = data.length - slice.length;
+    return props;
 }
 
 
@@ -103,36 +237,188 @@ NSDictionary* BLIPReadPropertiesFromBuffer(MYBuffer* buffer, BOOL *complete) {
 }
 
 
-static void appendStr( NSMutableData *data, NSString *str ) {
-    const char *utf8 = [str UTF8String];
-    size_t size = strlen(utf8)+1;
-    for (uint8_t i=0; i<kNAbbreviations; i++)
-        if (memcmp(utf8,kAbbreviations[i],size)==0) {
-            const UInt8 abbrev[2] = {i+1,0};
-            [data appendBytes: &abbrev length: 2];
-            return;
+@implementation BLIPPropertiesReader
+{
+    NSMutableData* _buffer;     // The block read so far, starting with its varint length
+    NSUInteger _totalLength;    // Length of the whole block including the varint, once known
+    NSUInteger _maxLength;
+}
+
+@synthesize properties=_properties;
+
+
+- (instancetype) initWithMaxLength: (NSUInteger)maxLength {
+    self = [super init];
+    if (self) {
+        _maxLength = maxLength;
+        _buffer = [[NSMutableData alloc] init];
+    }
+    return self;
+}
+
+
+- (NSUInteger) readData: (NSData*)data {
+    if (_properties)
+        return 0;
+    const UInt8* bytes = data.bytes;
+    NSUInteger used = 0;
+    while (_totalLength == 0) {
+        // Read the varint length, a byte at a time since it could be split too:
+        if (used >= data.length)
+            return used;
+        UInt8 byte = bytes[used++];
+        [_buffer appendBytes: &byte length: 1];
+        if (byte & 0x80) {
+            if (_buffer.length >= 10)
+                return NSNotFound;
+        } else {
+            MYSlice slice = _buffer.my_asSlice;
+            uint64_t length;
+            if (!MYSliceReadVarUInt(&slice, &length) || length > _maxLength)
+                return NSNotFound;
+            _totalLength = _buffer.length + (NSUInteger)length;
         }
-    [data appendBytes: utf8 length: size];
+    }
+
+    NSUInteger n = MIN(_totalLength - _buffer.length, data.length - used);
+    [_buffer appendBytes: bytes + used length: n];
+    used += n;
+    if (_buffer.length == _totalLength) {
+        NSUInteger length;
+        BOOL complete;
+        _properties = BLIPParsePropertiesFromData(_buffer, &length, &complete);
+        if (!_properties)
+            return NSNotFound;
+        _buffer = nil;
+    }
+    return used;
 }
 
-NSData* BLIPEncodeProperties(NSDictionary* properties) {
+
+@end
+
+
+// Appends a string, nul-terminated, abbreviating it if possible.
+static void appendStr( NSMutableData *data, NSString *str ) {
+    NSNumber* abbrev = sAbbreviationIndex[str];
+    if (abbrev) {
+        const UInt8 bytes[2] = {abbrev.unsignedCharValue, 0};
+        [data appendBytes: &bytes length: 2];
+        return;
+    }
+    const char *utf8 = CFStringGetCStringPtr((__bridge CFStringRef)str, kCFStringEncodingUTF8);
+    if (utf8) {
+        [data appendBytes: utf8 length: strlen(utf8)+1];
+    } else {
+        // Convert the string directly into the data, instead of via a temporary C string:
+        NSUInteger start = data.length;
+        NSUInteger maxLength = [str maximumLengthOfBytesUsingEncoding: NSUTF8StringEncoding];
+        data.length = start + maxLength + 1;
+        NSUInteger length = 0;
+        [str getBytes: (UInt8*)data.mutableBytes + start maxLength: maxLength usedLength: &length
+             encoding: NSUTF8StringEncoding options: 0 range: NSMakeRange(0, str.length)
+             remainingRange: NULL];
+        ((UInt8*)data.mutableBytes)[start + length] = 0;
+        data.length = start + length + 1;
+    }
+}
+
+void BLIPAppendEncodedProperties(NSMutableData* data, NSDictionary* properties) {
+    initAbbreviations();
     static const int kPlaceholderLength = 1; // space to reserve for varint length
-    NSMutableData *data = [NSMutableData dataWithCapacity: 16*properties.count];
-    [data setLength: kPlaceholderLength];
+    NSUInteger start = data.length;
+    [data setLength: start + kPlaceholderLength];
     for (NSString *name in properties) {
         appendStr(data,name);
         appendStr(data,properties[name]);
     }
-    NSUInteger length = data.length - kPlaceholderLength;
+    NSUInteger length = data.length - start - kPlaceholderLength;
     UInt8 buf[10];
     UInt8* end = MYEncodeVarUInt(buf, length);
-    [data replaceBytesInRange: NSMakeRange(0, kPlaceholderLength)
+    [data replaceBytesInRange: NSMakeRange(start, kPlaceholderLength)
                     withBytes: buf
                        length: end-buf];
+}
+
+NSData* BLIPEncodeProperties(NSDictionary* properties) {
+    NSMutableData *data = [NSMutableData dataWithCapacity: 16*properties.count + 1];
+    BLIPAppendEncodedProperties(data, properties);
     return data;
 }
 
 
+#pragma mark - TESTS:
+#if DEBUG
+
+TestCase(BLIPProperties) {
+    NSDictionary* props = @{@"Profile": @"Insert",
+                            @"Content-Type": @"application/json",
+                            @"Size": @"123",
+                            @"Name": @"\u00FCber caf\u00E9"};
+    NSData* encoded = BLIPEncodeProperties(props);
+    // "Profile", "Content-Type" and "application/json" are abbreviated:
+    CAssertEq(encoded.length, 1u + 2+7 + 2+2 + 5+4 + 5+12);
+
+    NSMutableData* frame = [encoded mutableCopy];
+    [frame appendBytes: "body" length: 4];
+    NSUInteger length = 0;
+    BOOL complete = NO;
+    NSDictionary* parsed = BLIPParsePropertiesFromData(frame, &length, &complete);
+    CAssert(complete);
+    CAssertEq(length, encoded.length);
+    CAssertEqual(parsed[@"Profile"], @"Insert");
+    CAssertEqual(parsed[@"Content-Type"], @"application/json");
+    CAssertEqual(parsed[@"Name"], @"\u00FCber caf\u00E9");
+    CAssert(parsed[@"Nonexistent"] == nil);
+    CAssertEqual(parsed, props);
+    CAssertEqual([parsed mutableCopy], props);
+
+    // Incomplete, or invalid:
+    MYSlice slice = MYMakeSlice(encoded.bytes, encoded.length - 1);
+    CAssert(BLIPParseProperties(&slice, &complete) == nil);
+    CAssert(!complete);
+    const UInt8 bad[] = {4, 'K', 0, 20, 0};   // 20 isn't a valid abbreviation
+    slice = MYMakeSlice(bad, sizeof(bad));
+    CAssert(BLIPParseProperties(&slice, &complete) == nil);
+    CAssert(complete);
+    const UInt8 odd[] = {2, 'K', 0};
+    slice = MYMakeSlice(odd, sizeof(odd));
+    CAssert(BLIPParseProperties(&slice, &complete) == nil);
+}
+
+
+TestCase(BLIPPropertiesReader) {
+    NSMutableDictionary* props = [NSMutableDictionary dictionary];
+    for (int i = 0; i < 100; i++)
+        props[$sprintf(@"Key%d", i)] = $sprintf(@"Value number %d", i);
+    NSMutableData* frames = [BLIPEncodeProperties(props) mutableCopy];
+    NSUInteger propsLength = frames.length;
+    [frames appendBytes: "body" length: 4];
+
+    // Feed it in pieces of various sizes:
+    for (NSUInteger pieceSize = 1; pieceSize <= 512; pieceSize *= 2) {
+        BLIPPropertiesReader* reader = [[BLIPPropertiesReader alloc]
+                                                initWithMaxLength: kBLIPMaxPropertiesSize];
+        NSUInteger pos = 0;
+        while (!reader.properties) {
+            NSUInteger n = MIN(pieceSize, frames.length - pos);
+            NSUInteger used = [reader readData: [frames subdataWithRange: NSMakeRange(pos, n)]];
+            CAssert(used != NSNotFound);
+            CAssert(used == n || reader.properties != nil);
+            pos += used;
+        }
+        CAssertEq(pos, propsLength);
+        CAssertEqual(reader.properties, props);
+    }
+
+    // Exceeding the maximum size is detected from the length prefix:
+    BLIPPropertiesReader* reader = [[BLIPPropertiesReader alloc] initWithMaxLength: 1000];
+    CAssertEq([reader readData: [frames subdataWithRange: NSMakeRange(0, 2)]], NSNotFound);
+}
+
+#endif
+
+
 /*
  Copyright (c) 2008-2013, Jens Alfke <jens@mooseyard.com>. All rights reserved.
  
@@ -13,6 +13,8 @@
 @interface BLIPRequest (HTTP)
 
 // Creates a BLIPRequest from an NSURLRequest.
+// If the request has an HTTPBodyStream, it's read lazily as the BLIP message is sent, one frame
+// at a time, instead of being loaded into memory.
 + (instancetype) requestWithHTTPRequest: (NSURLRequest*)httpRequest;
 
 // Creates an NSURLRequest from a BLIPRequest.
@@ -28,8 +30,20 @@
 - (void) setHTTPResponse: (NSHTTPURLResponse*)httpResponse
                 withBody: (NSData*)httpBody;
 
+// Stores an HTTP response into a BLIPResponse; the body will be read from the stream as the
+// response is sent.
+- (void) setHTTPResponse: (NSHTTPURLResponse*)httpResponse
+          withBodyStream: (NSInputStream*)httpBodyStream;
+
 // Creates an HTTP response from a BLIPResponse.
 - (NSHTTPURLResponse*) asHTTPResponseWithBody: (NSData**)outHTTPBody
                                        forURL: (NSURL*)url;
 
+// Parses the HTTP status line and headers from the start of a response's data, which may be
+// incomplete (as when streaming it with onDataReceived.) Returns nil if the header block hasn't
+// all arrived yet; otherwise sets *outHeaderLength to its length, i.e. where the body starts.
++ (NSHTTPURLResponse*) HTTPResponseFromData: (NSData*)data
+                               headerLength: (NSUInteger*)outHeaderLength
+                                     forURL: (NSURL*)url;
+
 @end
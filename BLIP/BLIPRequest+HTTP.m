@@ -39,12 +39,19 @@ static NSSet* kIgnoredHeaders;
                                                   (__bridge CFStringRef)headers[header]);
         }
     }
-    CFHTTPMessageSetBody(msg, (__bridge CFDataRef)req.HTTPBody);
 
-    NSData* body = CFBridgingRelease(CFHTTPMessageCopySerializedMessage(msg));
+    // Only the header block goes into the initial body; the HTTP body is appended to it, or
+    // streamed after it:
+    NSMutableData* body = [CFBridgingRelease(CFHTTPMessageCopySerializedMessage(msg)) mutableCopy];
     CFRelease(msg);
-    return [self requestWithBody: body
-                      properties: @{@"Profile": @"HTTP"}];
+    NSInputStream* bodyStream = req.HTTPBodyStream;
+    if (!bodyStream && req.HTTPBody)
+        [body appendData: req.HTTPBody];
+    BLIPRequest* request = [self requestWithBody: body
+                                      properties: @{@"Profile": @"HTTP"}];
+    if (bodyStream)
+        [request addStreamToBody: bodyStream];
+    return request;
 }
 
 
@@ -72,9 +79,7 @@ static NSSet* kIgnoredHeaders;
 
 @implementation BLIPResponse (HTTP)
 
-- (void) setHTTPResponse: (NSHTTPURLResponse*)httpResponse
-                withBody: (NSData*)httpBody
-{
+static NSMutableData* serializeResponseHeaders(NSHTTPURLResponse* httpResponse) {
     NSInteger status = httpResponse.statusCode;
     NSString* statusDesc = [NSHTTPURLResponse localizedStringForStatusCode: status];
     CFHTTPMessageRef msg = CFHTTPMessageCreateResponse(NULL,
@@ -86,25 +91,68 @@ static NSSet* kIgnoredHeaders;
         CFHTTPMessageSetHeaderFieldValue(msg, (__bridge CFStringRef)header,
                                          (__bridge CFStringRef)headers[header]);
     }
-    CFHTTPMessageSetBody(msg, (__bridge CFDataRef)httpBody);
-    self.profile = @"HTTP";
-    self.body = CFBridgingRelease(CFHTTPMessageCopySerializedMessage(msg));
+    NSMutableData* data = [CFBridgingRelease(CFHTTPMessageCopySerializedMessage(msg)) mutableCopy];
     CFRelease(msg);
+    return data;
+}
+
+
+- (void) setHTTPResponse: (NSHTTPURLResponse*)httpResponse
+                withBody: (NSData*)httpBody
+{
+    NSMutableData* body = serializeResponseHeaders(httpResponse);
+    if (httpBody)
+        [body appendData: httpBody];
+    self.profile = @"HTTP";
+    self.body = body;
+}
+
+
+- (void) setHTTPResponse: (NSHTTPURLResponse*)httpResponse
+          withBodyStream: (NSInputStream*)httpBodyStream
+{
+    self.profile = @"HTTP";
+    self.body = serializeResponseHeaders(httpResponse);
+    if (httpBodyStream)
+        [self addStreamToBody: httpBodyStream];
 }
 
 
 - (NSHTTPURLResponse*) asHTTPResponseWithBody: (NSData**)outHTTPBody forURL: (NSURL*)url {
+    NSData* data = self.body;
+    NSUInteger headerLength;
+    NSHTTPURLResponse* response = [[self class] HTTPResponseFromData: data
+                                                        headerLength: &headerLength
+                                                              forURL: url];
+    if (response && outHTTPBody)
+        *outHTTPBody = [data subdataWithRange: NSMakeRange(headerLength,
+                                                           data.length - headerLength)];
+    return response;
+}
+
+
++ (NSHTTPURLResponse*) HTTPResponseFromData: (NSData*)data
+                               headerLength: (NSUInteger*)outHeaderLength
+                                     forURL: (NSURL*)url
+{
+    // Find the blank line that ends the header block, and parse only up to there:
+    NSRange end = [data rangeOfData: [NSData dataWithBytes: "\r\n\r\n" length: 4]
+                            options: 0
+                              range: NSMakeRange(0, data.length)];
+    if (end.location == NSNotFound)
+        return nil;
+    NSUInteger headerLength = NSMaxRange(end);
     NSHTTPURLResponse* response = nil;
     CFHTTPMessageRef msg = CFHTTPMessageCreateEmpty(NULL, false);
-    if (CFHTTPMessageAppendBytes(msg, self.body.bytes, self.body.length) &&
+    if (CFHTTPMessageAppendBytes(msg, data.bytes, headerLength) &&
             CFHTTPMessageIsHeaderComplete(msg)) {
         response = [[NSHTTPURLResponse alloc]
                            initWithURL: url
                             statusCode: CFHTTPMessageGetResponseStatusCode(msg)
                            HTTPVersion: @"HTTP/1.1"
                           headerFields: CFBridgingRelease(CFHTTPMessageCopyAllHeaderFields(msg))];
-        if (outHTTPBody)
-            *outHTTPBody = CFBridgingRelease(CFHTTPMessageCopyBody(msg));
+        if (outHeaderLength)
+            *outHeaderLength = headerLength;
     }
     CFRelease(msg);
     return response;
@@ -155,9 +203,46 @@ TestCase(httpResponse) {
                  @"Body goes here");
 }
 
+TestCase(HTTPRequestStream) {
+    NSURL* url = [NSURL URLWithString:@"http://example.org/upload"];
+    NSMutableURLRequest* httpReq = [NSMutableURLRequest requestWithURL: url];
+    httpReq.HTTPMethod = @"POST";
+    NSData* upload = [@"streamed upload body" dataUsingEncoding: NSUTF8StringEncoding];
+    httpReq.HTTPBodyStream = [NSInputStream inputStreamWithData: upload];
+    BLIPRequest* blipReq = [BLIPRequest requestWithHTTPRequest: httpReq];
+
+    // Only the headers are in memory; the stream hasn't been touched yet:
+    CAssertEqual([[NSString alloc] initWithData: blipReq.body encoding: NSUTF8StringEncoding],
+                 @"POST /upload HTTP/1.1\r\n\r\n");
+    CAssertEq(httpReq.HTTPBodyStream.streamStatus, NSStreamStatusNotOpen);
+}
+
+
+TestCase(httpResponseHeaders) {
+    NSURL* url = [NSURL URLWithString:@"http://example.org/some/path"];
+    NSData* data = [@"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nPartial bo"
+                        dataUsingEncoding: NSUTF8StringEncoding];
+    // Headers aren't parsed until the whole block has arrived:
+    NSUInteger headerLength = 0;
+    for (NSUInteger len = 0; len < 45; len++) {
+        CAssert([BLIPResponse HTTPResponseFromData: [data subdataWithRange: NSMakeRange(0, len)]
+                                      headerLength: &headerLength
+                                            forURL: url] == nil);
+    }
+    NSHTTPURLResponse* httpRes = [BLIPResponse HTTPResponseFromData: data
+                                                       headerLength: &headerLength
+                                                             forURL: url];
+    CAssert(httpRes != nil);
+    CAssertEq(httpRes.statusCode, 200);
+    CAssertEqual(httpRes.allHeaderFields, @{@"Content-Type": @"text/plain"});
+    CAssertEq(headerLength, 45u);
+}
+
 TestCase(HTTP) {
     RequireTestCase(HTTPRequest);
+    RequireTestCase(HTTPRequestStream);
     RequireTestCase(httpResponse);
+    RequireTestCase(httpResponseHeaders);
 }
 
 #endif
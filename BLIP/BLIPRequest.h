@@ -41,6 +41,13 @@
     This property can only be set before sending the request. */
 @property BOOL noReply;
 
+/** How long to wait for the response, in seconds, after the request has been sent or since the
+    last part of the response arrived. If it hasn't arrived by then, the response fails with a
+    kBLIPError_Timeout error. The default value, 0, means to use
+    the connection's requestTimeout.
+    This property can only be set before sending the request. */
+@property NSTimeInterval timeout;
+
 /** Returns YES if you've replied to this request (by accessing its -response property.) */
 @property (readonly) BOOL repliedTo;
 
@@ -26,6 +26,7 @@
 @implementation BLIPRequest
 {
     BLIPResponse *_response;
+    NSTimeInterval _timeout;
 }
 
 
@@ -66,13 +67,30 @@
     BLIPRequest *copy = [[self class] requestWithBody: self.body 
                                            properties: self.properties];
     copy.compressed = self.compressed;
-    copy.urgent = self.urgent;
+    copy.compressionLevel = self.compressionLevel;
+    copy.priority = self.priority;
     copy.noReply = self.noReply;
+    copy.timeout = self.timeout;
     return copy;
 }
 
 
+- (void) cancel {
+    if (_isMine)
+        [super cancel];
+    else if (!self.noReply)
+        [self.response cancel];     // Cancelling an incoming request cancels my response
+}
+
+
 - (BOOL) noReply                            {return (_flags & kBLIP_NoReply) != 0;}
+- (NSTimeInterval) timeout                  {return _timeout;}
+
+- (void) setTimeout: (NSTimeInterval)timeout {
+    Assert(_isMine && _isMutable);
+    _timeout = timeout;
+}
+
 - (void) setNoReply: (BOOL)noReply          {[self _setFlag: kBLIP_NoReply value: noReply];}
 - (BLIPConnection*) connection        {return _connection;}
 
@@ -83,6 +101,8 @@
 
 
 - (BLIPResponse*) send {
+    if (_cancelled)
+        return nil;
     Assert(_connection,@"%@ has no connection to send over",self);
     Assert(!_sent,@"%@ was already sent",self);
     [self _encode];
@@ -25,8 +25,12 @@
 @implementation BLIPResponse
 {
     void (^_onComplete)();
+    NSTimeInterval _timeout;
+    CFAbsoluteTime _deadline;
 }
 
+@synthesize _timeout=_timeout, _deadline=_deadline;
+
 - (instancetype) _initWithRequest: (BLIPRequest*)request {
     Assert(request);
     self = [super _initWithConnection: request.connection
@@ -35,8 +39,8 @@
                                number: request.number
                                  body: nil];
     if (self != nil) {
-        if (_isMine && request.urgent)
-            _flags |= kBLIP_Urgent;
+        if (_isMine)
+            self.priority = request.priority;
     }
     return self;
 }
@@ -142,17 +146,22 @@
         if (!error)
             error = BLIPMakeError(kBLIPError_Disconnected,
                                   @"Connection closed before response was received");
-        // Change incoming response to an error:
-        _isMutable = YES;
-        _properties = [_properties mutableCopy];
-        [self _setError: error];
-        _isMutable = NO;
-        
-        self.complete = YES;    // Calls onComplete target
+        [self _failWithError: error];
     }
 }
 
 
+// Changes an incoming response that hasn't arrived yet into an error, and completes it.
+- (void) _failWithError: (NSError*)error {
+    _isMutable = YES;
+    _properties = [_properties mutableCopy];
+    [self _setError: error];
+    _isMutable = NO;
+
+    self.complete = YES;    // Calls onComplete target
+}
+
+
 @end
 
 
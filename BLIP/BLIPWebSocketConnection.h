@@ -9,6 +9,12 @@
 #import "BLIPConnection.h"
 #import "WebSocket.h"
 
+/** The WebSocket subprotocol that BLIPWebSocketConnection offers when connecting, and that
+    BLIPWebSocketListener accepts. If it's agreed on, both peers support the BLIP protocol
+    extensions (see BLIPConnection+Transport.h); otherwise they aren't used. */
+extern NSString* const kBLIPWebSocketProtocol;
+
+
 @interface BLIPWebSocketConnection : BLIPConnection
 
 - (instancetype) initWithURLRequest:(NSURLRequest *)request;
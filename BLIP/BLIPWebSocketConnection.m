@@ -9,9 +9,13 @@
 #import "BLIPWebSocketConnection.h"
 #import "BLIPConnection+Transport.h"
 #import "WebSocketClient.h"
+#import "WebSocket_Internal.h"
 #import "Test.h"
 
 
+NSString* const kBLIPWebSocketProtocol = @"BLIP+x1";
+
+
 @interface BLIPWebSocketConnection () <WebSocketDelegate>
 @end
 
@@ -28,18 +32,22 @@
     if (self) {
         _webSocket = webSocket;
         _webSocket.delegate = self;
+        if (webSocket.state == kWebSocketOpen)
+            self.peerSupportsExtensions = [webSocket.protocol isEqualToString: kBLIPWebSocketProtocol];
     }
     return self;
 }
 
 // Public API
 - (instancetype) initWithURLRequest:(NSURLRequest *)request {
-    return [self initWithWebSocket: [[WebSocketClient alloc] initWithURLRequest: request]];
+    WebSocketClient* webSocket = [[WebSocketClient alloc] initWithURLRequest: request];
+    webSocket.protocols = @[kBLIPWebSocketProtocol];
+    return [self initWithWebSocket: webSocket];
 }
 
 // Public API
 - (instancetype) initWithURL:(NSURL *)url {
-    return [self initWithWebSocket: [[WebSocketClient alloc] initWithURL: url]];
+    return [self initWithURLRequest: [NSURLRequest requestWithURL: url]];
 }
 
 
@@ -78,6 +86,7 @@
 
 // WebSocket delegate method
 - (void) webSocketDidOpen: (WebSocket *)webSocket {
+    self.peerSupportsExtensions = [webSocket.protocol isEqualToString: kBLIPWebSocketProtocol];
     [self transportDidOpen];
 }
 
@@ -105,6 +114,24 @@
     [_webSocket sendBinaryMessage: frame];
 }
 
+- (NSMutableData*) transportBufferWithCapacity: (NSUInteger)size headroom: (NSUInteger*)outHeadroom {
+    *outHeadroom = kWebSocketHeadroom;
+    return [_webSocket messageBufferWithCapacity: size];
+}
+
+- (void) sendFrameInBuffer: (NSMutableData*)buffer length: (NSUInteger)length {
+    [_webSocket sendBinaryMessageInBuffer: buffer length: length];
+}
+
+- (NSUInteger) transportQueuedBytes {
+    return _webSocket.queuedOutputBytes;
+}
+
+- (void) syncOnTransportQueue: (dispatch_block_t)block {
+    // My transport queue is the WebSocket's, which may target a shared queue:
+    [_webSocket syncOnWebSocketQueue: block];
+}
+
 // WebSocket delegate method
 - (BOOL)webSocket:(WebSocket *)webSocket didReceiveBinaryMessage:(NSData*)message {
     [self didReceiveFrame: message];
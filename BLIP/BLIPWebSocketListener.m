@@ -20,7 +20,7 @@
 {
     id<BLIPConnectionDelegate> _blipDelegate;
     dispatch_queue_t _delegateQueue;
-    NSMutableSet* _openSockets;
+    NSMapTable* _openSockets;       // Maps WebSocketIncoming -> BLIPWebSocketConnection
 }
 
 - (instancetype) initWithPath: (NSString*)path
@@ -38,7 +38,8 @@
     if (self) {
         _blipDelegate = delegate;
         _delegateQueue = queue ?: dispatch_get_main_queue();
-        _openSockets = [NSMutableSet new];
+        _openSockets = [NSMapTable strongToStrongObjectsMapTable];
+        self.protocols = @[kBLIPWebSocketProtocol];
     }
     return self;
 }
@@ -46,7 +47,11 @@
 
 - (void) webSocketDidOpen:(WebSocket *)ws {
     BLIPWebSocketConnection* b = [[BLIPWebSocketConnection alloc] initWithWebSocket: ws];
-    [_openSockets addObject: b];    //FIX: How to remove it since I'm not the delegate when it closes??
+    // The WebSocket only has a weak reference to its delegate, so keep the connection alive here
+    // until the listener reports that the socket has closed:
+    @synchronized(self) {
+        [_openSockets setObject: b forKey: ws];
+    }
     LogTo(BLIP, @"Listener got connection: %@", b);
     dispatch_async(_delegateQueue, ^{
         [self blipConnectionDidOpen: b];
@@ -59,4 +64,13 @@
 }
 
 
+- (void) connectionDidClose: (WebSocketIncoming*)ws {
+    // The BLIPWebSocketConnection has already been told about the close, as the WebSocket's
+    // delegate, so it's safe to release it now.
+    @synchronized(self) {
+        [_openSockets removeObjectForKey: ws];
+    }
+}
+
+
 @end
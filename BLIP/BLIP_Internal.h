@@ -10,7 +10,7 @@
 #import "BLIPRequest.h"
 #import "BLIPResponse.h"
 #import "BLIPProperties.h"
-@class MYBuffer;
+@class MYBuffer, WebSocketDeflater, WebSocketInflater;
 
 
 /* Private declarations and APIs for BLIP implementation. Not for use by clients! */
@@ -28,6 +28,7 @@ typedef NS_OPTIONS(UInt8, BLIPMessageFlags) {
     kBLIP_NoReply   = 0x10,       // no RPY needed
     kBLIP_MoreComing= 0x20,       // More frames coming (Applies only to individual frame)
     kBLIP_Meta      = 0x40,       // Special message type, handled internally (hello, bye, ...)
+                                  // Cancel notices and acks are Meta frames (see below.)
 
     kBLIP_MaxFlag   = 0xFF
 };
@@ -35,11 +36,28 @@ typedef NS_OPTIONS(UInt8, BLIPMessageFlags) {
 /* BLIP message types; encoded in each frame's header. */
 typedef BLIPMessageFlags BLIPMessageType;
 
+/* Cancel notices: a frame with the kBLIP_Meta flag and an empty body cancels the message with
+   that number. With type MSG it's sent by the requester: the request is cancelled and no
+   response is wanted. (It may take the place of a request that never started, so it uses up that
+   request number.) With type RPY or ERR it's sent by the responder, to abort its response.
+   Cancel notices and acks are only exchanged with peers that support the protocol extensions
+   (peerSupportsExtensions); to older peers, a Meta frame is the start of a meta request. */
+
+/* Acks: a frame with the kBLIP_Meta flag whose body is a varint is an acknowledgement from the
+   receiver of message #number (type MSG for a request, RPY for a response), giving the total
+   number of frame bytes of it that it has consumed (read by its onDataReceived reader, or spilled
+   to disk.) A sender stops sending a message once kBLIPReceiveWindow bytes of it are
+   unacknowledged, until more acks arrive; other messages keep flowing meanwhile. */
+#define kBLIPReceiveWindow  (1024*1024)
+#define kBLIPAckInterval    (256*1024)     // Receiver acks after processing this many bytes
+
 
 @interface BLIPConnection ()
 - (BOOL) _sendRequest: (BLIPRequest*)q response: (BLIPResponse*)response;
 - (BOOL) _sendResponse: (BLIPResponse*)response;
 - (void) _messageReceivedProperties: (BLIPMessage*)message;
+- (void) _cancelMessage: (BLIPMessage*)message;
+- (void) _sendAckForMessage: (BLIPMessage*)message bytes: (UInt64)bytesReceived;
 @end
 
 
@@ -48,17 +66,38 @@ typedef BLIPMessageFlags BLIPMessageType;
     @protected
     BLIPConnection* _connection;
     BLIPMessageFlags _flags;
+    BLIPPriority _priority;
     UInt32 _number;
     NSDictionary *_properties;
     NSData *_body;
     MYBuffer *_encodedBody;
+    NSMutableArray *_bodyChunks;    // Received body data, not yet concatenated into _body
+    NSUInteger _bodyChunksLength;   // Total length of _bodyChunks
+    NSFileHandle *_spillFile;       // Unlinked temp file that a large incoming body is written to
+    NSUInteger _spillLength;        // Number of bytes written to _spillFile
+    BLIPPropertiesReader *_propertiesReader; // Reads properties that span multiple frames
+    MYBuffer *_bodyToCompress;      // Outgoing body data not yet compressed into _encodedBody
+    WebSocketDeflater *_deflater;   // Compresses outgoing body
+    BOOL _deflaterHasInput;         // _deflater has been given data since it last flushed
+    NSError *_sendError;            // Set if the outgoing body couldn't be read
+    WebSocketInflater *_inflater;   // Decompresses incoming body
+    int _compressionLevel;
     NSMutableData *_mutableBody;
-    NSMutableArray* _bodyStreams;
+    NSMutableArray* _bodySources;   // Outgoing NSInputStreams, and NSData mapped from files
+    NSUInteger _bodySourceOffset;   // Bytes already read from _bodySources[0], if it's NSData
     BOOL _isMine, _isMutable, _sent, _propertiesAvailable, _complete;
+    BOOL _queued;                   // Outgoing message is in the outbox or generating a frame
+    BOOL _cancelled, _cancelNoticeSent;
     NSInteger _bytesWritten, _bytesReceived;
+    NSInteger _bytesAcked;          // Outgoing: bytes the peer has acked. Incoming: bytes I acked
+    NSInteger _bytesConsumed;       // Incoming: frame bytes read, spilled or kept for the body
+    NSMutableData* _readMarks;      // Incoming: BLIPReadMarks of data not yet read by the reader
+    NSUInteger _readMarksStart;     // Index of the first pending mark in _readMarks
+    UInt64 _bytesBuffered;          // Incoming: total bytes written to the reader's buffer
+    UInt64 _bodyLength;             // Incoming: body bytes received so far, after decompression
     id _representedObject;
 }
-@property BOOL sent, propertiesAvailable, complete;
+@property BOOL sent, propertiesAvailable, complete, queued;
 - (BLIPMessageFlags) _flags;
 - (void) _setFlag: (BLIPMessageFlags)flag value: (BOOL)value;
 - (void) _encode;
@@ -71,11 +110,20 @@ typedef BLIPMessageFlags BLIPMessageType;
                                flags: (BLIPMessageFlags)flags
                               number: (UInt32)msgNo
                                 body: (NSData*)body;
-- (NSData*) nextFrameWithMaxSize: (UInt16)maxSize moreComing: (BOOL*)outMoreComing;
+- (NSData*) nextFrameWithMaxSize: (NSUInteger)maxSize moreComing: (BOOL*)outMoreComing;
+- (NSUInteger) nextFrameLengthWithMaxSize: (NSUInteger)maxSize;
+- (NSUInteger) writeNextFrameTo: (void*)frame
+                      maxLength: (NSUInteger)maxLength
+                     moreComing: (BOOL*)outMoreComing;
 @property (readonly) NSInteger _bytesWritten;
+@property NSInteger _bytesAcked;
+@property (readonly) NSError* _sendError;
 - (void) _assignedNumber: (UInt32)number;
 - (BOOL) _receivedFrameWithFlags: (BLIPMessageFlags)flags body: (NSData*)body;
 - (void) _connectionClosed;
+- (void) _cancelWithNotice: (BOOL)notifyPeer;
+- (void) _readerReadBytes: (UInt64)totalRead;
+@property (readonly) BOOL _needsCancelNotice;
 @end
 
 
@@ -88,6 +136,9 @@ typedef BLIPMessageFlags BLIPMessageType;
 
 @interface BLIPResponse ()
 - (instancetype) _initWithRequest: (BLIPRequest*)request;
+- (void) _failWithError: (NSError*)error;
+@property NSTimeInterval _timeout;      // Max time to wait for progress, or 0 (transport queue)
+@property CFAbsoluteTime _deadline;     // When it times out, unless more progress is made
 #if DEBUG
 - (instancetype) _initIncomingWithProperties: (NSDictionary*)properties body: (NSData*)body;
 #endif
@@ -11,4 +11,8 @@
 - (NSString *)base64Encoded;
 - (NSData *)base64Decoded;
 
+// Returns a data object pointing into the receiver's bytes, without copying them.
+// The result retains the receiver, which must not be mutated while the result is alive.
+- (NSData *)subdataNoCopyWithRange:(NSRange)range;
+
 @end
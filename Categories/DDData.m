@@ -155,4 +155,19 @@ static char encodingTable[64] = {
 	return [NSData dataWithData:result];
 }
 
+- (NSData *)subdataNoCopyWithRange:(NSRange)range
+{
+	NSParameterAssert(NSMaxRange(range) <= [self length]);
+	if (range.location == 0 && range.length == [self length])
+		return [self copy];
+	if (range.length == 0)
+		return [NSData data];
+	NSData *owner = self;
+	return [[NSData alloc] initWithBytesNoCopy:(void*)((const char*)[self bytes] + range.location)
+	                                    length:range.length
+	                               deallocator:^(void *bytes, NSUInteger length) {
+		(void)owner; // keeps the receiver alive as long as the slice
+	}];
+}
+
 @end
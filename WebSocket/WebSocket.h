@@ -43,6 +43,10 @@ typedef enum WebSocketCloseCode WebSocketCloseCode;
 
 extern NSString* const WebSocketErrorDomain;
 
+/** Number of bytes at the start of a message buffer reserved for the frame header.
+    (See -[WebSocket messageBufferWithCapacity:].) */
+#define kWebSocketHeadroom 14
+
 
 /** Abstract superclass WebSocket implementation.
     (If you want to connect to a server, look at WebSocketClient.)
@@ -69,6 +73,10 @@ extern NSString* const WebSocketErrorDomain;
     This is observable, but KVO notifications will be sent on the WebSocket's dispatch queue. */
 @property (readonly) WebSocketState state;
 
+/** The subprotocol agreed on during the opening handshake (RFC 6455, section 1.9), or nil if
+    none. Valid once the WebSocket is open. */
+@property (readonly) NSString* protocol;
+
 /** Begins an orderly shutdown of the WebSocket connection, with code kWebSocketCloseNormal. */
 - (void) close;
 
@@ -87,6 +95,64 @@ extern NSString* const WebSocketErrorDomain;
 /** Sends a binary message over the WebSocket. */
 - (void) sendBinaryMessage:(NSData*)msg;
 
+/** Returns a buffer to build an outgoing binary message in, for use with
+    -sendBinaryMessageInBuffer:length:. The message goes after the first kWebSocketHeadroom bytes,
+    which are reserved for the frame header. Buffers come from a per-WebSocket pool and are reused
+    after they've been sent, so building messages this way avoids allocating and copying. */
+- (NSMutableData*) messageBufferWithCapacity: (NSUInteger)capacity;
+
+/** Sends a binary message that was written into a buffer from -messageBufferWithCapacity:,
+    starting at offset kWebSocketHeadroom. The frame header is written into the headroom and the
+    frame is sent straight from the buffer. The WebSocket takes over the buffer, so don't use it
+    afterwards. */
+- (void) sendBinaryMessageInBuffer: (NSMutableData*)buffer length: (NSUInteger)length;
+
+/** If nonzero, outgoing text and binary messages longer than this are split into fragments of
+    this size, and sent one at a time so that control frames (pings, close) can be interleaved
+    between them. Defaults to 0, meaning messages are never fragmented. */
+@property NSUInteger fragmentSize;
+
+/** Small frames sent during the same turn of the WebSocket's queue are combined into a single
+    socket write, which happens at the end of that turn or as soon as this many bytes accumulate.
+    Set to 0 to write every frame separately. Default is 16KB. */
+@property NSUInteger writeCoalescingLimit;
+
+/** Sets the socket's TCP_NODELAY option, which disables Nagle's algorithm so small frames aren't
+    delayed by the kernel. Defaults to YES, since the WebSocket does its own write coalescing. */
+@property BOOL noDelay;
+
+/** When this many bytes of outgoing messages are queued but not yet written to the socket, the
+    WebSocket stops calling -webSocketIsHungry: and calls -webSocketIsFull: instead.
+    Default is 128KB. */
+@property NSUInteger sendHighWatermark;
+
+/** After becoming full, the WebSocket calls -webSocketIsHungry: again once the queued output has
+    drained to this many bytes. Should be less than sendHighWatermark. Default is 32KB. */
+@property NSUInteger sendLowWatermark;
+
+/** The number of bytes of outgoing messages that haven't yet been written to the socket.
+    (Compressed messages count at their compressed size.) */
+@property (readonly) NSUInteger queuedOutputBytes;
+
+/** Maximum size of an incoming message. If the peer sends a larger one, the connection is closed
+    with code kWebSocketCloseMessageTooBig. Defaults to 0, meaning no limit. */
+@property UInt64 maxMessageSize;
+
+/** If YES, the permessage-deflate extension (RFC 7692) will be offered to the server, or
+    accepted if offered by the client; if both sides agree, messages will be sent compressed.
+    Defaults to NO, since compression costs CPU time and is wasted on data that's already
+    compressed. This has to be set before the connection opens (for an incoming WebSocket, the
+    latest opportunity is the -webSocket:shouldAccept: delegate call.) */
+@property BOOL perMessageDeflate;
+
+/** The base-2 log of the largest LZ77 window the peer may use to compress messages it sends,
+    in the range 9...15. Smaller values save memory at some cost in compression. Default is 15. */
+@property int deflateWindowBits;
+
+/** If NO, both sides will reset their compression state after every message, which saves memory
+    but compresses less well. Defaults to YES. */
+@property BOOL deflateContextTakeover;
+
 /** If set to YES, no incoming messages will be read from the socket or sent to the delegate.
     Messages will resume when it's set back to NO. */
 @property BOOL readPaused;
@@ -99,6 +165,15 @@ extern NSString* const WebSocketErrorDomain;
     This queue is created when the WebSocket is created. Don't use it for anything else. */
 @property (nonatomic, readonly) dispatch_queue_t websocketQueue;
 
+/** Makes WebSockets created after this call run on a fixed pool of `count` shared serial queues
+    (at most 64), instead of each one being scheduled by GCD independently. Each WebSocket still
+    has its own websocketQueue, so its events stay in order, but that queue targets one of the
+    shared ones, assigned round-robin. This saves wakeups and threads in processes with many
+    mostly-idle connections; a count of about the number of CPU cores is a good choice.
+    Pass 0 (the default) to turn this off. WebSockets already created aren't affected.
+    Since WebSockets sharing a queue run one at a time, delegate methods shouldn't block. */
++ (void) setSharedQueueCount: (NSUInteger)count;
+
 /** Calls -didCloseWithError:. */
 - (void) didCloseWithCode: (WebSocketCloseCode)code reason: (NSString*)reason;
 
@@ -113,7 +188,9 @@ extern NSString* const WebSocketErrorDomain;
 - (void) didOpen;
 - (void) didReceiveMessage:(NSString *)msg;
 - (void) didReceiveBinaryMessage:(NSData *)msg;
+- (void) didReceiveBinaryMessageChunk:(NSData *)chunk complete:(BOOL)complete;
 - (void) isHungry;
+- (void) isFull;
 - (void) didCloseWithError: (NSError*)error;
 
 
@@ -157,9 +234,24 @@ extern NSString* const WebSocketErrorDomain;
 - (BOOL) webSocket:(WebSocket *)ws
          didReceiveBinaryMessage:(NSData *)msg;
 
-/** Called when the WebSocket has finished sending all queued messages and is ready for more. */
+/** Called instead of -webSocket:didReceiveBinaryMessage: for fragmented binary messages and those
+    larger than 64KB, if the delegate implements it. The message is delivered in pieces as it
+    arrives, instead of being buffered in memory; `complete` is YES on the last piece.
+    If it returns NO, the WebSocket's read queue will be paused until the client sets the
+    readPaused property back to NO. */
+- (BOOL) webSocket:(WebSocket *)ws
+         didReceiveBinaryMessageChunk:(NSData *)chunk
+                             complete:(BOOL)complete;
+
+/** Called when the WebSocket is ready for more messages to send: after a message is sent or
+    written while the queued output is below the high watermark, or when it drains back down to
+    the low watermark after being full. */
 - (void) webSocketIsHungry:(WebSocket *)ws;
 
+/** Called when the queued output reaches the high watermark. The delegate should stop sending
+    messages until -webSocketIsHungry: is called. */
+- (void) webSocketIsFull:(WebSocket *)ws;
+
 /** Called after the WebSocket closes, either intentionally or due to an error.
     If the condition is an abnormal WebSocketCloseCode, it will be the `code` property of the
     NSError, and the `domain` will be WebSocketErrorDomain. */
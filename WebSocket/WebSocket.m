@@ -18,7 +18,11 @@
 #import "WebSocket.h"
 #import "WebSocket_Internal.h"
 #import "GCDAsyncSocket.h"
+#import "DDData.h"
 #import <Security/SecRandom.h>
+#import <zlib.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
 @class HTTPMessage;
 
 #if ! __has_feature(objc_arc)
@@ -53,40 +57,52 @@
 #define TIMEOUT_NONE          -1
 #define TIMEOUT_REQUEST_BODY  10
 
-#define HUNGRY_SIZE 5
+// Default send watermarks: see the sendHighWatermark and sendLowWatermark properties
+#define kDefaultSendHighWatermark (128*1024)
+#define kDefaultSendLowWatermark  ( 32*1024)
 
+// Number of random bytes fetched at once to use as masking keys (64 keys' worth)
+#define kMaskKeyPoolSize 256
 
-DefineLogDomain(WS);
+// Max number of frames of fragmented messages written to the socket at once. Keeping this small
+// lets control frames get sent without waiting behind a whole large message.
+#define kMaxFragmentsInFlight 2
 
+// Messages shorter than this aren't worth compressing
+#define kMinCompressibleSize 64
 
-/* unused
-static inline BOOL WS_OP_IS_FINAL_FRAGMENT(UInt8 frame) {
-	return (frame & 0x80) ? YES : NO;
-}*/
+// Unmasked payloads at least this large are written to the socket as-is, instead of being copied
+// into a frame buffer
+#define kMinUncopiedPayloadSize 4096
 
-static inline BOOL WS_PAYLOAD_IS_MASKED(UInt8 frame) {
-	return (frame & 0x80) ? YES : NO;
-}
+// Writes larger than this are never copied into the coalescing buffer
+#define kMaxCoalescedWriteSize 2048
 
-static inline NSUInteger WS_PAYLOAD_LENGTH(UInt8 frame) {
-	return frame & 0x7F;
-}
+#define kDefaultWriteCoalescingLimit (16*1024)
 
-static inline void maskBytes(NSMutableData* data, NSUInteger offset, NSUInteger length,
-                             const UInt8* mask)
-{
-    // OPT: Is there a vector operation to do this more quickly?
-    UInt8* bytes = (UInt8*)data.mutableBytes + offset;
-    for (NSUInteger i = 0; i < length; ++i) {
-        bytes[i] ^= mask[i % 4];
-    }
-}
+// Max number of idle message buffers of each size to keep for reuse
+#define kMaxPooledBuffers 8
+
+// Max number of shared queues (see +setSharedQueueCount:)
+#define kMaxSharedQueues 64
+
+
+DefineLogDomain(WS);
 
 
 NSString* const WebSocketErrorDomain = @"WebSocket";
 
 
-@interface WebSocket ()
+// Shared queue pool; see +setSharedQueueCount:. Queues are created as needed and never freed,
+// since WebSockets' queues may still be targeting them.
+static dispatch_queue_t sSharedQueues[kMaxSharedQueues];
+static NSUInteger sSharedQueueCount, sNextSharedQueue;
+
+// Queue-specific key; its value on a shared queue is that queue's index + 1
+static char kSharedQueueKey;
+
+
+@interface WebSocket () <WebSocketFrameParserDelegate>
 @property (readwrite) WebSocketState state;
 @end
 
@@ -99,12 +115,33 @@ NSString* const WebSocketErrorDomain = @"WebSocket";
 {
 	BOOL _isRFC6455;
     NSTimeInterval _timeout;
-	BOOL _nextFrameMasked;
-	NSData *_maskingKey;
-	NSUInteger _nextOpCode;
-    NSUInteger _writeQueueSize;
-    BOOL _readyToReadMessage;       // YES when message read and ready to start reading the next
+    WebSocketFrameParser* _parser;  // Decodes incoming frames
+    BOOL _sendFull;                 // YES after queued output passes the high watermark
+    NSMutableArray* _writtenFrameSizes; // Payload sizes of data frames being written, in order
+    BOOL _readyToReadMessage;       // YES when no socket read is in progress
     BOOL _readPaused;               // While YES, stop reading messages from the socket
+    UInt64 _maxMessageSize;
+    UInt8 _messageType;             // Opcode of the incoming message in progress, else 0
+    UInt64 _messageLength;          // Bytes received so far of the incoming message
+    BOOL _inFrame;                  // YES while a large frame is arriving in chunks
+    BOOL _deliveringChunks;         // YES if the incoming message is passed on in pieces
+    NSMutableData* _partialMessage; // Accumulates an incoming message that's not passed on in pieces
+    BOOL _messageCompressed;        // YES if the incoming message is compressed
+    WebSocketDeflateParams _deflateParams;
+    WebSocketDeflater* _deflater;   // Compresses outgoing messages, if negotiated
+    WebSocketInflater* _inflater;   // Decompresses incoming messages, if negotiated
+    NSMutableArray* _outgoingMessages; // Messages waiting to be written by -writeOutgoingMessages
+    NSUInteger _fragmentOffset;     // Bytes of _outgoingMessages[0] already written
+    NSUInteger _fragmentsInFlight;  // Number of fragment writes not yet completed
+    NSMutableData* _coalescedData;  // Small writes waiting to be written together
+    NSMutableArray* _coalescedTags; // Tags of the writes in _coalescedData
+    NSMutableArray* _coalescedTagGroups; // Tag arrays of coalesced writes in progress
+    BOOL _noDelay;
+    WebSocketBufferPool* _bufferPool; // Reusable buffers for -messageBufferWithCapacity:
+    UInt8 _maskKeys[kMaskKeyPoolSize]; // Random bytes for client masking keys
+    size_t _maskKeyPos;             // Offset of the next unused key in _maskKeys
+    NSUInteger _sharedQueueIndex;   // 1 + index of the shared queue I target, or 0 if none
+    NSError* _failure;              // Error to report on disconnect, after -failWithCode:reason:
 }
 
 
@@ -112,7 +149,11 @@ NSString* const WebSocketErrorDomain = @"WebSocket";
 #pragma mark - Setup and Teardown
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-@synthesize timeout=_timeout, websocketQueue=_websocketQueue, state=_state;
+@synthesize timeout=_timeout, websocketQueue=_websocketQueue, state=_state, protocol=_protocol,
+            fragmentSize=_fragmentSize, perMessageDeflate=_perMessageDeflate,
+            deflateWindowBits=_deflateWindowBits, deflateContextTakeover=_deflateContextTakeover,
+            writeCoalescingLimit=_writeCoalescingLimit, sendHighWatermark=_sendHighWatermark,
+            sendLowWatermark=_sendLowWatermark, queuedOutputBytes=_queuedOutputBytes;
 
 static NSData* kTerminator;
 
@@ -121,6 +162,33 @@ static NSData* kTerminator;
         kTerminator = [[NSData alloc] initWithBytes:"\xFF" length:1];
 }
 
++ (void) setSharedQueueCount: (NSUInteger)count {
+    count = MIN(count, (NSUInteger)kMaxSharedQueues);
+    @synchronized([WebSocket class]) {
+        for (NSUInteger i = 0; i < count; i++) {
+            if (!sSharedQueues[i]) {
+                sSharedQueues[i] = dispatch_queue_create("WebSocket shared", DISPATCH_QUEUE_SERIAL);
+                dispatch_queue_set_specific(sSharedQueues[i], &kSharedQueueKey,
+                                            (void*)(uintptr_t)(i + 1), NULL);
+            }
+        }
+        sSharedQueueCount = count;
+        sNextSharedQueue = 0;
+    }
+}
+
+// Makes a new WebSocket's queue target the next shared queue in turn, if they're enabled.
+// Returns the shared queue's index + 1, or 0 if none.
+static NSUInteger assignSharedQueue(dispatch_queue_t queue) {
+    @synchronized([WebSocket class]) {
+        if (sSharedQueueCount == 0)
+            return 0;
+        NSUInteger i = sNextSharedQueue++ % sSharedQueueCount;
+        dispatch_set_target_queue(queue, sSharedQueues[i]);
+        return i + 1;
+    }
+}
+
 // For compatibility with the WebSocket class in the CocoaHTTPServer library
 + (BOOL)isWebSocketRequest:(HTTPMessage *)request {
     return NO;
@@ -133,7 +201,21 @@ static NSData* kTerminator;
         _timeout = TIMEOUT_DEFAULT;
         _state = kWebSocketUnopened;
 		_websocketQueue = dispatch_queue_create("WebSocket", NULL);
+        _sharedQueueIndex = assignSharedQueue(_websocketQueue);
 		_isRFC6455 = YES;
+        _parser = [[WebSocketFrameParser alloc] initWithDelegate: self];
+        _maskKeyPos = kMaskKeyPoolSize;
+        _outgoingMessages = [[NSMutableArray alloc] init];
+        _perMessageDeflate = NO;
+        _deflateWindowBits = 15;
+        _deflateContextTakeover = YES;
+        _coalescedTagGroups = [[NSMutableArray alloc] init];
+        _writeCoalescingLimit = kDefaultWriteCoalescingLimit;
+        _noDelay = YES;
+        _writtenFrameSizes = [[NSMutableArray alloc] init];
+        _bufferPool = [[WebSocketBufferPool alloc] initWithMaxBuffersPerSize: kMaxPooledBuffers];
+        _sendHighWatermark = kDefaultSendHighWatermark;
+        _sendLowWatermark = kDefaultSendLowWatermark;
 	}
 	return self;
 }
@@ -176,9 +258,9 @@ static NSData* kTerminator;
 - (id)delegate {
 	__block id result = nil;
 	
-	dispatch_sync(_websocketQueue, ^{
+	[self syncOnWebSocketQueue: ^{
 		result = _delegate;
-	});
+	}];
 	
 	return result;
 }
@@ -189,6 +271,17 @@ static NSData* kTerminator;
 	});
 }
 
+- (void) syncOnWebSocketQueue: (dispatch_block_t)block {
+    // If the caller is running on the shared queue my queue targets (say, in another WebSocket's
+    // delegate method), dispatch_sync would deadlock. But since the shared queue is serial,
+    // nothing of mine can be running right now, so it's safe to just call the block.
+    void* current = dispatch_get_specific(&kSharedQueueKey);
+    if (_sharedQueueIndex && current == (void*)(uintptr_t)_sharedQueueIndex)
+        block();
+    else
+        dispatch_sync(_websocketQueue, block);
+}
+
 - (void) useTLS: (NSDictionary*)tlsSettings {
 	dispatch_async(_websocketQueue, ^{
         _tlsSettings = tlsSettings;
@@ -233,10 +326,8 @@ static NSData* kTerminator;
     [self closeWithCode: kWebSocketCloseNormal reason: nil];
 }
 
-- (void) closeWithCode:(WebSocketCloseCode)code reason:(NSString *)reason {
-	HTTPLogTrace();
-
-    // http://tools.ietf.org/html/rfc6455#section-5.5.1
+// Builds the payload of a close frame: http://tools.ietf.org/html/rfc6455#section-5.5.1
+static NSData* closeFramePayload(WebSocketCloseCode code, NSString* reason) {
     NSMutableData* msg = nil;
     if (code > 0 || reason != nil) {
         UInt16 rawCode = NSSwapHostShortToBig(code);
@@ -246,7 +337,12 @@ static NSData* kTerminator;
             msg = [NSMutableData dataWithCapacity: sizeof(rawCode)];
         [msg replaceBytesInRange: NSMakeRange(0, 0) withBytes: &rawCode length: sizeof(rawCode)];
     }
+    return msg;
+}
 
+- (void) closeWithCode:(WebSocketCloseCode)code reason:(NSString *)reason {
+	HTTPLogTrace();
+    NSData* msg = closeFramePayload(code, reason);
 	dispatch_async(_websocketQueue, ^{ @autoreleasepool {
         if (_state == kWebSocketOpen) {
             [self sendFrame: msg type: WS_OP_CONNECTION_CLOSE tag: 0];
@@ -255,6 +351,31 @@ static NSData* kTerminator;
     }});
 }
 
+// Fails the connection because of bad input from the peer (RFC 6455, section 7.1.7): sends a
+// close frame with the status code, then disconnects as soon as it's been written. The delegate
+// gets the error when the socket closes. Must be called on the websocket queue.
+- (void) failWithCode: (WebSocketCloseCode)code reason: (NSString*)reason {
+    LogTo(WS, @"%@: Failing connection: %@ (%d)", self, reason, code);
+    if (_state < kWebSocketOpen || !_asyncSocket) {
+        [self didCloseWithCode: code reason: reason];
+        return;
+    }
+    if (!_failure) {
+        _failure = [NSError errorWithDomain: WebSocketErrorDomain
+                                       code: code
+                                   userInfo: @{NSLocalizedFailureReasonErrorKey: reason}];
+    }
+    if (_state == kWebSocketOpen) {
+        [self sendFrame: closeFramePayload(code, reason)
+                   type: WS_OP_CONNECTION_CLOSE
+                    tag: TAG_STOP];
+        self.state = kWebSocketClosing;
+    } else {
+        // Already sent a close frame, so don't wait for the peer's reply:
+        [_asyncSocket disconnect];
+    }
+}
+
 - (void)didOpen {
 	HTTPLogTrace();
 	
@@ -264,6 +385,8 @@ static NSData* kTerminator;
 	// Don't forget to invoke [super didOpen] in your method.
 
     self.state = kWebSocketOpen;
+    if (_noDelay)
+        [self applyNoDelay];
 	
 	// Start reading for messages
     _readyToReadMessage = YES;
@@ -318,67 +441,381 @@ static NSData* kTerminator;
     if (_state >= kWebSocketClosing)
         return;
 	
-	NSMutableData *data = nil;
+	NSData *data = nil;
+    BOOL isControl = (type >= WS_OP_CONNECTION_CLOSE);
+    NSUInteger fragmentSize = self.fragmentSize;
 	
-	if (_isRFC6455) {
-        // Framing format: http://tools.ietf.org/html/rfc6455#section-5.2
-        UInt8 header[14] = {(0x80 | (UInt8)type) /*, 0x00...*/};
-        NSUInteger headerLen;
-
-		NSUInteger length = msgData.length;
-		if (length <= 125) {
-            header[1] = (UInt8)length;
-            headerLen = 2;
-		} else if (length <= 0xFFFF) {
-            header[1] = 0x7E;
-            UInt16 bigLen = NSSwapHostShortToBig((UInt16)length);
-            memcpy(&header[2], &bigLen, sizeof(bigLen));
-			headerLen = 4;
-		} else {
-            header[1] = 0x7F;
-            UInt64 bigLen = NSSwapHostLongLongToBig(length);
-            memcpy(&header[2], &bigLen, sizeof(bigLen));
-			headerLen = 10;
-		}
-
-        UInt8 mask[4];
-        if (_isClient) {
-            header[1] |= 0x80;  // Sets the 'mask' flag
-            (void)SecRandomCopyBytes(kSecRandomDefault, sizeof(mask), mask);
-            memcpy(&header[headerLen], mask, sizeof(mask));
-            headerLen += sizeof(mask);
+	if (!_isRFC6455) {
+		NSMutableData* hixieData = [NSMutableData dataWithCapacity:([msgData length] + 2)];
+		[hixieData appendBytes:"\x00" length:1];
+		[hixieData appendData:msgData];
+		[hixieData appendBytes:"\xFF" length:1];
+        data = hixieData;
+	} else if (isControl || (_isClient && !_perMessageDeflate && (fragmentSize == 0
+                                                        || msgData.length <= fragmentSize))) {
+        // Masking copies the payload anyway, so do that work on the calling thread. (_deflater
+        // is only safe to look at on the websocket queue, but it can't exist unless
+        // perMessageDeflate was set before opening.)
+        data = [self frameWithPayload: msgData.bytes length: msgData.length
+                                 type: type final: YES compressed: NO];
+    } else {
+        // Will be framed later, on the websocket queue: compression state has to be updated in
+        // the same order the messages are sent, and unmasked payloads can be written uncopied.
+        msgData = [msgData copy];
+    }
+	
+	dispatch_async(_websocketQueue, ^{ @autoreleasepool {
+        // Once the close frame's been sent, only control frames can follow it:
+        if (_state == kWebSocketOpen || (isControl && _state == kWebSocketClosing)) {
+            if (isControl) {
+                [self writeData: data tag: tag];
+            } else {
+                id message = data;
+                if (!message) {
+                    BOOL compressed = NO;
+                    NSData* payload = msgData;
+                    if (_deflater && payload.length >= kMinCompressibleSize) {
+                        payload = [self deflateMessage: payload];
+                        if (!payload) {
+                            [self closeWithCode: kWebSocketCloseCantFulfill
+                                         reason: @"Compression failed"];
+                            return;
+                        }
+                        compressed = YES;
+                    }
+                    message = @[payload, @(type), @(compressed)];
+                }
+                [self queueOutgoingMessage: message];
+            }
         }
+    }});
+}
 
-        data = [NSMutableData dataWithCapacity: headerLen + length];
-        [data appendBytes: header length: headerLen];
-        [data appendData: msgData];
+- (NSMutableData*) messageBufferWithCapacity: (NSUInteger)capacity {
+    return [_bufferPool bufferWithLength: kWebSocketHeadroom + capacity];
+}
 
-        if (_isClient) {
-            maskBytes(data, headerLen, length, mask);
-        }
-	} else {
-		data = [NSMutableData dataWithCapacity:([msgData length] + 2)];
-		[data appendBytes:"\x00" length:1];
-		[data appendData:msgData];
-		[data appendBytes:"\xFF" length:1];
-	}
-	
-	dispatch_async(_websocketQueue, ^{ @autoreleasepool {
-        if (_state == kWebSocketOpen) {
-            if (tag == TAG_MESSAGE) {
-                _writeQueueSize += 1; // data.length would be better
+- (void) sendBinaryMessageInBuffer: (NSMutableData*)buffer length: (NSUInteger)length {
+    NSAssert(kWebSocketHeadroom + length <= buffer.length, @"Message overflows its buffer");
+    NSUInteger fragmentSize = self.fragmentSize;
+    if (!_isRFC6455 || (fragmentSize > 0 && length > fragmentSize)) {
+        // The frame can't be built in place, so send it the usual way:
+        [self sendBinaryMessage: [buffer subdataWithRange: NSMakeRange(kWebSocketHeadroom, length)]];
+        [_bufferPool recycleBuffer: buffer];
+        return;
+    }
+
+    dispatch_async(_websocketQueue, ^{ @autoreleasepool {
+        UInt8* payload = (UInt8*)buffer.mutableBytes + kWebSocketHeadroom;
+        if (_state != kWebSocketOpen) {
+            [_bufferPool recycleBuffer: buffer];
+        } else if (_deflater && length >= kMinCompressibleSize) {
+            // Compression creates a new payload, so the buffer can be recycled right away:
+            NSData* compressed = [self deflateMessage: [NSData dataWithBytesNoCopy: payload
+                                                                            length: length
+                                                                      freeWhenDone: NO]];
+            [_bufferPool recycleBuffer: buffer];
+            if (!compressed) {
+                [self closeWithCode: kWebSocketCloseCantFulfill reason: @"Compression failed"];
+                return;
             }
-            [_asyncSocket writeData:data withTimeout:_timeout tag: tag];
-            if (tag == TAG_MESSAGE && _writeQueueSize <= HUNGRY_SIZE)
-                [self isHungry];
+            [self queueOutgoingMessage: @[compressed, @(WS_OP_BINARY_FRAME), @YES]];
+        } else {
+            // Write the header just before the payload, mask the payload in place if necessary,
+            // and send the frame straight from the buffer. It's recycled after it's written.
+            UInt8 header[14], mask[4];
+            size_t headerLen = [self encodeFrameHeader: header payloadLength: length
+                                                  type: WS_OP_BINARY_FRAME final: YES
+                                            compressed: NO mask: mask];
+            if (_isClient)
+                WebSocketMaskBytes(payload, length, mask);
+            memcpy(payload - headerLen, header, headerLen);
+            NSRange frameRange = NSMakeRange(kWebSocketHeadroom - headerLen, headerLen + length);
+            [self queueOutgoingMessage: [_bufferPool dataWithBuffer: buffer range: frameRange]];
         }
     }});
 }
 
+// Adds a message (a complete frame, or an array of [payload, type, compressed]) to the outgoing
+// queue, and starts writing it if possible. Must be called on the websocket queue.
+- (void) queueOutgoingMessage: (id)message {
+    [_outgoingMessages addObject: message];
+    _queuedOutputBytes += [self lengthOfOutgoingMessage: message];
+    [self writeOutgoingMessages];
+    [self updateSendState];
+}
+
+// Encodes an RFC 6455 frame header; returns its length. If I'm a client, a masking key is
+// generated and copied to `mask`.
+- (size_t) encodeFrameHeader: (UInt8*)header payloadLength: (NSUInteger)length
+                        type: (unsigned)type final: (BOOL)final compressed: (BOOL)compressed
+                        mask: (UInt8*)mask
+{
+    // Framing format: http://tools.ietf.org/html/rfc6455#section-5.2
+    header[0] = (final ? 0x80 : 0x00) | (compressed ? 0x40 : 0x00) | (UInt8)type;
+    size_t headerLen;
+    if (length <= 125) {
+        header[1] = (UInt8)length;
+        headerLen = 2;
+    } else if (length <= 0xFFFF) {
+        header[1] = 0x7E;
+        UInt16 bigLen = NSSwapHostShortToBig((UInt16)length);
+        memcpy(&header[2], &bigLen, sizeof(bigLen));
+        headerLen = 4;
+    } else {
+        header[1] = 0x7F;
+        UInt64 bigLen = NSSwapHostLongLongToBig(length);
+        memcpy(&header[2], &bigLen, sizeof(bigLen));
+        headerLen = 10;
+    }
+
+    if (_isClient) {
+        header[1] |= 0x80;  // Sets the 'mask' flag
+        [self getMaskingKey: mask];
+        memcpy(&header[headerLen], mask, 4);
+        headerLen += 4;
+    }
+    return headerLen;
+}
+
+// Encodes an RFC 6455 frame, copying (and if necessary masking) the payload into it.
+- (NSData*) frameWithPayload: (const void*)payload length: (NSUInteger)length
+                        type: (unsigned)type final: (BOOL)final compressed: (BOOL)compressed
+{
+    UInt8 header[14], mask[4];
+    size_t headerLen = [self encodeFrameHeader: header payloadLength: length type: type
+                                         final: final compressed: compressed mask: mask];
+    NSMutableData* data = [NSMutableData dataWithLength: headerLen + length];
+    UInt8* dst = data.mutableBytes;
+    memcpy(dst, header, headerLen);
+    if (_isClient)
+        WebSocketCopyAndMaskBytes(dst + headerLen, payload, length, mask);
+    else if (length > 0)
+        memcpy(dst + headerLen, payload, length);
+    return data;
+}
+
+// Writes a frame whose payload is a range of an NSData. If the payload doesn't need masking and
+// is big enough, it's written to the socket right after the header instead of being copied.
+- (void) writeFrameWithPayload: (NSData*)payload range: (NSRange)range
+                          type: (unsigned)type final: (BOOL)final compressed: (BOOL)compressed
+                           tag: (long)tag
+{
+    if (!_isClient && range.length >= kMinUncopiedPayloadSize) {
+        UInt8 header[14];
+        size_t headerLen = [self encodeFrameHeader: header payloadLength: range.length type: type
+                                             final: final compressed: compressed mask: NULL];
+        [self writeData: [NSData dataWithBytes: header length: headerLen] tag: TAG_FRAME_HEADER];
+        [self writeData: [payload subdataNoCopyWithRange: range] tag: tag];
+    } else {
+        [self writeData: [self frameWithPayload: (const UInt8*)payload.bytes + range.location
+                                         length: range.length type: type final: final
+                                     compressed: compressed]
+                    tag: tag];
+    }
+}
+
+- (void) enableDeflate: (WebSocketDeflateParams)params {
+    LogTo(WS, @"%@ using permessage-deflate (window bits %d/%d%@)", self,
+          params.compressWindowBits, params.decompressWindowBits,
+          (params.compressNoContextTakeover ? @", no context takeover" : @""));
+    _deflateParams = params;
+    _deflater = [[WebSocketDeflater alloc] initWithLevel: Z_DEFAULT_COMPRESSION
+                                              windowBits: -params.compressWindowBits];
+    _inflater = [[WebSocketInflater alloc] initWithWindowBits: -params.decompressWindowBits];
+    _parser.allowCompressedFrames = YES;
+}
+
+// Compresses an outgoing message. Must be called on the websocket queue, in message order.
+- (NSData*) deflateMessage: (NSData*)message {
+    NSMutableData* output = [NSMutableData dataWithCapacity: message.length / 2 + 16];
+    if (![_deflater deflateBytes: message.bytes length: message.length
+                          toData: output flush: Z_SYNC_FLUSH])
+        return nil;
+    // Strip the 00 00 FF FF that the sync flush ends with (RFC 7692, section 7.2.1):
+    if (output.length >= 4)
+        output.length -= 4;
+    if (_deflateParams.compressNoContextTakeover)
+        [_deflater reset];
+    return output;
+}
+
+// Decompresses the next piece of an incoming compressed message.
+// On failure, closes the connection and returns nil.
+- (NSData*) inflateMessageData: (NSData*)data complete: (BOOL)complete {
+    NSUInteger maxLength = 0;
+    if (_maxMessageSize > 0)
+        maxLength = (NSUInteger)MAX(_maxMessageSize - MIN(_messageLength, _maxMessageSize), 1);
+    NSMutableData* output = [NSMutableData dataWithCapacity: 2 * data.length];
+    BOOL ok = [_inflater inflateBytes: data.bytes length: data.length
+                               toData: output maxLength: maxLength];
+    if (ok && complete) {
+        // Add back the 00 00 FF FF the sender removed, or reset if it ended the stream:
+        ok = [_inflater finishMessageToData: output maxLength: maxLength];
+    }
+    if (!ok) {
+        if (maxLength > 0 && output.length > maxLength)
+            [self failWithCode: kWebSocketCloseMessageTooBig reason: @"Message too big"];
+        else
+            [self failWithCode: kWebSocketCloseBadMessageFormat
+                        reason: @"Couldn't decompress message"];
+        return nil;
+    }
+    return output;
+}
+
+// Writes frames of the messages in _outgoingMessages, in order. Fragmented messages are written
+// a few frames at a time, so that control frames can be sent in between; the rest are written
+// as write completions arrive. Must be called on the websocket queue.
+- (void) writeOutgoingMessages {
+    if (_state != kWebSocketOpen) {
+        // No more data frames after a close frame:
+        for (id message in _outgoingMessages)
+            _queuedOutputBytes -= [self lengthOfOutgoingMessage: message];
+        _queuedOutputBytes += _fragmentOffset;
+        [_outgoingMessages removeAllObjects];
+        _fragmentOffset = 0;
+        return;
+    }
+    while (_outgoingMessages.count > 0) {
+        id message = _outgoingMessages[0];
+        if ([message isKindOfClass: [NSData class]]) {
+            // An already-encoded frame:
+            [_writtenFrameSizes addObject: @([message length])];
+            [self writeData: message tag: TAG_MESSAGE];
+        } else {
+            NSData* payload = message[0];
+            NSUInteger length = payload.length - _fragmentOffset;
+            if (_fragmentSize > 0)
+                length = MIN(length, _fragmentSize);
+            BOOL first = (_fragmentOffset == 0);
+            BOOL final = (_fragmentOffset + length == payload.length);
+            long tag = TAG_MESSAGE;
+            if (!(first && final)) {
+                if (_fragmentsInFlight >= kMaxFragmentsInFlight)
+                    break;
+                ++_fragmentsInFlight;
+                tag = final ? TAG_LAST_FRAGMENT : TAG_FRAGMENT;
+            }
+            unsigned type = first ? [message[1] unsignedIntValue] : WS_OP_CONTINUATION_FRAME;
+            BOOL compressed = first && [message[2] boolValue];
+            [_writtenFrameSizes addObject: @(length)];
+            [self writeFrameWithPayload: payload range: NSMakeRange(_fragmentOffset, length)
+                                   type: type final: final compressed: compressed tag: tag];
+            _fragmentOffset += length;
+            if (!final)
+                continue;
+        }
+        [_outgoingMessages removeObjectAtIndex: 0];
+        _fragmentOffset = 0;
+    }
+}
+
+// The number of bytes an entry in _outgoingMessages adds to queuedOutputBytes.
+- (NSUInteger) lengthOfOutgoingMessage: (id)message {
+    if ([message isKindOfClass: [NSData class]])
+        return [message length];
+    else
+        return [message[0] length];
+}
+
+// Writes data to the socket. Small writes are coalesced into a single buffer, which is written
+// at the end of the current turn of the websocket queue or as soon as it fills up.
+- (void) writeData: (NSData*)data tag: (long)tag {
+    NSUInteger limit = _writeCoalescingLimit;
+    if (limit > 0 && data.length <= kMaxCoalescedWriteSize) {
+        if (!_coalescedData) {
+            _coalescedData = [[NSMutableData alloc] initWithCapacity: limit];
+            _coalescedTags = [[NSMutableArray alloc] init];
+            dispatch_async(_websocketQueue, ^{
+                [self flushWrites];
+            });
+        }
+        [_coalescedData appendData: data];
+        [_coalescedTags addObject: @(tag)];
+        if (_coalescedData.length >= limit)
+            [self flushWrites];
+    } else {
+        [self flushWrites];
+        [_asyncSocket writeData: data withTimeout: _timeout tag: tag];
+    }
+}
+
+// Writes any coalesced data to the socket.
+- (void) flushWrites {
+    if (!_coalescedData)
+        return;
+    if (_coalescedTags.count == 1) {
+        [_asyncSocket writeData: _coalescedData withTimeout: _timeout
+                            tag: [_coalescedTags[0] longValue]];
+    } else {
+        [_coalescedTagGroups addObject: _coalescedTags];
+        [_asyncSocket writeData: _coalescedData withTimeout: _timeout tag: TAG_COALESCED];
+    }
+    _coalescedData = nil;
+    _coalescedTags = nil;
+}
+
+- (BOOL) noDelay {
+    __block BOOL result;
+    [self syncOnWebSocketQueue: ^{
+        result = _noDelay;
+    }];
+    return result;
+}
+
+- (void) setNoDelay: (BOOL)noDelay {
+    dispatch_async(_websocketQueue, ^{
+        _noDelay = noDelay;
+        [self applyNoDelay];
+    });
+}
+
+// Sets the socket's TCP_NODELAY option to match the noDelay property.
+- (void) applyNoDelay {
+    GCDAsyncSocket* socket = _asyncSocket;
+    int flag = _noDelay;
+    [socket performBlock: ^{
+        int fd = socket.socketFD;
+        if (fd >= 0 && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) != 0)
+            Warn(@"WebSocket: couldn't set TCP_NODELAY (errno %d)", errno);
+    }];
+}
+
+// Gets a random masking key for a frame. Random bytes are fetched in bulk, since
+// SecRandomCopyBytes is too expensive to call for every frame.
+- (void) getMaskingKey: (UInt8*)mask {
+    @synchronized(self) {
+        if (_maskKeyPos + 4 > kMaskKeyPoolSize) {
+            (void)SecRandomCopyBytes(kSecRandomDefault, kMaskKeyPoolSize, _maskKeys);
+            _maskKeyPos = 0;
+        }
+        memcpy(mask, &_maskKeys[_maskKeyPos], 4);
+        _maskKeyPos += 4;
+    }
+}
+
+// Called when a data frame has been written to the socket.
 - (void) finishedSendingFrame {
-    _writeQueueSize -= 1; // data.length would be better but we don't know it anymore
-    if (_writeQueueSize <= HUNGRY_SIZE)
-        [self isHungry];
+    _queuedOutputBytes -= [_writtenFrameSizes[0] unsignedIntegerValue];
+    [_writtenFrameSizes removeObjectAtIndex: 0];
+    [self updateSendState];
+}
+
+// Tells the delegate whether to send more, based on the amount of queued output. Below the high
+// watermark it's hungry after every send or write; once it's passed the high watermark it's full,
+// and doesn't get hungry again until the queue drains down to the low watermark.
+- (void) updateSendState {
+    if (_sendFull) {
+        if (_queuedOutputBytes > _sendLowWatermark)
+            return;
+        _sendFull = NO;
+    } else if (_queuedOutputBytes >= _sendHighWatermark) {
+        _sendFull = YES;
+        [self isFull];
+        return;
+    }
+    [self isHungry];
 }
 
 - (void) isHungry {
@@ -389,6 +826,13 @@ static NSData* kTerminator;
 		[delegate webSocketIsHungry:self];
 }
 
+- (void) isFull {
+	HTTPLogTrace();
+    id<WebSocketDelegate> delegate = _delegate;
+	if ([delegate respondsToSelector:@selector(webSocketIsFull:)])
+		[delegate webSocketIsFull:self];
+}
+
 #pragma mark - RECEIVING MESSAGES:
 
 - (BOOL) didReceiveFrame: (NSData*)frame type: (NSUInteger)type {
@@ -418,10 +862,70 @@ static NSData* kTerminator;
             }
             return NO;
         default:
-			[self didCloseWithCode: kWebSocketCloseProtocolError
-                            reason: @"Unsupported frame type"];
+			[self failWithCode: kWebSocketCloseProtocolError
+                        reason: @"Unsupported frame type"];
+            return NO;
+    }
+}
+
+// Handles incoming data-frame payloads (text, binary or continuation), which may be entire frames
+// or chunks of large ones. Fragmented and large binary messages are passed on in pieces if the
+// delegate supports that; otherwise the message is assembled and then handled as usual.
+- (BOOL) didReceiveData: (NSData*)data type: (UInt8)type
+                  final: (BOOL)final endOfFrame: (BOOL)endOfFrame
+{
+    if (!_inFrame) {
+        // Start of a frame:
+        if (_messageType == 0) {
+            if (type == WS_OP_CONTINUATION_FRAME) {
+                [self failWithCode: kWebSocketCloseProtocolError
+                            reason: @"Unexpected continuation frame"];
+                return NO;
+            }
+            _messageType = type;
+            _messageLength = 0;
+            _messageCompressed = _parser.frameCompressed;
+            id<WebSocketDelegate> delegate = _delegate;
+            _deliveringChunks = (type == WS_OP_BINARY_FRAME && !(final && endOfFrame) &&
+                [delegate respondsToSelector: @selector(webSocket:didReceiveBinaryMessageChunk:complete:)]);
+            if (!_deliveringChunks && !(final && endOfFrame))
+                _partialMessage = [[NSMutableData alloc] init];
+        } else if (type != WS_OP_CONTINUATION_FRAME) {
+            [self failWithCode: kWebSocketCloseProtocolError
+                        reason: @"Expected continuation frame"];
             return NO;
+        }
     }
+    _inFrame = !endOfFrame;
+    BOOL complete = final && endOfFrame;
+
+    if (_messageCompressed) {
+        data = [self inflateMessageData: data complete: complete];
+        if (!data)
+            return NO;
+    }
+
+    _messageLength += data.length;
+    if (_maxMessageSize > 0 && _messageLength > _maxMessageSize) {
+        [self failWithCode: kWebSocketCloseMessageTooBig reason: @"Message too big"];
+        return NO;
+    }
+
+    type = _messageType;
+    if (complete)
+        _messageType = 0;
+
+    if (_deliveringChunks) {
+        [self didReceiveBinaryMessageChunk: data complete: complete];
+        return YES;
+    } else if (_partialMessage) {
+        [_partialMessage appendData: data];
+        if (!complete)
+            return YES;
+        data = _partialMessage;
+        _partialMessage = nil;
+    }
+    return [self didReceiveFrame: data type: type];
 }
 
 - (void)didReceiveMessage:(NSString *)msg {
@@ -456,19 +960,67 @@ static NSData* kTerminator;
 	}
 }
 
+- (void)didReceiveBinaryMessageChunk:(NSData *)chunk complete:(BOOL)complete {
+	HTTPLogTrace();
+
+	// Override me to process incoming messages.
+	// This method is invoked on the websocketQueue.
+	//
+	// For completeness, you should invoke [super didReceiveBinaryMessageChunk:complete:]
+	// in your method.
+
+	// Notify delegate
+    id<WebSocketDelegate> delegate = _delegate;
+	if ([delegate respondsToSelector:@selector(webSocket:didReceiveBinaryMessageChunk:complete:)]) {
+		if (![delegate webSocket:self didReceiveBinaryMessageChunk:chunk complete:complete])
+            [self _setReadPaused: YES];
+	}
+}
+
+- (BOOL) canReadMessages {
+    return !_readPaused && (_state == kWebSocketOpen || _state == kWebSocketClosing);
+}
+
 - (void) startReadingNextMessage {
-    if (_readyToReadMessage && !_readPaused && _state == kWebSocketOpen) {
+    if (_readyToReadMessage && [self canReadMessages]) {
+        if (!_isRFC6455) {
+            _readyToReadMessage = NO;
+            [_asyncSocket readDataToLength:1 withTimeout:_timeout tag:TAG_PREFIX];
+            return;
+        }
+        // First process any complete frames already in the buffer:
+        if (![_parser parse] || ![self canReadMessages])
+            return;
+        // Then read whatever the socket has available, appending it to the parser's buffer:
         _readyToReadMessage = NO;
-        [_asyncSocket readDataToLength:1 withTimeout:_timeout
-                                   tag:(_isRFC6455 ? TAG_PAYLOAD_PREFIX : TAG_PREFIX)];
+        NSMutableData* buffer = _parser.buffer;
+        [_asyncSocket readDataWithTimeout: _timeout
+                                   buffer: buffer
+                             bufferOffset: buffer.length
+                                      tag: TAG_FRAME_DATA];
     }
 }
 
+- (UInt64) maxMessageSize {
+    __block UInt64 result;
+    [self syncOnWebSocketQueue: ^{
+        result = _maxMessageSize;
+    }];
+    return result;
+}
+
+- (void) setMaxMessageSize: (UInt64)maxMessageSize {
+    dispatch_async(_websocketQueue, ^{
+        _maxMessageSize = maxMessageSize;
+        _parser.maxFrameSize = maxMessageSize;
+    });
+}
+
 - (BOOL) readPaused {
     __block BOOL result;
-    dispatch_sync(_websocketQueue, ^{
+    [self syncOnWebSocketQueue: ^{
         result = _readPaused;
-    });
+    }];
     return result;
 }
 
@@ -508,31 +1060,6 @@ static NSData* kTerminator;
     });
 }
 
-// 0                   1                   2                   3
-// 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-// +-+-+-+-+-------+-+-------------+-------------------------------+
-// |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
-// |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
-// |N|V|V|V|       |S|             |   (if payload len==126/127)   |
-// | |1|2|3|       |K|             |                               |
-// +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
-// |     Extended payload length continued, if payload len == 127  |
-// + - - - - - - - - - - - - - - - +-------------------------------+
-// |                               |Masking-key, if MASK set to 1  |
-// +-------------------------------+-------------------------------+
-// | Masking-key (continued)       |          Payload Data         |
-// +-------------------------------- - - - - - - - - - - - - - - - +
-// :                     Payload Data continued ...                :
-// + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
-// |                     Payload Data continued ...                |
-// +---------------------------------------------------------------+
-
-- (BOOL)isValidWebSocketFrame:(UInt8)frame {
-	NSUInteger rsv =  frame & 0x70;
-	NSUInteger opcode = frame & 0x0F;
-	return ! ((rsv || (3 <= opcode && opcode <= 7) || (0xB <= opcode && opcode <= 0xF)));
-}
-
 - (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data withTag:(long)tag {
 	HTTPLogTrace();
 	
@@ -547,65 +1074,10 @@ static NSData* kTerminator;
 			[self didCloseWithCode: kWebSocketCloseProtocolError
                             reason: @"Unsupported frame type"];
 		}
-	} else if (tag == TAG_PAYLOAD_PREFIX) {
-		UInt8 *pFrame = (UInt8 *)[data bytes];
-		UInt8 frame = *pFrame;
-
-		if ([self isValidWebSocketFrame: frame]) {
-			_nextOpCode = (frame & 0x0F);
-			[_asyncSocket readDataToLength:1 withTimeout:_timeout tag:TAG_PAYLOAD_LENGTH];
-		} else {
-			// Unsupported frame type
-			[self didCloseWithCode: kWebSocketCloseProtocolError
-                            reason: @"Invalid incoming frame"];
-		}
-	} else if (tag == TAG_PAYLOAD_LENGTH) {
-		UInt8 frame = *(UInt8 *)[data bytes];
-		BOOL masked = WS_PAYLOAD_IS_MASKED(frame);
-		NSUInteger length = WS_PAYLOAD_LENGTH(frame);
-		_nextFrameMasked = masked;
-		_maskingKey = nil;
-        if (length <= 125) {
-			if (_nextFrameMasked)
-			{
-				[_asyncSocket readDataToLength:4 withTimeout:_timeout tag:TAG_MSG_MASKING_KEY];
-			}
-            if (length > 0) {
-                [_asyncSocket readDataToLength:length withTimeout:_timeout tag:TAG_MSG_WITH_LENGTH];
-            } else {
-                // Special case: zero-length payload doesn't need any read call at all
-                [self socket: sock didReadData: [NSData data] withTag: TAG_MSG_WITH_LENGTH];
-            }
-		} else if (length == 126) {
-			[_asyncSocket readDataToLength:2 withTimeout:_timeout tag:TAG_PAYLOAD_LENGTH16];
-		} else {
-			[_asyncSocket readDataToLength:8 withTimeout:_timeout tag:TAG_PAYLOAD_LENGTH64];
-		}
-	} else if (tag == TAG_PAYLOAD_LENGTH16) {
-		UInt8 *pFrame = (UInt8 *)[data bytes];
-		NSUInteger length = ((NSUInteger)pFrame[0] << 8) | (NSUInteger)pFrame[1];
-		if (_nextFrameMasked) {
-			[_asyncSocket readDataToLength:4 withTimeout:_timeout tag:TAG_MSG_MASKING_KEY];
-		}
-		[_asyncSocket readDataToLength:length withTimeout:_timeout tag:TAG_MSG_WITH_LENGTH];
-	} else if (tag == TAG_PAYLOAD_LENGTH64) {
-		// TODO: 64bit data size in memory?
-        [self didCloseWithCode: kWebSocketClosePolicyError
-                        reason: @"Oops, 64-bit frame size not yet supported"];
-	} else if (tag == TAG_MSG_WITH_LENGTH) {
-		NSUInteger msgLength = [data length];
-		if (_nextFrameMasked && _maskingKey) {
-			NSMutableData *masked = data.mutableCopy;
-            maskBytes(masked, 0, msgLength, _maskingKey.bytes);
-			data = masked;
-		}
+	} else if (tag == TAG_FRAME_DATA) {
+        // The data has already been appended to the parser's buffer:
         _readyToReadMessage = YES;
-        if ([self didReceiveFrame: data type: _nextOpCode]) {
-            // Read next frame
-            [self startReadingNextMessage];
-        }
-	} else if (tag == TAG_MSG_MASKING_KEY) {
-		_maskingKey = data.copy;
+        [self startReadingNextMessage];
 	} else {
 		NSUInteger msgLength = [data length] - 1; // Excluding ending 0xFF frame
 		NSString *msg = [[NSString alloc] initWithBytes:[data bytes] length:msgLength encoding:NSUTF8StringEncoding];
@@ -616,12 +1088,61 @@ static NSData* kTerminator;
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Frame Parser Delegate
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL) frameParser: (WebSocketFrameParser*)parser
+        didReadFrame: (NSData*)payload
+              opcode: (UInt8)opcode
+               final: (BOOL)final
+{
+    BOOL ok;
+    if (opcode >= WS_OP_CONNECTION_CLOSE)
+        ok = [self didReceiveFrame: payload type: opcode];
+    else
+        ok = [self didReceiveData: payload type: opcode final: final endOfFrame: YES];
+    return ok && [self canReadMessages];
+}
+
+- (BOOL) frameParser: (WebSocketFrameParser*)parser
+   didReadFrameChunk: (NSData*)chunk
+              opcode: (UInt8)opcode
+               final: (BOOL)final
+           lastChunk: (BOOL)lastChunk
+{
+    return [self didReceiveData: chunk type: opcode final: final endOfFrame: lastChunk]
+        && [self canReadMessages];
+}
+
+- (void) frameParser: (WebSocketFrameParser*)parser
+     didFailWithCode: (WebSocketCloseCode)code
+              reason: (NSString*)reason
+{
+    [self failWithCode: code reason: reason];
+}
+
 - (void)socket:(GCDAsyncSocket *)sock didWriteDataWithTag:(long)tag {
 	HTTPLogTrace();
+    if (tag == TAG_COALESCED) {
+        NSArray* tags = _coalescedTagGroups[0];
+        [_coalescedTagGroups removeObjectAtIndex: 0];
+        for (NSNumber* frameTag in tags)
+            [self didWriteFrameWithTag: frameTag.longValue];
+    } else {
+        [self didWriteFrameWithTag: tag];
+    }
+}
+
+- (void) didWriteFrameWithTag: (long)tag {
     if (tag == TAG_STOP) {
         [self disconnect];
     } else if (tag == TAG_MESSAGE) {
         [self finishedSendingFrame];
+    } else if (tag == TAG_FRAGMENT || tag == TAG_LAST_FRAGMENT) {
+        --_fragmentsInFlight;
+        [self writeOutgoingMessages];
+        [self finishedSendingFrame];
     }
 }
 
@@ -652,6 +1173,11 @@ static NSData* kTerminator;
                                     code: urlCode
                                 userInfo: @{NSUnderlyingErrorKey: error}];
     }
+    if (_failure) {
+        // I closed the connection because of a protocol error; report that instead:
+        error = _failure;
+        _failure = nil;
+    }
     [self didCloseWithError: error];
 }
 
@@ -29,4 +29,8 @@
 /** Authentication credential. */
 @property NSURLCredential* credential;
 
+/** Subprotocols to offer the server, in order of preference. Set this before connecting.
+    The one the server picks, if any, is available from the `protocol` property once open. */
+@property (copy) NSArray* protocols;
+
 @end
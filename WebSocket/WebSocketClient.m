@@ -31,7 +31,7 @@
 }
 
 
-@synthesize credential=_credential;
+@synthesize credential=_credential, protocols=_protocols;
 
 
 - (instancetype) initWithURLRequest:(NSURLRequest *)urlRequest {
@@ -63,9 +63,9 @@
 
 - (BOOL) connect: (NSError**)outError {
     __block BOOL result = NO;
-	dispatch_sync(_websocketQueue, ^{
+	[self syncOnWebSocketQueue: ^{
         result = [self _connect: outError];
-    });
+    }];
     return result;
 }
 
@@ -108,6 +108,9 @@
     _logic[@"Sec-WebSocket-Key"] = _nonceKey;
     if (_protocols)
         _logic[@"Sec-WebSocket-Protocol"] = [_protocols componentsJoinedByString: @","];
+    if (self.perMessageDeflate)
+        _logic[@"Sec-WebSocket-Extensions"] = WebSocketDeflateOffer(self.deflateWindowBits,
+                                                                   self.deflateContextTakeover);
 
     CFHTTPMessageRef httpMsg = [_logic newHTTPRequest];
     NSData* requestData = CFBridgingRelease(CFHTTPMessageCopySerializedMessage(httpMsg));
@@ -174,7 +177,32 @@
         return;
     }
 
-    // TODO: Check Sec-WebSocket-Extensions for unknown extensions
+    // Check which subprotocol the server chose; it has to be one I offered:
+    NSString* protocol = CFBridgingRelease(CFHTTPMessageCopyHeaderFieldValue(httpResponse,
+                                                        CFSTR("Sec-WebSocket-Protocol")));
+    if (protocol && ![_protocols containsObject: protocol]) {
+        [self didCloseWithCode: kWebSocketCloseProtocolError
+                        reason: @"Invalid 'Sec-WebSocket-Protocol' header"];
+        return;
+    }
+    _protocol = protocol;
+
+    // Check which extensions the server accepted:
+    NSString* extensions = CFBridgingRelease(CFHTTPMessageCopyHeaderFieldValue(httpResponse,
+                                                        CFSTR("Sec-WebSocket-Extensions")));
+    WebSocketDeflateParams deflateParams;
+    BOOL deflate;
+    if (!WebSocketDeflateParseResponse(extensions, &deflateParams, &deflate)
+            || (deflate && !self.perMessageDeflate)) {
+        [self didCloseWithCode: kWebSocketCloseProtocolError
+                        reason: @"Invalid 'Sec-WebSocket-Extensions' header"];
+        return;
+    }
+    if (deflate) {
+        if (!self.deflateContextTakeover)
+            deflateParams.compressNoContextTakeover = YES;
+        [self enableDeflate: deflateParams];
+    }
 
     // Now I can hook up the socket as my asyncSocket and start the WebSocket protocol:
     _asyncSocket = _httpSocket;
@@ -0,0 +1,92 @@
+//
+//  WebSocketDeflate.h
+//  WebSocket
+//
+//  Copyright (c) 2015 Couchbase, Inc. All rights reserved.
+
+#import <Foundation/Foundation.h>
+
+
+/** Incremental zlib compressor. Each call compresses more input, appending the output to an
+    NSMutableData, so a message can be compressed piece by piece. */
+@interface WebSocketDeflater : NSObject
+
+/** @param level  zlib compression level (0-9, or Z_DEFAULT_COMPRESSION)
+    @param windowBits  Base-2 log of the LZ77 window size, using zlib's conventions: negative for
+                raw deflate (as used by WebSockets), or plus 16 for gzip format. */
+- (instancetype) initWithLevel: (int)level windowBits: (int)windowBits;
+
+/** Compresses the bytes, appending the output to the data.
+    @param flush  zlib flush mode: Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH.
+    @return  YES on success, NO on a zlib error. */
+- (BOOL) deflateBytes: (const void*)bytes
+               length: (size_t)length
+               toData: (NSMutableData*)output
+                flush: (int)flush;
+
+/** Resets the compressor to its initial state, discarding its history. */
+- (void) reset;
+
+@end
+
+
+/** Incremental zlib decompressor; the counterpart of WebSocketDeflater. */
+@interface WebSocketInflater : NSObject
+
+/** @param windowBits  Base-2 log of the LZ77 window size, using zlib's conventions: negative for
+                raw deflate, plus 16 for gzip, or plus 32 to auto-detect zlib or gzip. */
+- (instancetype) initWithWindowBits: (int)windowBits;
+
+/** Decompresses the bytes, appending the output to the data.
+    @param maxLength  If nonzero, decompression fails if the data would grow longer than this.
+    @return  YES on success, NO on corrupt input or if maxLength is exceeded. */
+- (BOOL) inflateBytes: (const void*)bytes
+               length: (size_t)length
+               toData: (NSMutableData*)output
+            maxLength: (NSUInteger)maxLength;
+
+/** Call this at the end of a permessage-deflate message, after its last bytes have been passed to
+    -inflateBytes:. Appends the 00 00 FF FF trailer the sender removed (RFC 7692, section 7.2.2),
+    unless the message ended the stream with a final (BFINAL) block; in that case the
+    decompressor is reset so the next message can start a new stream.
+    Returns NO under the same conditions as -inflateBytes:. */
+- (BOOL) finishMessageToData: (NSMutableData*)output maxLength: (NSUInteger)maxLength;
+
+/** Resets the decompressor to its initial state. */
+- (void) reset;
+
+/** YES if the end of the compressed stream has been reached. */
+@property (readonly) BOOL finished;
+
+@end
+
+
+/** The permessage-deflate parameters agreed on for a connection, from one side's point of view. */
+typedef struct {
+    int compressWindowBits;             // LZ77 window size for messages I send (9...15)
+    BOOL compressNoContextTakeover;     // Must I reset my compressor after every message?
+    int decompressWindowBits;           // LZ77 window size of messages I receive (8...15)
+} WebSocketDeflateParams;
+
+/** Client side: returns a Sec-WebSocket-Extensions header value offering permessage-deflate
+    (RFC 7692.)
+    @param maxWindowBits  Largest LZ77 window the server may compress with (9...15).
+    @param contextTakeover  If NO, asks that both sides reset their compressors after every message. */
+NSString* WebSocketDeflateOffer(int maxWindowBits, BOOL contextTakeover);
+
+/** Client side: interprets the Sec-WebSocket-Extensions header of the server's response to an
+    offer made with WebSocketDeflateOffer.
+    @param header  The header value, or nil if it was absent.
+    @param outAccepted  On return, YES if the server accepted permessage-deflate.
+    @return  NO if the header is invalid or names any other extension. */
+BOOL WebSocketDeflateParseResponse(NSString* header, WebSocketDeflateParams* outParams,
+                                   BOOL* outAccepted);
+
+/** Server side: looks through the Sec-WebSocket-Extensions header of a client's request for an
+    acceptable permessage-deflate offer.
+    @param header  The header value, or nil if it was absent.
+    @param maxWindowBits  Largest LZ77 window the client may compress with (9...15).
+    @param contextTakeover  If NO, both sides will reset their compressors after every message.
+    @return  The header value to send in the response, or nil if there's no acceptable offer. */
+NSString* WebSocketDeflateAcceptOffer(NSString* header, int maxWindowBits, BOOL contextTakeover,
+                                      WebSocketDeflateParams* outParams);
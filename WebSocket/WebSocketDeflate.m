@@ -0,0 +1,439 @@
+//
+//  WebSocketDeflate.m
+//  WebSocket
+//
+//  Copyright (c) 2015 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "WebSocketDeflate.h"
+#import "Logging.h"
+#import "Test.h"
+#import <zlib.h>
+
+
+// Minimum amount of room to add to the output data before each call to zlib
+#define kMinOutputChunk 4096
+
+
+@implementation WebSocketDeflater
+{
+    z_stream _z;
+    BOOL _ok;
+}
+
+
+- (instancetype) initWithLevel: (int)level windowBits: (int)windowBits {
+    self = [super init];
+    if (self) {
+        if (deflateInit2(&_z, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return nil;
+        _ok = YES;
+    }
+    return self;
+}
+
+- (void) dealloc {
+    if (_ok)
+        deflateEnd(&_z);
+}
+
+
+- (BOOL) deflateBytes: (const void*)bytes
+               length: (size_t)length
+               toData: (NSMutableData*)output
+                flush: (int)flush
+{
+    _z.next_in = (Bytef*)bytes;
+    _z.avail_in = (uInt)length;
+    size_t chunk = MAX(kMinOutputChunk, length / 2);
+    int err;
+    do {
+        NSUInteger used = output.length;
+        output.length = used + chunk;
+        _z.next_out = (Bytef*)output.mutableBytes + used;
+        _z.avail_out = (uInt)chunk;
+        err = deflate(&_z, flush);
+        output.length = used + (chunk - _z.avail_out);
+        // (If the output filled up, there may be more pending, so go around again.)
+    } while (err == Z_OK && (_z.avail_in > 0 || _z.avail_out == 0 || flush == Z_FINISH));
+    return (err == Z_OK || err == Z_STREAM_END || err == Z_BUF_ERROR);
+}
+
+
+- (void) reset {
+    deflateReset(&_z);
+}
+
+
+@end
+
+
+
+
+@implementation WebSocketInflater
+{
+    z_stream _z;
+    BOOL _ok;
+}
+
+@synthesize finished=_finished;
+
+
+- (instancetype) initWithWindowBits: (int)windowBits {
+    self = [super init];
+    if (self) {
+        if (inflateInit2(&_z, windowBits) != Z_OK)
+            return nil;
+        _ok = YES;
+    }
+    return self;
+}
+
+- (void) dealloc {
+    if (_ok)
+        inflateEnd(&_z);
+}
+
+
+- (BOOL) inflateBytes: (const void*)bytes
+               length: (size_t)length
+               toData: (NSMutableData*)output
+            maxLength: (NSUInteger)maxLength
+{
+    if (_finished)
+        return (length == 0);
+    _z.next_in = (Bytef*)bytes;
+    _z.avail_in = (uInt)length;
+    size_t chunk = MAX(kMinOutputChunk, 2 * length);
+    int err;
+    do {
+        NSUInteger used = output.length;
+        output.length = used + chunk;
+        _z.next_out = (Bytef*)output.mutableBytes + used;
+        _z.avail_out = (uInt)chunk;
+        err = inflate(&_z, Z_SYNC_FLUSH);
+        output.length = used + (chunk - _z.avail_out);
+        if (maxLength > 0 && output.length > maxLength)
+            return NO;
+    } while (err == Z_OK && (_z.avail_in > 0 || _z.avail_out == 0));
+    if (err == Z_STREAM_END)
+        _finished = YES;
+    return (err == Z_OK || err == Z_STREAM_END || (err == Z_BUF_ERROR && _z.avail_in == 0));
+}
+
+
+- (BOOL) finishMessageToData: (NSMutableData*)output maxLength: (NSUInteger)maxLength {
+    static const UInt8 kTrailer[4] = {0x00, 0x00, 0xFF, 0xFF};
+    BOOL ok = YES;
+    if (!_finished)
+        ok = [self inflateBytes: kTrailer length: sizeof(kTrailer)
+                         toData: output maxLength: maxLength];
+    if (_finished)
+        [self reset];
+    return ok;
+}
+
+
+- (void) reset {
+    inflateReset(&_z);
+    _finished = NO;
+}
+
+
+@end
+
+
+
+
+#pragma mark - PERMESSAGE-DEFLATE NEGOTIATION:
+
+
+static NSString* const kPerMessageDeflate = @"permessage-deflate";
+
+
+static NSString* trim(NSString* str) {
+    return [str stringByTrimmingCharactersInSet: [NSCharacterSet whitespaceCharacterSet]];
+}
+
+
+// Parses a Sec-WebSocket-Extensions header value into an array of [name, parameters] pairs.
+// Parameters without values map to the empty string. Returns nil on a syntax error.
+static NSArray* parseExtensions(NSString* header) {
+    NSMutableArray* result = [NSMutableArray array];
+    for (NSString* item in [header componentsSeparatedByString: @","]) {
+        NSArray* parts = [item componentsSeparatedByString: @";"];
+        NSString* name = trim(parts[0]);
+        if (name.length == 0)
+            return nil;
+        NSMutableDictionary* params = [NSMutableDictionary dictionary];
+        for (NSUInteger i = 1; i < parts.count; ++i) {
+            NSString* param = parts[i];
+            NSString *key, *value = @"";
+            NSRange eq = [param rangeOfString: @"="];
+            if (eq.location == NSNotFound) {
+                key = trim(param);
+            } else {
+                key = trim([param substringToIndex: eq.location]);
+                value = trim([param substringFromIndex: NSMaxRange(eq)]);
+                if (value.length >= 2 && [value hasPrefix: @"\""] && [value hasSuffix: @"\""])
+                    value = [value substringWithRange: NSMakeRange(1, value.length - 2)];
+            }
+            if (key.length == 0 || params[key])
+                return nil;     // parameters can't be repeated
+            params[key] = value;
+        }
+        [result addObject: @[name, params]];
+    }
+    return result;
+}
+
+
+// Parses a window-bits parameter value, which has to be a number in the range 8...15.
+static BOOL parseWindowBits(NSString* value, int* outBits) {
+    if (value.length < 1 || value.length > 2)
+        return NO;
+    for (NSUInteger i = 0; i < value.length; ++i)
+        if (!isdigit([value characterAtIndex: i]))
+            return NO;
+    int bits = value.intValue;
+    if (bits < 8 || bits > 15)
+        return NO;
+    *outBits = bits;
+    return YES;
+}
+
+
+NSString* WebSocketDeflateOffer(int maxWindowBits, BOOL contextTakeover) {
+    NSMutableString* offer = [NSMutableString stringWithFormat: @"%@; client_max_window_bits",
+                              kPerMessageDeflate];
+    if (maxWindowBits < 15)
+        [offer appendFormat: @"; server_max_window_bits=%d", MAX(maxWindowBits, 9)];
+    if (!contextTakeover)
+        [offer appendString: @"; server_no_context_takeover; client_no_context_takeover"];
+    return offer;
+}
+
+
+BOOL WebSocketDeflateParseResponse(NSString* header, WebSocketDeflateParams* outParams,
+                                   BOOL* outAccepted)
+{
+    *outAccepted = NO;
+    if (header.length == 0)
+        return YES;
+    NSArray* extensions = parseExtensions(header);
+    if (!extensions)
+        return NO;
+    for (NSArray* extension in extensions) {
+        if (![extension[0] isEqualToString: kPerMessageDeflate] || *outAccepted)
+            return NO;      // Server can't accept an extension I didn't offer
+        WebSocketDeflateParams params = {15, NO, 15};
+        NSDictionary* paramDict = extension[1];
+        for (NSString* key in paramDict) {
+            NSString* value = paramDict[key];
+            if ([key isEqualToString: @"server_no_context_takeover"]) {
+                if (value.length > 0)
+                    return NO;
+            } else if ([key isEqualToString: @"client_no_context_takeover"]) {
+                if (value.length > 0)
+                    return NO;
+                params.compressNoContextTakeover = YES;
+            } else if ([key isEqualToString: @"server_max_window_bits"]) {
+                if (!parseWindowBits(value, &params.decompressWindowBits))
+                    return NO;
+            } else if ([key isEqualToString: @"client_max_window_bits"]) {
+                // (zlib can't compress with an 8-bit window)
+                if (!parseWindowBits(value, &params.compressWindowBits)
+                        || params.compressWindowBits < 9)
+                    return NO;
+            } else {
+                return NO;
+            }
+        }
+        *outParams = params;
+        *outAccepted = YES;
+    }
+    return YES;
+}
+
+
+NSString* WebSocketDeflateAcceptOffer(NSString* header, int maxWindowBits, BOOL contextTakeover,
+                                      WebSocketDeflateParams* outParams)
+{
+    maxWindowBits = MIN(MAX(maxWindowBits, 9), 15);
+    for (NSArray* extension in parseExtensions(header)) {
+        if (![extension[0] isEqualToString: kPerMessageDeflate])
+            continue;
+        WebSocketDeflateParams params = {15, !contextTakeover, 15};
+        BOOL clientNoContextTakeover = !contextTakeover;
+        BOOL hasServerBits = NO, hasClientBits = NO;
+        int clientBits = 15;
+        BOOL acceptable = YES;
+        NSDictionary* paramDict = extension[1];
+        for (NSString* key in paramDict) {
+            NSString* value = paramDict[key];
+            if ([key isEqualToString: @"server_no_context_takeover"]) {
+                acceptable = (value.length == 0);
+                params.compressNoContextTakeover = YES;
+            } else if ([key isEqualToString: @"client_no_context_takeover"]) {
+                acceptable = (value.length == 0);
+                clientNoContextTakeover = YES;
+            } else if ([key isEqualToString: @"server_max_window_bits"]) {
+                // (zlib can't compress with an 8-bit window)
+                acceptable = parseWindowBits(value, &params.compressWindowBits)
+                                && params.compressWindowBits >= 9;
+                hasServerBits = YES;
+            } else if ([key isEqualToString: @"client_max_window_bits"]) {
+                acceptable = (value.length == 0 || parseWindowBits(value, &clientBits));
+                hasClientBits = YES;
+            } else {
+                acceptable = NO;
+            }
+            if (!acceptable)
+                break;
+        }
+        if (!acceptable)
+            continue;       // Try the next offer, if any
+
+        NSMutableString* response = [kPerMessageDeflate mutableCopy];
+        if (params.compressNoContextTakeover)
+            [response appendString: @"; server_no_context_takeover"];
+        if (clientNoContextTakeover)
+            [response appendString: @"; client_no_context_takeover"];
+        if (hasServerBits)
+            [response appendFormat: @"; server_max_window_bits=%d", params.compressWindowBits];
+        if (hasClientBits) {
+            // Client lets me limit its window size:
+            params.decompressWindowBits = MIN(clientBits, maxWindowBits);
+            if (params.decompressWindowBits < 15)
+                [response appendFormat: @"; client_max_window_bits=%d",
+                                        params.decompressWindowBits];
+        }
+        *outParams = params;
+        return response;
+    }
+    return nil;
+}
+
+
+
+
+#if DEBUG
+
+TestCase(WebSocketDeflater) {
+    NSMutableString* str = [NSMutableString string];
+    for (int i = 0; i < 1000; ++i)
+        [str appendFormat: @"{\"seq\":%d,\"id\":\"doc-%d\",\"rev\":\"1-abcdef\"}\n", i, i % 17];
+    NSData* input = [str dataUsingEncoding: NSUTF8StringEncoding];
+
+    // Compress in several pieces with sync flushes, then decompress in small pieces:
+    WebSocketDeflater* deflater = [[WebSocketDeflater alloc] initWithLevel: Z_DEFAULT_COMPRESSION
+                                                                windowBits: -15];
+    NSMutableData* compressed = [NSMutableData data];
+    const size_t kPiece = 5000;
+    for (size_t pos = 0; pos < input.length; pos += kPiece) {
+        size_t n = MIN(kPiece, input.length - pos);
+        CAssert([deflater deflateBytes: (const UInt8*)input.bytes + pos length: n
+                                toData: compressed flush: Z_SYNC_FLUSH]);
+    }
+    CAssert(compressed.length < input.length / 3);
+
+    WebSocketInflater* inflater = [[WebSocketInflater alloc] initWithWindowBits: -15];
+    NSMutableData* output = [NSMutableData data];
+    for (size_t pos = 0; pos < compressed.length; pos += 100) {
+        size_t n = MIN((size_t)100, compressed.length - pos);
+        CAssert([inflater inflateBytes: (const UInt8*)compressed.bytes + pos length: n
+                                toData: output maxLength: 0]);
+    }
+    CAssertEqual(output, input);
+
+    // Exceeding maxLength:
+    inflater = [[WebSocketInflater alloc] initWithWindowBits: -15];
+    output = [NSMutableData data];
+    CAssert(![inflater inflateBytes: compressed.bytes length: compressed.length
+                             toData: output maxLength: 1000]);
+}
+
+
+TestCase(WebSocketInflaterMessages) {
+    // A sender may end a message with a final (BFINAL) block, or with a sync flush whose
+    // trailer it strips; the inflater has to handle a mix of both:
+    NSData* input = [@"Hello hello hello hello, permessage-deflate!"
+                                dataUsingEncoding: NSUTF8StringEncoding];
+    WebSocketInflater* inflater = [[WebSocketInflater alloc] initWithWindowBits: -15];
+    for (int i = 0; i < 4; i++) {
+        BOOL final = (i % 2 == 0);
+        WebSocketDeflater* deflater = [[WebSocketDeflater alloc] initWithLevel: Z_DEFAULT_COMPRESSION
+                                                                    windowBits: -15];
+        NSMutableData* compressed = [NSMutableData data];
+        CAssert([deflater deflateBytes: input.bytes length: input.length
+                                toData: compressed flush: (final ? Z_FINISH : Z_SYNC_FLUSH)]);
+        if (!final)
+            compressed.length -= 4;     // strip 00 00 FF FF
+        NSMutableData* output = [NSMutableData data];
+        CAssert([inflater inflateBytes: compressed.bytes length: compressed.length
+                                toData: output maxLength: 0]);
+        CAssertEq(inflater.finished, final);
+        CAssert([inflater finishMessageToData: output maxLength: 0]);
+        CAssert(!inflater.finished);
+        CAssertEqual(output, input);
+    }
+}
+
+
+TestCase(WebSocketDeflateNegotiation) {
+    WebSocketDeflateParams params;
+    BOOL accepted;
+
+    // Default offer, accepted as-is:
+    NSString* offer = WebSocketDeflateOffer(15, YES);
+    CAssertEqual(offer, @"permessage-deflate; client_max_window_bits");
+    NSString* response = WebSocketDeflateAcceptOffer(offer, 15, YES, &params);
+    CAssertEqual(response, @"permessage-deflate");
+    CAssertEq(params.compressWindowBits, 15);
+    CAssertEq(params.compressNoContextTakeover, NO);
+    CAssertEq(params.decompressWindowBits, 15);
+    CAssert(WebSocketDeflateParseResponse(response, &params, &accepted));
+    CAssert(accepted);
+    CAssertEq(params.compressWindowBits, 15);
+
+    // Restricted window and no context takeover:
+    offer = WebSocketDeflateOffer(10, NO);
+    response = WebSocketDeflateAcceptOffer(offer, 12, YES, &params);
+    CAssertEqual(response, @"permessage-deflate; server_no_context_takeover; "
+                            "client_no_context_takeover; server_max_window_bits=10; "
+                            "client_max_window_bits=12");
+    CAssertEq(params.compressWindowBits, 10);
+    CAssertEq(params.compressNoContextTakeover, YES);
+    CAssertEq(params.decompressWindowBits, 12);
+    CAssert(WebSocketDeflateParseResponse(response, &params, &accepted));
+    CAssert(accepted);
+    CAssertEq(params.compressWindowBits, 12);
+    CAssertEq(params.compressNoContextTakeover, YES);
+    CAssertEq(params.decompressWindowBits, 10);
+
+    // Server skips unacceptable offers:
+    response = WebSocketDeflateAcceptOffer(@"x-webkit-deflate-frame, permessage-deflate; "
+                                            "server_max_window_bits=8, permessage-deflate; "
+                                            "client_max_window_bits=\"11\"", 15, YES, &params);
+    CAssertEqual(response, @"permessage-deflate; client_max_window_bits=11");
+    CAssertNil(WebSocketDeflateAcceptOffer(@"permessage-deflate; foo", 15, YES, &params));
+    CAssert(WebSocketDeflateAcceptOffer(nil, 15, YES, &params) == nil);
+
+    // Client rejects bad responses:
+    CAssert(WebSocketDeflateParseResponse(nil, &params, &accepted));
+    CAssert(!accepted);
+    CAssert(!WebSocketDeflateParseResponse(@"x-foo", &params, &accepted));
+    CAssert(!WebSocketDeflateParseResponse(@"permessage-deflate; client_max_window_bits=99",
+                                           &params, &accepted));
+    CAssert(!WebSocketDeflateParseResponse(@"permessage-deflate, permessage-deflate",
+                                           &params, &accepted));
+}
+
+#endif
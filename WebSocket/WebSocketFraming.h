@@ -0,0 +1,110 @@
+//
+//  WebSocketFraming.h
+//  WebSocket
+//
+//  Copyright (c) 2015 Couchbase, Inc. All rights reserved.
+
+#import "WebSocket.h"
+@protocol WebSocketFrameParserDelegate;
+
+
+/** Copies bytes from src to dst, XORing them with the 4-byte WebSocket masking key.
+    This is done in one pass, 16 or 32 bytes at a time. dst may be equal to src, but the buffers
+    mustn't otherwise overlap. */
+void WebSocketCopyAndMaskBytes(void* dst, const void* src, size_t length, const UInt8 mask[4]);
+
+/** XORs the bytes in place with the 4-byte WebSocket masking key. */
+static inline void WebSocketMaskBytes(void* bytes, size_t length, const UInt8 mask[4]) {
+    WebSocketCopyAndMaskBytes(bytes, bytes, length, mask);
+}
+
+
+/** Implements incremental decoding of RFC 6455 WebSocket frames, without doing any I/O.
+    Input is appended to the parser's buffer (either by -parseData: or by reading directly into
+    -buffer), and -parse then decodes as many complete frames as the buffer holds. A frame may be
+    split across any number of reads. Frames larger than 64KB aren't buffered; instead their
+    payloads are delivered to the delegate in chunks as they arrive. */
+@interface WebSocketFrameParser : NSObject
+
+- (instancetype) initWithDelegate: (id<WebSocketFrameParserDelegate>)delegate;
+
+@property (weak) id<WebSocketFrameParserDelegate> delegate;
+
+/** The buffer that unparsed input accumulates in. The caller may append bytes to it directly
+    (e.g. by having a GCDAsyncSocket read into it) and then call -parse.
+    Don't modify it in any other way. */
+@property (readonly) NSMutableData* buffer;
+
+/** Appends the data to the buffer, then calls -parse. */
+- (BOOL) parseData: (NSData*)data;
+
+/** Decodes as many complete frames as are in the buffer, calling the delegate for each one.
+    Incomplete data at the end of the buffer is kept for next time.
+    @return  NO if the delegate asked to stop, or if the input is invalid; else YES. */
+- (BOOL) parse;
+
+/** Maximum allowed payload length of a frame; the parser fails with kWebSocketCloseMessageTooBig
+    if a frame header announces a larger one. Defaults to 0, meaning no limit. */
+@property UInt64 maxFrameSize;
+
+/** If YES, the RSV1 bit may be set on text and binary frames, indicating a compressed message
+    (RFC 7692); otherwise it's a protocol error. Defaults to NO. */
+@property BOOL allowCompressedFrames;
+
+/** During a call to the delegate, YES if the frame being delivered has the RSV1 bit set. */
+@property (readonly) BOOL frameCompressed;
+
+/** YES if the parser encountered invalid input. It won't parse anything after that. */
+@property (readonly) BOOL failed;
+
+@end
+
+
+/** A thread-safe pool of reusable buffers for building outgoing frames in.
+    Buffer lengths are powers of two, from 4KB to 1MB; larger ones are allocated as needed and
+    not kept. */
+@interface WebSocketBufferPool : NSObject
+
+/** @param maxBuffers  The maximum number of idle buffers of each size to keep. */
+- (instancetype) initWithMaxBuffersPerSize: (NSUInteger)maxBuffers;
+
+/** Returns a buffer at least `length` bytes long, either from the pool or newly allocated.
+    Don't change its length. */
+- (NSMutableData*) bufferWithLength: (NSUInteger)length;
+
+/** Returns a buffer to the pool. Don't use it afterwards. */
+- (void) recycleBuffer: (NSMutableData*)buffer;
+
+/** Returns an immutable NSData that points to a range of the buffer without copying it. The buffer
+    is recycled when the NSData is deallocated, so don't use the buffer yourself after this. */
+- (NSData*) dataWithBuffer: (NSMutableData*)buffer range: (NSRange)range;
+
+@end
+
+
+@protocol WebSocketFrameParserDelegate <NSObject>
+
+/** Called when a frame has been parsed. The payload has already been unmasked.
+    If this returns NO, the parser stops; any remaining input stays in the buffer until the
+    next call to -parse. */
+- (BOOL) frameParser: (WebSocketFrameParser*)parser
+        didReadFrame: (NSData*)payload
+              opcode: (UInt8)opcode
+               final: (BOOL)final;
+
+/** Called instead of -frameParser:didReadFrame:... for a frame larger than 64KB, each time another
+    piece of its payload arrives. The chunks have already been unmasked. lastChunk is YES on the
+    call that delivers the end of the frame. Return value is the same as for
+    -frameParser:didReadFrame:... */
+- (BOOL) frameParser: (WebSocketFrameParser*)parser
+   didReadFrameChunk: (NSData*)chunk
+              opcode: (UInt8)opcode
+               final: (BOOL)final
+           lastChunk: (BOOL)lastChunk;
+
+/** Called if the input isn't valid WebSocket framing. */
+- (void) frameParser: (WebSocketFrameParser*)parser
+     didFailWithCode: (WebSocketCloseCode)code
+              reason: (NSString*)reason;
+
+@end
@@ -0,0 +1,577 @@
+//
+//  WebSocketFraming.m
+//  WebSocket
+//
+//  Copyright (c) 2015 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "WebSocketFraming.h"
+#import "DDData.h"
+#import "Test.h"
+
+
+// Payloads at least this large are handed to the delegate as slices of the read buffer instead
+// of being copied. (Smaller ones are copied so they don't keep a whole read buffer alive.)
+#define kMinSliceSize 1024
+
+#define kDefaultBufferSize 4096
+
+// Frames with payloads larger than this are delivered in chunks instead of being buffered.
+#define kMaxBufferedFrameSize (64*1024)
+
+// Minimum size of a chunk of a large frame (except for the final one.)
+#define kMinChunkSize 4096
+
+
+// 0                   1                   2                   3
+// 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+// +-+-+-+-+-------+-+-------------+-------------------------------+
+// |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+// |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
+// |N|V|V|V|       |S|             |   (if payload len==126/127)   |
+// | |1|2|3|       |K|             |                               |
+// +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
+// |     Extended payload length continued, if payload len == 127  |
+// + - - - - - - - - - - - - - - - +-------------------------------+
+// |                               |Masking-key, if MASK set to 1  |
+// +-------------------------------+-------------------------------+
+// | Masking-key (continued)       |          Payload Data         |
+// +-------------------------------- - - - - - - - - - - - - - - - +
+// :                     Payload Data continued ...                :
+// + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
+// |                     Payload Data continued ...                |
+// +---------------------------------------------------------------+
+
+
+#if defined(__clang__) || defined(__GNUC__)
+// Unaligned vector types; the compiler maps these onto SSE/AVX or NEON registers as available.
+typedef UInt8 WSVec16 __attribute__((vector_size(16), aligned(1)));
+typedef UInt8 WSVec32 __attribute__((vector_size(32), aligned(1)));
+#define WS_VECTOR_MASKING 1
+#endif
+
+void WebSocketCopyAndMaskBytes(void* dst, const void* src, size_t length, const UInt8 mask[4]) {
+    UInt8* d = dst;
+    const UInt8* s = src;
+    size_t i = 0;
+#if WS_VECTOR_MASKING
+    // Since the vector sizes are multiples of 4, the mask stays in phase with the data:
+    if (length >= 16) {
+        UInt8 pattern[32];
+        for (int j = 0; j < 32; j += 4)
+            memcpy(&pattern[j], mask, 4);
+        WSVec32 mask32;
+        memcpy(&mask32, pattern, sizeof(mask32));
+        for (; i + 32 <= length; i += 32) {
+            WSVec32 v;
+            memcpy(&v, s + i, sizeof(v));
+            v ^= mask32;
+            memcpy(d + i, &v, sizeof(v));
+        }
+        if (i + 16 <= length) {
+            WSVec16 mask16, v;
+            memcpy(&mask16, pattern, sizeof(mask16));
+            memcpy(&v, s + i, sizeof(v));
+            v ^= mask16;
+            memcpy(d + i, &v, sizeof(v));
+            i += 16;
+        }
+    }
+#endif
+    for (; i < length; ++i)
+        d[i] = s[i] ^ mask[i & 3];
+}
+
+
+static inline BOOL isValidFrameHeader(UInt8 frame, BOOL allowRSV1) {
+	NSUInteger rsv =  frame & 0x70;
+	NSUInteger opcode = frame & 0x0F;
+    if (rsv == 0x40 && allowRSV1)
+        rsv = 0;    // RSV1 ('compressed') is allowed on the first frame of a data message
+	return ! ((rsv || (3 <= opcode && opcode <= 7) || (0xB <= opcode && opcode <= 0xF)));
+}
+
+
+@implementation WebSocketFrameParser
+{
+    NSMutableData* _buffer;
+    size_t _pos;                // Offset in _buffer of the first unparsed byte
+    BOOL _bufferShared;         // YES if payload slices point into _buffer
+    BOOL _parsing;
+
+    // State of a large frame whose payload is being delivered in chunks:
+    BOOL _streaming;
+    UInt8 _streamOpcode;
+    BOOL _streamFinal, _streamMasked, _streamCompressed;
+    UInt8 _streamMask[4];
+    UInt64 _streamOffset, _streamRemaining;
+}
+
+@synthesize delegate=_delegate, buffer=_buffer, failed=_failed, maxFrameSize=_maxFrameSize,
+            allowCompressedFrames=_allowCompressedFrames, frameCompressed=_frameCompressed;
+
+
+- (instancetype) initWithDelegate: (id<WebSocketFrameParserDelegate>)delegate {
+    self = [super init];
+    if (self) {
+        _delegate = delegate;
+        _buffer = [[NSMutableData alloc] initWithCapacity: kDefaultBufferSize];
+    }
+    return self;
+}
+
+
+- (BOOL) parseData: (NSData*)data {
+    [_buffer appendData: data];
+    return [self parse];
+}
+
+
+- (BOOL) parse {
+    if (_failed)
+        return NO;
+    if (_parsing)
+        return YES;     // re-entrant call from the delegate; the outer call will continue
+    _parsing = YES;
+    BOOL result = YES;
+    while (result) {
+        UInt8* start = (UInt8*)_buffer.mutableBytes + _pos;
+        size_t available = _buffer.length - _pos;
+
+        if (_streaming) {
+            // In the middle of a large frame; deliver the part of its payload that's arrived:
+            size_t length = (size_t)MIN((UInt64)available, _streamRemaining);
+            if (length < MIN(_streamRemaining, (UInt64)kMinChunkSize))
+                break;
+            result = [self readChunk: start length: length];
+            continue;
+        }
+
+        // Decode the header, if it's all there:
+        if (available < 2)
+            break;
+        UInt8 frame = start[0];
+        UInt8 opcode = frame & 0x0F;
+        BOOL compressed = (frame & 0x40) != 0;
+        if (!isValidFrameHeader(frame, _allowCompressedFrames && (opcode == 1 || opcode == 2))) {
+            result = [self failWithCode: kWebSocketCloseProtocolError
+                                 reason: @"Invalid incoming frame"];
+            break;
+        }
+        BOOL final = (frame & 0x80) != 0;
+        BOOL masked = (start[1] & 0x80) != 0;
+        UInt64 length = start[1] & 0x7F;
+        size_t headerLen = 2;
+        if (length == 126) {
+            headerLen += 2;
+            if (available < headerLen)
+                break;
+            length = ((UInt64)start[2] << 8) | start[3];
+        } else if (length == 127) {
+            headerLen += 8;
+            if (available < headerLen)
+                break;
+            length = 0;
+            for (int i = 2; i < 10; ++i)
+                length = (length << 8) | start[i];
+            if (length >> 63) {
+                result = [self failWithCode: kWebSocketCloseProtocolError
+                                     reason: @"Invalid frame length"];
+                break;
+            }
+        }
+        if (opcode >= 8 && (length > 125 || !final)) {
+            result = [self failWithCode: kWebSocketCloseProtocolError
+                                 reason: @"Invalid control frame"];
+            break;
+        }
+        if (_maxFrameSize > 0 && length > _maxFrameSize) {
+            result = [self failWithCode: kWebSocketCloseMessageTooBig
+                                 reason: @"Message too big"];
+            break;
+        }
+        const UInt8* mask = NULL;
+        if (masked) {
+            mask = start + headerLen;
+            headerLen += 4;
+        }
+
+        if (length > kMaxBufferedFrameSize) {
+            // Too big to buffer; switch to delivering the payload in chunks as it arrives:
+            if (available < headerLen)
+                break;
+            _streaming = YES;
+            _streamOpcode = opcode;
+            _streamFinal = final;
+            _streamCompressed = compressed;
+            _streamMasked = masked;
+            if (masked)
+                memcpy(_streamMask, mask, 4);
+            _streamOffset = 0;
+            _streamRemaining = length;
+            _pos += headerLen;
+            continue;
+        }
+
+        // Wait till the entire payload has arrived:
+        if (available < headerLen + length)
+            break;
+        UInt8* payload = start + headerLen;
+        if (masked)
+            WebSocketMaskBytes(payload, (size_t)length, mask);
+        NSData* payloadData = [self dataWithPayload: payload length: (size_t)length];
+        _pos += headerLen + length;
+
+        _frameCompressed = compressed;
+        result = [_delegate frameParser: self didReadFrame: payloadData
+                                 opcode: opcode final: final];
+    }
+
+    // Discard the consumed bytes, keeping any partial frame for next time. If slices of the
+    // buffer have been handed out, it can't be modified anymore, so switch to a new one:
+    if (_bufferShared) {
+        size_t remaining = _buffer.length - _pos;
+        NSMutableData* newBuffer = [[NSMutableData alloc] initWithCapacity:
+                                                            MAX(remaining, kDefaultBufferSize)];
+        [newBuffer appendBytes: (const UInt8*)_buffer.bytes + _pos length: remaining];
+        _buffer = newBuffer;
+        _bufferShared = NO;
+        _pos = 0;
+    } else if (_pos > 0) {
+        [_buffer replaceBytesInRange: NSMakeRange(0, _pos) withBytes: NULL length: 0];
+        _pos = 0;
+    }
+    _parsing = NO;
+    return result;
+}
+
+
+// Delivers the next chunk of a large frame's payload.
+- (BOOL) readChunk: (UInt8*)bytes length: (size_t)length {
+    if (_streamMasked) {
+        // Rotate the mask to line up with this chunk's offset in the payload:
+        UInt8 mask[4];
+        for (int i = 0; i < 4; ++i)
+            mask[i] = _streamMask[(_streamOffset + i) & 3];
+        WebSocketMaskBytes(bytes, length, mask);
+    }
+    NSData* chunk = [self dataWithPayload: bytes length: length];
+    _pos += length;
+    _streamOffset += length;
+    _streamRemaining -= length;
+    BOOL lastChunk = (_streamRemaining == 0);
+    if (lastChunk)
+        _streaming = NO;
+    _frameCompressed = _streamCompressed;
+    return [_delegate frameParser: self didReadFrameChunk: chunk
+                           opcode: _streamOpcode final: _streamFinal lastChunk: lastChunk];
+}
+
+
+// Returns payload bytes in the buffer as an NSData, either copied or as a slice of the buffer.
+- (NSData*) dataWithPayload: (UInt8*)payload length: (size_t)length {
+    if (length >= kMinSliceSize) {
+        NSRange range = NSMakeRange(payload - (UInt8*)_buffer.mutableBytes, length);
+        _bufferShared = YES;
+        return [_buffer subdataNoCopyWithRange: range];
+    } else if (length > 0) {
+        return [NSData dataWithBytes: payload length: length];
+    } else {
+        return [NSData data];
+    }
+}
+
+
+- (BOOL) failWithCode: (WebSocketCloseCode)code reason: (NSString*)reason {
+    _failed = YES;
+    _buffer = [[NSMutableData alloc] init];
+    _pos = 0;
+    _bufferShared = NO;
+    _streaming = NO;
+    [_delegate frameParser: self didFailWithCode: code reason: reason];
+    return NO;
+}
+
+
+@end
+
+
+
+
+// Pooled buffer sizes are 2^kMinPooledBufferBits ... 2^kMaxPooledBufferBits bytes
+#define kMinPooledBufferBits 12
+#define kMaxPooledBufferBits 20
+#define kNumPooledBufferSizes (kMaxPooledBufferBits - kMinPooledBufferBits + 1)
+
+@implementation WebSocketBufferPool
+{
+    NSMutableArray* _buffers[kNumPooledBufferSizes];    // Idle buffers of each size
+    NSUInteger _maxBuffers;
+}
+
+
+- (instancetype) initWithMaxBuffersPerSize: (NSUInteger)maxBuffers {
+    self = [super init];
+    if (self) {
+        _maxBuffers = maxBuffers;
+        for (int i = 0; i < kNumPooledBufferSizes; i++)
+            _buffers[i] = [[NSMutableArray alloc] initWithCapacity: maxBuffers];
+    }
+    return self;
+}
+
+
+// Returns the index in _buffers of the smallest size that holds `length` bytes, or -1 if none.
+static int sizeClassForLength(NSUInteger length) {
+    int bits = kMinPooledBufferBits;
+    while (bits <= kMaxPooledBufferBits && ((NSUInteger)1 << bits) < length)
+        ++bits;
+    return bits <= kMaxPooledBufferBits ? bits - kMinPooledBufferBits : -1;
+}
+
+
+- (NSMutableData*) bufferWithLength: (NSUInteger)length {
+    int sizeClass = sizeClassForLength(length);
+    if (sizeClass < 0)
+        return [NSMutableData dataWithLength: length];
+    @synchronized(self) {
+        NSMutableArray* buffers = _buffers[sizeClass];
+        NSMutableData* buffer = buffers.lastObject;
+        if (buffer) {
+            [buffers removeLastObject];
+            return buffer;
+        }
+    }
+    return [NSMutableData dataWithLength: (NSUInteger)1 << (sizeClass + kMinPooledBufferBits)];
+}
+
+
+- (void) recycleBuffer: (NSMutableData*)buffer {
+    NSUInteger length = buffer.length;
+    int sizeClass = sizeClassForLength(length);
+    if (sizeClass < 0 || length != (NSUInteger)1 << (sizeClass + kMinPooledBufferBits))
+        return;     // Not one of mine
+    @synchronized(self) {
+        NSMutableArray* buffers = _buffers[sizeClass];
+        if (buffers.count < _maxBuffers)
+            [buffers addObject: buffer];
+    }
+}
+
+
+- (NSData*) dataWithBuffer: (NSMutableData*)buffer range: (NSRange)range {
+    Assert(NSMaxRange(range) <= buffer.length);
+    return [[NSData alloc] initWithBytesNoCopy: (UInt8*)buffer.mutableBytes + range.location
+                                        length: range.length
+                                   deallocator: ^(void *bytes, NSUInteger length) {
+                                       [self recycleBuffer: buffer];
+                                   }];
+}
+
+
+@end
+
+
+
+
+#if DEBUG
+
+@interface WebSocketFrameParserTester : NSObject <WebSocketFrameParserDelegate>
+@property NSMutableArray* frames;
+@property NSMutableData* partialFrame;
+@property NSUInteger chunkCount;
+@end
+
+@implementation WebSocketFrameParserTester
+@synthesize frames=_frames, partialFrame=_partialFrame, chunkCount=_chunkCount;
+- (BOOL) frameParser: (WebSocketFrameParser*)parser didReadFrame: (NSData*)payload
+              opcode: (UInt8)opcode final: (BOOL)final
+{
+    [_frames addObject: @[payload, @(opcode), @(final)]];
+    return YES;
+}
+- (BOOL) frameParser: (WebSocketFrameParser*)parser didReadFrameChunk: (NSData*)chunk
+              opcode: (UInt8)opcode final: (BOOL)final lastChunk: (BOOL)lastChunk
+{
+    if (!_partialFrame)
+        _partialFrame = [NSMutableData data];
+    [_partialFrame appendData: chunk];
+    ++_chunkCount;
+    if (lastChunk) {
+        [_frames addObject: @[_partialFrame, @(opcode), @(final)]];
+        _partialFrame = nil;
+    }
+    return YES;
+}
+- (void) frameParser: (WebSocketFrameParser*)parser didFailWithCode: (WebSocketCloseCode)code
+              reason: (NSString*)reason
+{
+    [_frames addObject: @(code)];
+}
+@end
+
+
+static void appendTestFrame(NSMutableData* stream, UInt8 opcode, NSData* payload, BOOL masked) {
+    UInt8 header[14] = {0x80 | opcode};
+    size_t headerLen = 2;
+    if (payload.length <= 125) {
+        header[1] = (UInt8)payload.length;
+    } else if (payload.length <= 0xFFFF) {
+        header[1] = 126;
+        header[2] = (UInt8)(payload.length >> 8);
+        header[3] = (UInt8)payload.length;
+        headerLen = 4;
+    } else {
+        header[1] = 127;
+        for (int i = 0; i < 8; ++i)
+            header[2 + i] = (UInt8)((UInt64)payload.length >> (8 * (7 - i)));
+        headerLen = 10;
+    }
+    const UInt8 mask[4] = {0x12, 0x34, 0x56, 0x78};
+    if (masked) {
+        header[1] |= 0x80;
+        memcpy(&header[headerLen], mask, 4);
+        headerLen += 4;
+    }
+    [stream appendBytes: header length: headerLen];
+    NSMutableData* body = [payload mutableCopy];
+    if (masked)
+        WebSocketMaskBytes(body.mutableBytes, body.length, mask);
+    [stream appendData: body];
+}
+
+
+TestCase(WebSocketFrameParser) {
+    // (The big payload is large enough to be delivered as a slice of the read buffer.)
+    NSMutableData* big = [NSMutableData dataWithLength: 3000];
+    for (NSUInteger i = 0; i < big.length; ++i)
+        ((UInt8*)big.mutableBytes)[i] = (UInt8)i;
+    NSArray* payloads = @[[@"hello" dataUsingEncoding: NSUTF8StringEncoding],
+                          [NSData data],
+                          big,
+                          [@"bye" dataUsingEncoding: NSUTF8StringEncoding]];
+    NSMutableData* stream = [NSMutableData data];
+    NSMutableArray* expected = [NSMutableArray array];
+    BOOL masked = NO;
+    for (NSData* payload in payloads) {
+        appendTestFrame(stream, 2, payload, masked);
+        [expected addObject: @[payload, @2, @YES]];
+        masked = !masked;
+    }
+
+    // Split the stream at every possible position:
+    for (NSUInteger split = 0; split <= stream.length; ++split) {
+        WebSocketFrameParserTester* tester = [[WebSocketFrameParserTester alloc] init];
+        tester.frames = [NSMutableArray array];
+        WebSocketFrameParser* parser = [[WebSocketFrameParser alloc] initWithDelegate: tester];
+        CAssert([parser parseData: [stream subdataWithRange: NSMakeRange(0, split)]]);
+        CAssert([parser parseData: [stream subdataWithRange: NSMakeRange(split,
+                                                                  stream.length - split)]]);
+        CAssertEqual(tester.frames, expected);
+        CAssertEq(parser.buffer.length, 0);
+    }
+
+    // Feed the stream one byte at a time:
+    WebSocketFrameParserTester* tester = [[WebSocketFrameParserTester alloc] init];
+    tester.frames = [NSMutableArray array];
+    WebSocketFrameParser* parser = [[WebSocketFrameParser alloc] initWithDelegate: tester];
+    for (NSUInteger i = 0; i < stream.length; ++i)
+        CAssert([parser parseData: [stream subdataWithRange: NSMakeRange(i, 1)]]);
+    CAssertEqual(tester.frames, expected);
+
+    // Invalid input:
+    tester.frames = [NSMutableArray array];
+    parser = [[WebSocketFrameParser alloc] initWithDelegate: tester];
+    CAssert(![parser parseData: [NSData dataWithBytes: "\x83\x00" length: 2]]);
+    CAssert(parser.failed);
+    CAssertEqual(tester.frames, @[@(kWebSocketCloseProtocolError)]);
+}
+
+
+TestCase(WebSocketFrameParserLargeFrames) {
+    // A frame bigger than 64KB (with a 64-bit length) is delivered in chunks:
+    NSMutableData* big = [NSMutableData dataWithLength: 200000];
+    for (NSUInteger i = 0; i < big.length; ++i)
+        ((UInt8*)big.mutableBytes)[i] = (UInt8)(i * 13);
+    NSData* small = [@"after" dataUsingEncoding: NSUTF8StringEncoding];
+    NSArray* expected = @[@[big, @2, @YES], @[small, @2, @YES]];
+    for (int masked = 0; masked <= 1; ++masked) {
+        NSMutableData* stream = [NSMutableData data];
+        appendTestFrame(stream, 2, big, masked);
+        appendTestFrame(stream, 2, small, masked);
+        for (NSUInteger readSize = 3; readSize < stream.length; readSize *= 5) {
+            WebSocketFrameParserTester* tester = [[WebSocketFrameParserTester alloc] init];
+            tester.frames = [NSMutableArray array];
+            WebSocketFrameParser* parser = [[WebSocketFrameParser alloc] initWithDelegate: tester];
+            for (NSUInteger pos = 0; pos < stream.length; pos += readSize) {
+                NSRange r = NSMakeRange(pos, MIN(readSize, stream.length - pos));
+                CAssert([parser parseData: [stream subdataWithRange: r]]);
+            }
+            CAssertEqual(tester.frames, expected);
+            CAssert(tester.chunkCount > 1);
+            CAssert(parser.buffer.length < 64*1024);
+        }
+    }
+
+    // Exceeding maxFrameSize:
+    WebSocketFrameParserTester* tester = [[WebSocketFrameParserTester alloc] init];
+    tester.frames = [NSMutableArray array];
+    WebSocketFrameParser* parser = [[WebSocketFrameParser alloc] initWithDelegate: tester];
+    parser.maxFrameSize = 100000;
+    NSMutableData* stream = [NSMutableData data];
+    appendTestFrame(stream, 2, big, NO);
+    CAssert(![parser parseData: [stream subdataWithRange: NSMakeRange(0, 100)]]);
+    CAssertEqual(tester.frames, @[@(kWebSocketCloseMessageTooBig)]);
+}
+
+
+TestCase(WebSocketBufferPool) {
+    WebSocketBufferPool* pool = [[WebSocketBufferPool alloc] initWithMaxBuffersPerSize: 2];
+    NSMutableData* buffer = [pool bufferWithLength: 5000];
+    CAssertEq(buffer.length, 8192u);
+    const void* bytes = buffer.bytes;
+    @autoreleasepool {
+        NSData* data = [pool dataWithBuffer: buffer range: NSMakeRange(10, 100)];
+        CAssertEq(data.bytes, (const void*)((const UInt8*)bytes + 10));
+        buffer = nil;
+        data = nil;
+    }
+    // The buffer was recycled when the data was released:
+    buffer = [pool bufferWithLength: 8000];
+    CAssertEq((const void*)buffer.bytes, bytes);
+    CAssertEq([pool bufferWithLength: 8000].length, 8192u);
+    CAssertEq([pool bufferWithLength: 2*1024*1024].length, 2*1024*1024u);
+}
+
+
+TestCase(WebSocketCopyAndMaskBytes) {
+    const UInt8 mask[4] = {0xA1, 0xB2, 0xC3, 0xD4};
+    UInt8 src[200], dst[200];
+    for (size_t i = 0; i < sizeof(src); ++i)
+        src[i] = (UInt8)(i * 7);
+    // Try every length at a few (mis)alignments, comparing with a plain scalar loop:
+    for (size_t offset = 0; offset < 4; ++offset) {
+        for (size_t length = 0; length + offset <= sizeof(src); ++length) {
+            memset(dst, 0, sizeof(dst));
+            WebSocketCopyAndMaskBytes(dst + offset, src + offset, length, mask);
+            for (size_t i = 0; i < length; ++i)
+                CAssertEq(dst[offset + i], (UInt8)(src[offset + i] ^ mask[i % 4]));
+            if (offset + length < sizeof(dst))
+                CAssertEq(dst[offset + length], 0);
+        }
+    }
+    // In place:
+    memcpy(dst, src, sizeof(src));
+    WebSocketMaskBytes(dst, sizeof(dst), mask);
+    WebSocketMaskBytes(dst, sizeof(dst), mask);
+    CAssert(memcmp(dst, src, sizeof(src)) == 0);
+}
+
+#endif
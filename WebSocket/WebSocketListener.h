@@ -6,6 +6,7 @@
 //  Copyright (c) 2013 Couchbase. All rights reserved.
 
 #import "WebSocket.h"
+@class WebSocketIncoming;
 
 
 /** A listener/server for incoming WebSocket connections.
@@ -21,7 +22,22 @@
 /** The URI path the listener is accepting requests on. */
 @property (readonly) NSString* path;
 
+/** The subprotocols the listener supports, in order of preference. If a client offers any of
+    them, the first one here that it offered is accepted (see WebSocket.protocol.) */
+@property (copy) NSArray* protocols;
+
+/** The maximum number of connections to have open at once, or 0 (the default) for no limit.
+    When the limit is reached, further clients still get an HTTP response, but it's a 503 status
+    instead of a WebSocket upgrade. */
+@property NSUInteger maxConnections;
+
+/** The number of currently open (or handshaking) connections. Closed connections are released as
+    soon as their sockets disconnect. */
+@property (readonly) NSUInteger connectionCount;
+
 /** Starts the listener.
+    This may be called more than once, to listen on several interfaces or ports at once. Each
+    listening socket accepts connections on its own dispatch queue.
     @param interface  The name of the network interface, or nil to listen on all interfaces
         (See the GCDAsyncSocket documentation for more details.)
     @param port  The TCP port to listen on.
@@ -34,6 +50,11 @@
 /** Stops the listener from accepting any more connections. */
 - (void) disconnect;
 
+/** Called when an incoming connection's socket has disconnected, just before the listener
+    releases it. Subclasses can override this to clean up after the connection; the default
+    implementation does nothing. Called on the connection's websocketQueue. */
+- (void) connectionDidClose: (WebSocketIncoming*)connection;
+
 @end
 
 
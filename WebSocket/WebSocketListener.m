@@ -23,6 +23,8 @@
 
 
 @interface WebSocketListener () <GCDAsyncSocketDelegate>
+- (BOOL) isRefusing: (WebSocketIncoming*)ws;
+- (void) incomingDidDisconnect: (WebSocketIncoming*)ws;
 @end
 
 
@@ -30,13 +32,16 @@
 {
     NSString* _path;
     NSString* _desc;
-    GCDAsyncSocket* _listenerSocket;
+    NSMutableArray* _listenerSockets;       // One GCDAsyncSocket per interface/port listened on
     __weak id<WebSocketDelegate> _delegate;
-    NSMutableSet* _connections;
+    NSMutableSet* _connections;             // Connections counted against maxConnections
+    NSMutableSet* _rejectedConnections;     // Connections being sent a 503 response
+    NSUInteger _maxConnections;
+    NSArray* _protocols;
 }
 
 
-@synthesize path=_path;
+@synthesize path=_path, protocols=_protocols;
 
 
 - (instancetype) initWithPath: (NSString*)path delegate: (id<WebSocketDelegate>)delegate {
@@ -45,10 +50,9 @@
         _path = path;
         _delegate = delegate;
         _desc = path;
-        dispatch_queue_t delegateQueue = dispatch_queue_create("WebSocketListener", 0);
-        _listenerSocket = [[GCDAsyncSocket alloc] initWithDelegate: self
-                                                     delegateQueue: delegateQueue];
+        _listenerSockets = [[NSMutableArray alloc] init];
         _connections = [[NSMutableSet alloc] init];
+        _rejectedConnections = [[NSMutableSet alloc] init];
     }
     return self;
 }
@@ -59,30 +63,95 @@
 }
 
 
+- (NSUInteger) maxConnections {
+    @synchronized(self) {
+        return _maxConnections;
+    }
+}
+
+- (void) setMaxConnections: (NSUInteger)maxConnections {
+    @synchronized(self) {
+        _maxConnections = maxConnections;
+    }
+}
+
+- (NSUInteger) connectionCount {
+    @synchronized(self) {
+        return _connections.count;
+    }
+}
+
 
 - (BOOL) acceptOnInterface: (NSString*)interface
                       port: (UInt16)port
                      error: (NSError**)outError
 {
-    if (![_listenerSocket acceptOnInterface: interface port: port error: outError])
+    // Each listening socket gets its own accept queue, so they don't contend with each other:
+    dispatch_queue_t acceptQueue = dispatch_queue_create("WebSocketListener", 0);
+    GCDAsyncSocket* listenerSocket = [[GCDAsyncSocket alloc] initWithDelegate: self
+                                                                delegateQueue: acceptQueue];
+    if (![listenerSocket acceptOnInterface: interface port: port error: outError])
         return NO;
-    _desc = $sprintf(@"%@:%d%@", (interface ?: @""), port, _path);
+    @synchronized(self) {
+        if (_listenerSockets.count == 0)
+            _desc = $sprintf(@"%@:%d%@", (interface ?: @""), port, _path);
+        [_listenerSockets addObject: listenerSocket];
+    }
     LogTo(WS, @"%@ now listening on port %d", self, port);
     return YES;
 }
 
 
 - (void) disconnect {
-    [_listenerSocket disconnect];
+    NSArray* listenerSockets;
+    @synchronized(self) {
+        listenerSockets = [_listenerSockets copy];
+        [_listenerSockets removeAllObjects];
+    }
+    for (GCDAsyncSocket* listenerSocket in listenerSockets)
+        [listenerSocket disconnect];
 }
 
 
 - (void)socket:(GCDAsyncSocket *)sock didAcceptNewSocket:(GCDAsyncSocket *)newSocket {
-    WebSocketIncoming* ws = [[WebSocketIncoming alloc] initWithConnectedSocket: newSocket
-                                                                      delegate: _delegate];
-    ws.listener = self;
-    LogTo(WS, @"Opened incoming %@ with delegate %@", ws, ws.delegate);
-    [_connections addObject: ws];
+    // The new WebSocket starts reading its request right away; holding the lock till it's been
+    // filed keeps -isRefusing: from being asked about it too soon.
+    @synchronized(self) {
+        WebSocketIncoming* ws = [[WebSocketIncoming alloc] initWithConnectedSocket: newSocket
+                                                                          delegate: _delegate];
+        ws.listener = self;
+        if (_maxConnections > 0 && _connections.count >= _maxConnections) {
+            LogTo(WS, @"%@ is full (%lu connections); refusing %@",
+                  self, (unsigned long)_connections.count, ws);
+            [_rejectedConnections addObject: ws];
+        } else {
+            LogTo(WS, @"Opened incoming %@ with delegate %@", ws, _delegate);
+            [_connections addObject: ws];
+        }
+    }
+}
+
+
+// Called by a WebSocketIncoming when it gets its HTTP request. If YES, it should be answered with
+// a 503 instead of an upgrade, since the listener was full when it connected.
+- (BOOL) isRefusing: (WebSocketIncoming*)ws {
+    @synchronized(self) {
+        return [_rejectedConnections containsObject: ws];
+    }
+}
+
+
+// Called by a WebSocketIncoming, on its queue, when its socket disconnects.
+- (void) incomingDidDisconnect: (WebSocketIncoming*)ws {
+    [self connectionDidClose: ws];
+    @synchronized(self) {
+        [_connections removeObject: ws];
+        [_rejectedConnections removeObject: ws];
+    }
+}
+
+
+- (void) connectionDidClose: (WebSocketIncoming*)connection {
 }
 
 @end
@@ -122,6 +191,22 @@ static BOOL checkHeader(CFHTTPMessageRef msg, NSString* header, NSString* expect
 }
 
 
+// Picks the first of my supported subprotocols that the client offered, or nil.
+static NSString* chooseProtocol(NSString* offered, NSArray* supported) {
+    if (!offered || supported.count == 0)
+        return nil;
+    NSMutableSet* offeredSet = [NSMutableSet set];
+    NSCharacterSet* whitespace = [NSCharacterSet whitespaceCharacterSet];
+    for (NSString* item in [offered componentsSeparatedByString: @","])
+        [offeredSet addObject: [item stringByTrimmingCharactersInSet: whitespace]];
+    for (NSString* protocol in supported) {
+        if ([offeredSet containsObject: protocol])
+            return protocol;
+    }
+    return nil;
+}
+
+
 - (void) gotHTTPRequest: (CFHTTPMessageRef)httpRequest data: (NSData*)requestData {
     HTTPLogTrace();
     //NSLog(@"Got HTTP request:\n%@", [[NSString alloc] initWithData: requestData encoding:NSUTF8StringEncoding]);
@@ -141,7 +226,12 @@ static BOOL checkHeader(CFHTTPMessageRef msg, NSString* header, NSString* expect
     int status;
     NSString* statusText = @"";
     NSString* acceptStr;
-    if (![url.path isEqualToString: _listener.path]) {
+    NSString* extensionsStr = nil;
+    NSString* protocol = nil;
+    if ([_listener isRefusing: self]) {
+        status = 503;
+        statusText = @"Too many connections";
+    } else if (![url.path isEqualToString: _listener.path]) {
         status = 404;
         statusText = @"Not found";
     } else if (![method isEqualToString: @"GET"]) {
@@ -169,6 +259,18 @@ static BOOL checkHeader(CFHTTPMessageRef msg, NSString* header, NSString* expect
                 status = 101;
                 acceptStr = [nonceKey stringByAppendingString: @"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"];
                 acceptStr = [[[acceptStr dataUsingEncoding: NSASCIIStringEncoding] sha1Digest] base64Encoded];
+                protocol = chooseProtocol(getHeader(httpRequest, @"Sec-WebSocket-Protocol"),
+                                          _listener.protocols);
+                _protocol = protocol;
+                if (self.perMessageDeflate) {
+                    WebSocketDeflateParams deflateParams;
+                    extensionsStr = WebSocketDeflateAcceptOffer(
+                                            getHeader(httpRequest, @"Sec-WebSocket-Extensions"),
+                                            self.deflateWindowBits, self.deflateContextTakeover,
+                                            &deflateParams);
+                    if (extensionsStr)
+                        [self enableDeflate: deflateParams];
+                }
             }
         }
     }
@@ -184,6 +286,10 @@ static BOOL checkHeader(CFHTTPMessageRef msg, NSString* header, NSString* expect
                                  "Upgrade: websocket\r\n"
                                  "Sec-WebSocket-Accept: %@\r\n",
                                  acceptStr];
+        if (protocol)
+            [response appendFormat: @"Sec-WebSocket-Protocol: %@\r\n", protocol];
+        if (extensionsStr)
+            [response appendFormat: @"Sec-WebSocket-Extensions: %@\r\n", extensionsStr];
     }
     [response appendString: @"\r\n"];
     [_asyncSocket writeData: [response dataUsingEncoding: NSUTF8StringEncoding]
@@ -232,6 +338,13 @@ static BOOL checkHeader(CFHTTPMessageRef msg, NSString* header, NSString* expect
 }
 
 
+- (void)socketDidDisconnect:(GCDAsyncSocket *)sock withError:(NSError *)error {
+    [super socketDidDisconnect: sock withError: error];
+    // Now the listener can let go of me:
+    [_listener incomingDidDisconnect: self];
+}
+
+
 - (NSURL*) URL {
     return $url($sprintf(@"ws://%@:%d/", _asyncSocket.connectedHost, _asyncSocket.connectedPort));
 }
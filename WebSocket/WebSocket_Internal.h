@@ -6,6 +6,8 @@
 //  Copyright (c) 2013 Couchbase. All rights reserved.
 
 #import "WebSocket.h"
+#import "WebSocketFraming.h"
+#import "WebSocketDeflate.h"
 #import "GCDAsyncSocket.h"
 #import "MYLogging.h"
 
@@ -30,16 +32,15 @@ enum {
     // Tags for reads:
     TAG_PREFIX = 300,
     TAG_MSG_PLUS_SUFFIX,
-    TAG_MSG_WITH_LENGTH,
-    TAG_MSG_MASKING_KEY,
-    TAG_PAYLOAD_PREFIX,
-    TAG_PAYLOAD_LENGTH,
-    TAG_PAYLOAD_LENGTH16,
-    TAG_PAYLOAD_LENGTH64,
+    TAG_FRAME_DATA,
 
     // Tags for writes:
     TAG_MESSAGE = 400,
     TAG_STOP,
+    TAG_FRAGMENT,
+    TAG_LAST_FRAGMENT,
+    TAG_FRAME_HEADER,
+    TAG_COALESCED,
 
     // Tags for WebSocketClient initial HTTP handshake:
     TAG_HTTP_REQUEST_HEADERS = 500,
@@ -56,6 +57,7 @@ enum {
 
     NSDictionary* _tlsSettings;
     WebSocketState _state;
+    NSString* _protocol;
 //	BOOL _isStarted;
 //	BOOL _isOpen;
     BOOL _isClient;
@@ -65,6 +67,13 @@ enum {
 
 - (void) start;
 
+/** Runs the block synchronously on the websocketQueue. Unlike dispatch_sync, this is safe to call
+    from another WebSocket's queue that targets the same shared queue. */
+- (void) syncOnWebSocketQueue: (dispatch_block_t)block;
+
 - (void) sendFrame: (NSData*)msgData type: (unsigned)type tag: (long)tag;
 
+/** Starts compressing/decompressing messages, after permessage-deflate has been negotiated. */
+- (void) enableDeflate: (WebSocketDeflateParams)params;
+
 @end